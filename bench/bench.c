@@ -0,0 +1,434 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "editor.h"
+
+/*
+	Replays keystroke scripts against a copy of a corpus file, on a
+	virtual terminal, and reports how long the editor took over them and
+	what it sent to the terminal. After every frame the terminal's grid
+	is checked against what the screen thinks is on it.
+
+	A script has one command per line; blank lines and lines starting
+	with # are skipped:
+		type TEXT		types each byte of TEXT
+		paste COUNT TEXT	pastes COUNT lines of TEXT at once
+		key NAME [COUNT]	presses a key COUNT times (once by default)
+		goto LINE		jumps to line LINE, counting from 1, as ^_ does
+		save			writes the document out to a scratch file
+		burst COMMAND		runs a type, paste, key or goto command with one
+					frame drawn at the end, as the editor does
+					for keys that come in faster than it draws
+	NAME is Enter, Tab, Backspace, Delete, Up, Down, Left, Right, Home,
+	End, PageUp, PageDown, ^X for Ctrl+X, or M-X for Alt+X. Keys that
+	ask a question (^O, ^_) get no answer, since standard input is closed
+*/
+
+typedef struct _bench_key_name {
+	const char *name;
+	InputKey key;
+} BenchKeyName;
+
+static const BenchKeyName BENCH_KEYS[] = {
+	{ "Enter", '\r' }, { "Tab", '\t' }, { "Backspace", 127 }, { "Delete", INPUT_KEY_DEL },
+	{ "Up", INPUT_KEY_UP }, { "Down", INPUT_KEY_DOWN }, { "Left", INPUT_KEY_LEFT }, { "Right", INPUT_KEY_RIGHT },
+	{ "Home", INPUT_KEY_HOME }, { "End", INPUT_KEY_END }, { "PageUp", INPUT_KEY_PAGE_UP }, { "PageDown", INPUT_KEY_PAGE_DOWN }
+};
+
+/*
+	Samples of one quantity, kept so percentiles can be taken at the end
+*/
+typedef struct _bench_samples {
+	uint64_t *values;
+	uint64_t count;
+	uint64_t capacity;
+} BenchSamples;
+
+/*
+	What a run of a script measured. Times are in nanoseconds. stats is
+	what the terminal saw, mismatches the number of frames after which
+	it did not show what the screen meant it to
+*/
+typedef struct _bench_result {
+	BenchSamples latency;
+	BenchSamples frame;
+	VTermStats stats;
+	uint64_t mismatches;
+	uint64_t load_time;
+	uint64_t load_bytes;
+	uint64_t save_time;
+	uint64_t save_bytes;
+	uint64_t saves;
+} BenchResult;
+
+static uint64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static uint8_t bench_samples_add(BenchSamples *samples, const uint64_t value)
+{
+	uint64_t capacity, *tmp;
+
+	if (samples->count == samples->capacity) {
+		capacity = (samples->capacity) ? samples->capacity * 2 : 1024;
+		tmp = (uint64_t *) realloc(samples->values, sizeof(uint64_t) * capacity);
+		if (tmp == NULL)
+			return 1;
+		samples->values = tmp;
+		samples->capacity = capacity;
+	}
+	samples->values[samples->count++] = value;
+	return 0;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+	const uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+	The sample that p percent of them are no larger than; the samples
+	have to be sorted
+*/
+static uint64_t bench_percentile(const BenchSamples *samples, const double p)
+{
+	uint64_t i;
+
+	if (samples->count == 0)
+		return 0;
+	i = (uint64_t) (p / 100.0 * (samples->count - 1) + 0.5);
+	return samples->values[i];
+}
+
+static uint8_t bench_copy(const char *from, const char *to)
+{
+	char block[1 << 16];
+	ssize_t n;
+	int in, out;
+	uint8_t failed = 0;
+
+	in = open(from, O_RDONLY);
+	if (in < 0)
+		return 1;
+	out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (out < 0) {
+		close(in);
+		return 2;
+	}
+	while (!failed && (n = read(in, block, sizeof(block))) > 0)
+		failed = write(out, block, n) != n;
+	close(in);
+	close(out);
+	return failed || n < 0;
+}
+
+/*
+	Turns the name of a key into the key. Returns INPUT_KEY_NONE if
+	there is no such key
+*/
+static InputKey bench_key(const char *name)
+{
+	size_t i;
+
+	if (name[0] == '^' && name[1] != '\0' && name[2] == '\0')
+		return (InputKey) (name[1] & 0x1F);
+	if (name[0] == 'M' && name[1] == '-' && name[2] != '\0' && name[3] == '\0')
+		return INPUT_ALT | (unsigned char) name[2];
+	for (i = 0; i < sizeof(BENCH_KEYS) / sizeof(BenchKeyName); ++i)
+		if (!strcmp(BENCH_KEYS[i].name, name))
+			return BENCH_KEYS[i].key;
+	return INPUT_KEY_NONE;
+}
+
+/*
+	Whether the terminal shows the glyphs the screen last sent it. An
+	empty cell on either side is the same as a blank
+*/
+static uint8_t bench_check(const Screen *screen, const VTerm *vt)
+{
+	const ScreenCell *cell = screen->front;
+	const unsigned char *a, *b;
+	uint16_t row, col;
+
+	for (row = 0; row < screen->max_row; ++row) {
+		for (col = 0; col < screen->max_col; ++col, ++cell) {
+			a = cell->glyph;
+			b = vterm_cell(vt, row, col)->glyph;
+			if (a[0] == '\0')
+				a = (const unsigned char *) " ";
+			if (b[0] == '\0')
+				b = (const unsigned char *) " ";
+			if (strncmp((const char *) a, (const char *) b, SCREEN_GLYPH_MAX))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+	Draws the frame after a key the way the main loop does, recording
+	how long the key took since start and how big the frame came out,
+	given what the terminal had seen before it
+*/
+static void bench_draw(Editor *editor, const VTerm *vt, BenchResult *result, const uint64_t start, const uint64_t bytes)
+{
+	editor_render(editor);
+	screen_flush_out(&editor->screen);
+	bench_samples_add(&result->latency, bench_now() - start);
+	bench_samples_add(&result->frame, vt->stats.bytes - bytes);
+	result->mismatches += bench_check(&editor->screen, vt);
+}
+
+/* Hands a key to the editor, drawing the frame after it if draw is set */
+static void bench_press(Editor *editor, const VTerm *vt, BenchResult *result, const InputKey key, const uint8_t draw)
+{
+	uint64_t start = bench_now(), bytes = vt->stats.bytes;
+
+	editor_input(editor, key);
+	if (draw)
+		bench_draw(editor, vt, result, start, bytes);
+}
+
+/* Pastes text the way a bracketed paste from the terminal is taken in */
+static void bench_paste(Editor *editor, const VTerm *vt, BenchResult *result, const unsigned char *text, const uint64_t len,
+	const uint8_t draw)
+{
+	uint64_t start = bench_now(), bytes = vt->stats.bytes;
+
+	editor_insert_span(editor, text, len);
+	if (draw)
+		bench_draw(editor, vt, result, start, bytes);
+}
+
+/* Jumps to a line as ^_ does, drawing the frame after it if draw is set */
+static void bench_goto(Editor *editor, const VTerm *vt, BenchResult *result, const uint64_t line, const uint8_t draw)
+{
+	uint64_t start = bench_now(), bytes = vt->stats.bytes;
+
+	editor_goto_line(editor, line);
+	if (draw)
+		bench_draw(editor, vt, result, start, bytes);
+}
+
+static uint8_t bench_run(const char *dir, const char *corpus, const char *script, const TtyInfo *geometry,
+	BenchResult *result)
+{
+	char path[4096], saved[4096], journal[4096], *line = NULL, *cmd, *arg, *end, *text;
+	const char *name;
+	size_t size = 0;
+	ssize_t len;
+	uint64_t start, from = 0, bytes = 0, count, i, n, lineno = 0;
+	struct stat st;
+	Editor editor;
+	Terminal term;
+	VTerm vt;
+	InputKey key;
+	FILE *in;
+	uint8_t failed = 0, burst;
+
+	/* The copy keeps the name of the corpus, so it is highlighted the same */
+	name = strrchr(corpus, '/');
+	name = (name != NULL) ? name + 1 : corpus;
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+	snprintf(saved, sizeof(saved), "%s/saved-%s", dir, name);
+	snprintf(journal, sizeof(journal), "%s/%s~", dir, name);
+	if (bench_copy(corpus, path) || stat(path, &st)) {
+		fprintf(stderr, "qwerty-bench: cannot copy %s\n", corpus);
+		return 1;
+	}
+	in = fopen(script, "r");
+	if (in == NULL) {
+		fprintf(stderr, "qwerty-bench: cannot open %s\n", script);
+		return 2;
+	}
+
+	if (vterm_new(&vt, geometry->rows, geometry->cols)) {
+		fclose(in);
+		return 3;
+	}
+	terminal_virtual(&term, &vt);
+
+	start = bench_now();
+	if (editor_init_terminal(&editor, path, &term)) {
+		fprintf(stderr, "qwerty-bench: cannot load %s\n", corpus);
+		fclose(in);
+		vterm_release(&vt);
+		return 3;
+	}
+	result->load_time = bench_now() - start;
+	result->load_bytes = st.st_size;
+
+	editor_render(&editor);
+	screen_flush_out(&editor.screen);
+
+	while (!failed && (len = getline(&line, &size, in)) >= 0) {
+		++lineno;
+		if (len > 0 && line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (len == 0 || line[0] == '#')
+			continue;
+
+		/* A burst is timed from its first key to the one frame after its last */
+		cmd = line;
+		burst = !strncmp(line, "burst ", 6);
+		if (burst) {
+			cmd = line + 6;
+			from = bench_now();
+			bytes = vt.stats.bytes;
+		}
+
+		if (!strncmp(cmd, "type ", 5)) {
+			for (arg = cmd + 5; *arg != '\0'; ++arg)
+				bench_press(&editor, &vt, result, (unsigned char) *arg, !burst);
+		} else if (!strncmp(cmd, "paste ", 6)) {
+			count = strtoull(cmd + 6, &arg, 10);
+			if (*arg != ' ' || count == 0) {
+				fprintf(stderr, "qwerty-bench: %s:%" PRIu64 ": bad paste\n", script, lineno);
+				failed = 4;
+				continue;
+			}
+			n = line + len - ++arg;
+			text = (char *) malloc(count * (n + 1));
+			if (text == NULL) {
+				failed = 4;
+				continue;
+			}
+			for (i = 0; i < count; ++i) {
+				memcpy(text + i * (n + 1), arg, n);
+				text[i * (n + 1) + n] = '\n';
+			}
+			bench_paste(&editor, &vt, result, (const unsigned char *) text, count * (n + 1), !burst);
+			free(text);
+		} else if (!strncmp(cmd, "key ", 4)) {
+			arg = strtok(cmd + 4, " \t");
+			key = (arg != NULL) ? bench_key(arg) : INPUT_KEY_NONE;
+			arg = strtok(NULL, " \t");
+			count = (arg != NULL) ? strtoull(arg, &end, 10) : 1;
+			if (key == INPUT_KEY_NONE || (arg != NULL && *end != '\0')) {
+				fprintf(stderr, "qwerty-bench: %s:%" PRIu64 ": bad key\n", script, lineno);
+				failed = 4;
+			}
+			for (i = 0; !failed && i < count; ++i)
+				bench_press(&editor, &vt, result, key, !burst);
+		} else if (!strncmp(cmd, "goto ", 5)) {
+			count = strtoull(cmd + 5, &end, 10);
+			if (count == 0 || *end != '\0') {
+				fprintf(stderr, "qwerty-bench: %s:%" PRIu64 ": bad line\n", script, lineno);
+				failed = 4;
+				continue;
+			}
+			bench_goto(&editor, &vt, result, count - 1, !burst);
+		} else if (!burst && !strcmp(line, "save")) {
+			start = bench_now();
+			if (editor_flush(&editor, saved)) {
+				fprintf(stderr, "qwerty-bench: %s:%" PRIu64 ": save failed\n", script, lineno);
+				failed = 5;
+			}
+			result->save_time += bench_now() - start;
+			result->save_bytes += document_length(&editor.doc);
+			++result->saves;
+		} else {
+			fprintf(stderr, "qwerty-bench: %s:%" PRIu64 ": unknown command\n", script, lineno);
+			failed = 6;
+		}
+
+		if (burst && !failed)
+			bench_draw(&editor, &vt, result, from, bytes);
+	}
+
+	result->stats = vt.stats;
+	free(line);
+	fclose(in);
+	editor_release(&editor);
+	vterm_release(&vt);
+	unlink(path);
+	unlink(saved);
+	unlink(journal);
+	return failed;
+}
+
+static double bench_rate(const uint64_t bytes, const uint64_t ns)
+{
+	return (ns) ? bytes / (ns / 1e9) / (1024.0 * 1024.0) : 0;
+}
+
+static void bench_report(FILE *out, const char *script, BenchResult *result, const TtyInfo *size)
+{
+	const BenchSamples *lat = &result->latency, *frame = &result->frame;
+	uint64_t i, total = 0;
+
+	qsort(result->latency.values, lat->count, sizeof(uint64_t), bench_compare);
+	qsort(result->frame.values, frame->count, sizeof(uint64_t), bench_compare);
+
+	for (i = 0; i < frame->count; ++i)
+		total += frame->values[i];
+
+	fprintf(out, "%s (%ux%u)\n", script, size->rows, size->cols);
+	fprintf(out, "  load   %10.3f ms  %10.1f MiB/s  (%" PRIu64 " bytes)\n",
+		result->load_time / 1e6, bench_rate(result->load_bytes, result->load_time), result->load_bytes);
+	fprintf(out, "  keys   %10" PRIu64 "     p50 %.1f us  p90 %.1f us  p99 %.1f us  p99.9 %.1f us  max %.1f us\n",
+		lat->count, bench_percentile(lat, 50) / 1e3, bench_percentile(lat, 90) / 1e3,
+		bench_percentile(lat, 99) / 1e3, bench_percentile(lat, 99.9) / 1e3, bench_percentile(lat, 100) / 1e3);
+	fprintf(out, "  frames %10.1f B   p50 %" PRIu64 " B  p99 %" PRIu64 " B  max %" PRIu64 " B  (%" PRIu64 " bytes)\n",
+		(frame->count) ? (double) total / frame->count : 0, bench_percentile(frame, 50),
+		bench_percentile(frame, 99), bench_percentile(frame, 100), total);
+	fprintf(out, "  output %10" PRIu64 " writes  %" PRIu64 " moves  %" PRIu64 " SGR  %" PRIu64 " erases  %" PRIu64 " glyphs\n",
+		result->stats.writes, result->stats.moves, result->stats.sgr, result->stats.erases + result->stats.clears,
+		result->stats.glyphs);
+	fprintf(out, "  check  %10" PRIu64 " of %" PRIu64 " frames differ from the screen\n", result->mismatches, frame->count);
+	if (result->saves)
+		fprintf(out, "  save   %10.3f ms  %10.1f MiB/s  (%" PRIu64 " bytes)\n",
+			result->save_time / 1e6 / result->saves, bench_rate(result->save_bytes, result->save_time),
+			result->save_bytes / result->saves);
+}
+
+int main(int argc, char **argv)
+{
+	char dir[] = "/tmp/qwerty-bench-XXXXXX";
+	BenchResult result;
+	TtyInfo size;
+	int i, fd, failed = 0;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: qwerty-bench corpus script...\n");
+		return 1;
+	}
+
+	/*
+		Nobody answers the editor's questions. The virtual terminal is
+		LINES x COLUMNS, or the default size
+	*/
+	fd = open("/dev/null", O_RDONLY);
+	if (fd < 0 || mkdtemp(dir) == NULL) {
+		fprintf(stderr, "qwerty-bench: cannot set up\n");
+		return 1;
+	}
+	dup2(fd, STDIN_FILENO);
+	close(fd);
+	tty_info_get(&size, -1);
+
+	for (i = 2; i < argc; ++i) {
+		memset(&result, 0, sizeof(result));
+		if (bench_run(dir, argv[1], argv[i], &size, &result))
+			failed = 1;
+		else
+			bench_report(stdout, argv[i], &result, &size);
+		fflush(stdout);
+		free(result.latency.values);
+		free(result.frame.values);
+	}
+
+	rmdir(dir);
+	return failed;
+}
@@ -0,0 +1,254 @@
+#include "backup.h"
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+
+static uint8_t backup_write(const int fd, const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *) data;
+	ssize_t n;
+
+	while (len > 0) {
+		n = write(fd, p, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return 1;
+		}
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/*
+	Writes a new journal to the side and moves it over the old one, so
+	that a crash half way leaves the previous journal in place
+*/
+static uint8_t backup_write_restart(Backup *backup, const JournalHeader *header, const DocumentSnapshot *contents, const Journal *records)
+{
+	JournalRecord record;
+	int fd;
+
+	fd = open(backup->temp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return 1;
+
+	if (backup_write(fd, header, sizeof(JournalHeader)))
+		goto fail;
+	if (contents->spans != NULL) {
+		record.op = JOURNAL_CONTENTS;
+		record.offset = 0;
+		record.length = contents->length;
+		if (backup_write(fd, &record, sizeof(JournalRecord)) || document_snapshot_write(contents, fd))
+			goto fail;
+	}
+	if (backup_write(fd, records->data, records->length) || fdatasync(fd) || rename(backup->temp, backup->path))
+		goto fail;
+
+	if (backup->fd >= 0)
+		close(backup->fd);
+	backup->fd = fd;
+	return 0;
+
+fail:
+	close(fd);
+	return 2;
+}
+
+static uint8_t backup_write_append(Backup *backup, const Journal *records)
+{
+	if (backup->fd < 0) {
+		/* Carry on with a journal left behind by an earlier session */
+		backup->fd = open(backup->path, O_WRONLY | O_APPEND | O_CLOEXEC);
+		if (backup->fd < 0)
+			return 1;
+	}
+
+	if (backup_write(backup->fd, records->data, records->length) || fdatasync(backup->fd))
+		return 2;
+	return 0;
+}
+
+static void *backup_run(void *arg)
+{
+	Backup *backup = (Backup *) arg;
+	DocumentSnapshot contents;
+	JournalHeader header;
+	Journal records, swap;
+	uint64_t one = 1;
+	uint8_t restart, failed;
+
+	journal_new(&records);
+
+	pthread_mutex_lock(&backup->lock);
+	while (1) {
+		while (!backup->has_pending && !backup->quit)
+			pthread_cond_wait(&backup->wake, &backup->lock);
+		if (!backup->has_pending)
+			break;
+
+		/* Take everything queued, leaving our emptied buffer in its place */
+		journal_clear(&records);
+		swap = backup->pending;
+		backup->pending = records;
+		records = swap;
+		restart = backup->restart;
+		header = backup->header;
+		contents = backup->contents;
+		backup->contents.spans = NULL;
+		backup->restart = backup->has_pending = 0;
+		pthread_mutex_unlock(&backup->lock);
+
+		/* The disk is only touched with the lock released */
+		if (restart)
+			failed = backup_write_restart(backup, &header, &contents, &records);
+		else
+			failed = backup_write_append(backup, &records);
+		document_snapshot_release(&contents);
+
+		pthread_mutex_lock(&backup->lock);
+		if (!backup->has_pending)
+			backup->state = (failed) ? BACKUP_FAILED : BACKUP_DONE;
+		if (!failed)
+			backup->last = time(NULL);
+		if (write(backup->notify, &one, sizeof(one)) < 0) {
+			/* Only the status line misses out */
+		}
+	}
+	pthread_mutex_unlock(&backup->lock);
+
+	journal_release(&records);
+	return NULL;
+}
+
+uint8_t backup_init(Backup *backup, const char *path)
+{
+	sigset_t all, saved;
+	int failed;
+
+	if (backup == NULL)
+		return 1;
+
+	memset(backup, 0, sizeof(Backup));
+	backup->path = path;
+	backup->fd = -1;
+	backup->state = BACKUP_IDLE;
+	journal_new(&backup->pending);
+
+	backup->temp = (char *) malloc(sizeof(char) * (strlen(path) + 5));
+	if (backup->temp == NULL)
+		return 2;
+	strcpy(backup->temp, path);
+	strcat(backup->temp, ".tmp");
+
+	backup->notify = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (backup->notify < 0) {
+		free(backup->temp);
+		return 3;
+	}
+
+	pthread_mutex_init(&backup->lock, NULL);
+	pthread_cond_init(&backup->wake, NULL);
+
+	/*
+		The thread starts with every signal blocked, so that signals keep
+		going to the main loop's signalfd and never to this thread
+	*/
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &saved);
+	failed = pthread_create(&backup->thread, NULL, backup_run, backup);
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	if (failed) {
+		close(backup->notify);
+		backup->notify = -1;
+		free(backup->temp);
+		return 4;
+	}
+
+	return 0;
+}
+
+uint8_t backup_append(Backup *backup, Journal *journal)
+{
+	Journal swap;
+
+	if (journal->length == 0)
+		return 0;
+
+	pthread_mutex_lock(&backup->lock);
+	if (backup->pending.length == 0) {
+		swap = backup->pending;
+		backup->pending = *journal;
+		*journal = swap;
+	} else if (journal_append(&backup->pending, journal)) {
+		/* Keep the records where they are and try again next time */
+		pthread_mutex_unlock(&backup->lock);
+		return 1;
+	}
+	backup->state = BACKUP_RUNNING;
+	backup->has_pending = 1;
+	pthread_cond_signal(&backup->wake);
+	pthread_mutex_unlock(&backup->lock);
+
+	journal_clear(journal);
+	return 0;
+}
+
+void backup_restart(Backup *backup, const JournalHeader *header, DocumentSnapshot *snap)
+{
+	pthread_mutex_lock(&backup->lock);
+	journal_clear(&backup->pending);
+	document_snapshot_release(&backup->contents);
+	if (snap != NULL) {
+		backup->contents = *snap;
+		snap->spans = NULL;
+		snap->count = snap->length = 0;
+	}
+	backup->header = *header;
+	backup->restart = backup->has_pending = 1;
+	backup->state = BACKUP_RUNNING;
+	pthread_cond_signal(&backup->wake);
+	pthread_mutex_unlock(&backup->lock);
+}
+
+BackupState backup_status(Backup *backup, time_t *last)
+{
+	BackupState state;
+
+	pthread_mutex_lock(&backup->lock);
+	state = backup->state;
+	if (last != NULL)
+		*last = backup->last;
+	pthread_mutex_unlock(&backup->lock);
+
+	return state;
+}
+
+void backup_release(Backup *backup)
+{
+	if (backup == NULL || backup->notify < 0)
+		return;
+
+	pthread_mutex_lock(&backup->lock);
+	backup->quit = 1;
+	pthread_cond_signal(&backup->wake);
+	pthread_mutex_unlock(&backup->lock);
+
+	/* Whatever is still pending gets written before the thread stops */
+	pthread_join(backup->thread, NULL);
+	pthread_cond_destroy(&backup->wake);
+	pthread_mutex_destroy(&backup->lock);
+	journal_release(&backup->pending);
+	document_snapshot_release(&backup->contents);
+	if (backup->fd >= 0)
+		close(backup->fd);
+	close(backup->notify);
+	backup->notify = -1;
+	free(backup->temp);
+}
@@ -0,0 +1,74 @@
+#ifndef _BACKUP_H_INCLUDED
+#define _BACKUP_H_INCLUDED
+
+#include "document.h"
+#include "journal.h"
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+/**
+ *	States a backup can be in
+ *		1. BACKUP_IDLE - nothing has been backed up yet
+ *		2. BACKUP_RUNNING - records are waiting or being written
+ *		3. BACKUP_DONE - the last records made it to disk
+ *		4. BACKUP_FAILED - the last records could not be written
+ */
+typedef enum _backup_state {
+	BACKUP_IDLE, BACKUP_RUNNING, BACKUP_DONE, BACKUP_FAILED
+} BackupState;
+
+/**
+ *	Keeps the journal file at path up to date from a thread of its own,
+ *	so that the editor never waits on the disk. Records handed over are
+ *	appended to the journal; a restart replaces the journal with a new
+ *	one, made of header, the whole text in contents (if it has any
+ *	spans) and whatever records follow. notify is an eventfd that
+ *	becomes readable whenever a write finishes
+ */
+typedef struct _backup {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	Journal pending;
+	DocumentSnapshot contents;
+	JournalHeader header;
+	uint8_t restart;
+	uint8_t has_pending;
+	uint8_t quit;
+	const char *path;
+	char *temp;
+	int fd;
+	BackupState state;
+	time_t last;
+	int notify;
+} Backup;
+
+/**
+ *	Start the backup thread, keeping the journal at path
+ */
+extern uint8_t backup_init(Backup *backup, const char *path);
+
+/**
+ *	Queue the records in journal to be appended, and empty it
+ */
+extern uint8_t backup_append(Backup *backup, Journal *journal);
+
+/**
+ *	Queue a new journal, starting with header and, if snap is not NULL,
+ *	the text in it. The backup thread owns snap from then on. Records
+ *	queued before this are dropped
+ */
+extern void backup_restart(Backup *backup, const JournalHeader *header, DocumentSnapshot *snap);
+
+/**
+ *	Get the state of the latest backup and when the last one completed
+ */
+extern BackupState backup_status(Backup *backup, time_t *last);
+
+/**
+ *	Wait for the backup thread to finish what it is writing and stop it
+ */
+extern void backup_release(Backup *backup);
+
+#endif /* _BACKUP_H_INCLUDED */
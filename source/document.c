@@ -0,0 +1,1021 @@
+#include "document.h"
+#include "journal.h"
+#include "undo.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <signal.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static uint64_t document_count_lines(const unsigned char *data, uint64_t len)
+{
+	uint64_t i = 0, ret = 0;
+#ifdef __SSE2__
+	/*
+		Compare 16 bytes at a time against '\n'. Matches come out as 0xFF,
+		so subtracting them bumps per-byte counters; those are folded into
+		the total before they can overflow, every 255 rounds
+	*/
+	const __m128i nl = _mm_set1_epi8('\n');
+	const __m128i zero = _mm_setzero_si128();
+	__m128i acc, sum;
+	uint64_t rounds;
+
+	while (i + 16 <= len) {
+		acc = zero;
+		for (rounds = 0; rounds < 255 && i + 16 <= len; ++rounds, i += 16)
+			acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *) (data + i)), nl));
+		sum = _mm_sad_epu8(acc, zero);
+		ret += (uint64_t) _mm_cvtsi128_si32(sum) + (uint64_t) _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+	}
+#endif
+	for (; i < len; ++i)
+		ret += (data[i] == '\n');
+
+	return ret;
+}
+
+/*
+	Number of bytes of the original buffer in page
+*/
+static uint64_t document_page_length(const Document *doc, const uint64_t page)
+{
+	uint64_t start = page * DOCUMENT_PAGE_SIZE;
+	return (doc->original_length - start < DOCUMENT_PAGE_SIZE) ? doc->original_length - start : DOCUMENT_PAGE_SIZE;
+}
+
+/*
+	Marks the pages of the original buffer that hold [start, start + len)
+	as used, handing the one used longest ago back to the kernel if that
+	makes too many of them resident. Does nothing outside large-file mode
+*/
+static void document_page_in(const Document *doc, const uint64_t start, const uint64_t len)
+{
+	DocumentPager *pager = doc->pager;
+	uint64_t page, last, i, victim;
+
+	if (pager == NULL || len == 0)
+		return;
+
+	last = (start + len - 1) / DOCUMENT_PAGE_SIZE;
+	for (page = start / DOCUMENT_PAGE_SIZE; page <= last; ++page) {
+		if (pager->resident && pager->lru[0] == page)
+			continue;
+		for (i = 0; i < pager->resident && pager->lru[i] != page; ++i);
+		if (i == pager->resident) {
+			if (pager->resident == DOCUMENT_PAGES_MAX) {
+				victim = pager->lru[--i];
+				madvise(doc->original + victim * DOCUMENT_PAGE_SIZE, document_page_length(doc, victim), MADV_DONTNEED);
+			} else {
+				++pager->resident;
+			}
+		}
+		memmove(pager->lru + 1, pager->lru, sizeof(uint64_t) * i);
+		pager->lru[0] = page;
+	}
+}
+
+/*
+	Marks len bytes from offset k of a piece as used, if they are in
+	the original buffer
+*/
+static void document_piece_in(const Document *doc, const DocumentPiece *piece, const uint64_t k, const uint64_t len)
+{
+	if (piece->source == DOCUMENT_ORIGINAL)
+		document_page_in(doc, piece->start + k, len);
+}
+
+static const unsigned char *document_piece_data(const Document *doc, const DocumentPiece *piece)
+{
+	if (piece->source == DOCUMENT_ORIGINAL)
+		return doc->original + piece->start;
+	return doc->add[piece->start / DOCUMENT_PIECE_MAX] + piece->start % DOCUMENT_PIECE_MAX;
+}
+
+static uint64_t document_node_length(const DocumentNode *node)
+{
+	return (node != NULL) ? node->length : 0;
+}
+
+static uint64_t document_node_lines(const DocumentNode *node)
+{
+	return (node != NULL) ? node->lines : 0;
+}
+
+static void document_node_update(DocumentNode *node)
+{
+	node->length = document_node_length(node->left) + node->piece.length + document_node_length(node->right);
+	node->lines = document_node_lines(node->left) + node->piece.lines + document_node_lines(node->right);
+}
+
+static DocumentNode *document_node_new(Document *doc, const DocumentSource source, const uint64_t start, const uint64_t length, const uint64_t lines)
+{
+	DocumentNode *node = (DocumentNode *) pool_alloc(&doc->nodes);
+
+	if (node == NULL)
+		return NULL;
+
+	/* xorshift32, only needs to be cheap and well spread */
+	doc->seed ^= doc->seed << 13;
+	doc->seed ^= doc->seed >> 17;
+	doc->seed ^= doc->seed << 5;
+
+	node->piece.source = source;
+	node->piece.start = start;
+	node->piece.length = length;
+	node->piece.lines = lines;
+	node->priority = doc->seed;
+	node->left = node->right = NULL;
+	document_node_update(node);
+	++doc->piece_count;
+
+	return node;
+}
+
+static void document_node_release(Document *doc, DocumentNode *node)
+{
+	if (node == NULL)
+		return;
+	document_node_release(doc, node->left);
+	document_node_release(doc, node->right);
+	pool_free(&doc->nodes, node);
+	--doc->piece_count;
+}
+
+/*
+	Joins two trees, every piece of a coming before every piece of b
+*/
+static DocumentNode *document_node_merge(DocumentNode *a, DocumentNode *b)
+{
+	if (a == NULL)
+		return b;
+	if (b == NULL)
+		return a;
+
+	if (a->priority > b->priority) {
+		a->right = document_node_merge(a->right, b);
+		document_node_update(a);
+		return a;
+	}
+
+	b->left = document_node_merge(a, b->left);
+	document_node_update(b);
+	return b;
+}
+
+/*
+	Splits a tree so that l holds the first offset bytes and r the rest.
+	A piece straddling offset is cut in two
+*/
+static uint8_t document_node_split(Document *doc, DocumentNode *node, const uint64_t offset, DocumentNode **l, DocumentNode **r)
+{
+	uint64_t left, k, lines;
+	uint8_t ret;
+	DocumentNode *tail;
+
+	if (node == NULL) {
+		*l = *r = NULL;
+		return 0;
+	}
+
+	left = document_node_length(node->left);
+	if (offset <= left) {
+		ret = document_node_split(doc, node->left, offset, l, &node->left);
+		document_node_update(node);
+		*r = node;
+		return ret;
+	}
+
+	if (offset >= left + node->piece.length) {
+		ret = document_node_split(doc, node->right, offset - left - node->piece.length, &node->right, r);
+		document_node_update(node);
+		*l = node;
+		return ret;
+	}
+
+	k = offset - left;
+	document_piece_in(doc, &node->piece, 0, k);
+	lines = document_count_lines(document_piece_data(doc, &node->piece), k);
+	tail = document_node_new(doc, node->piece.source, node->piece.start + k, node->piece.length - k, node->piece.lines - lines);
+	if (tail == NULL) {
+		*l = node;
+		*r = NULL;
+		return 1;
+	}
+
+	node->piece.length = k;
+	node->piece.lines = lines;
+	*r = document_node_merge(tail, node->right);
+	node->right = NULL;
+	document_node_update(node);
+	*l = node;
+
+	return 0;
+}
+
+/*
+	Finds the node holding the byte at offset. piece_offset receives the
+	position of that byte inside the piece. Returns NULL past the end
+*/
+static DocumentNode *document_find(const Document *doc, uint64_t offset, uint64_t *piece_offset)
+{
+	DocumentNode *node = doc->root;
+	uint64_t left;
+
+	while (node != NULL) {
+		left = document_node_length(node->left);
+		if (offset < left) {
+			node = node->left;
+		} else if (offset - left < node->piece.length) {
+			*piece_offset = offset - left;
+			return node;
+		} else {
+			offset -= left + node->piece.length;
+			node = node->right;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+	Stretches the piece that ends at offset by len bytes, fixing up the
+	counts of every subtree on the way down to it
+*/
+static void document_node_extend(DocumentNode *node, uint64_t offset, const uint64_t len, const uint64_t lines)
+{
+	uint64_t left;
+
+	while (node != NULL) {
+		node->length += len;
+		node->lines += lines;
+
+		left = document_node_length(node->left);
+		if (offset <= left) {
+			node = node->left;
+		} else if (offset == left + node->piece.length) {
+			node->piece.length += len;
+			node->piece.lines += lines;
+			return;
+		} else {
+			offset -= left + node->piece.length;
+			node = node->right;
+		}
+	}
+}
+
+/*
+	Copies len bytes (at most one block's worth) to the end of the add
+	buffer and stores where they landed in start. The add buffer is a
+	list of fixed-size blocks that are never moved or freed before the
+	document is, so pointers into it stay valid; a span that does not fit
+	in what is left of the current block starts a new one
+*/
+static uint8_t document_append_add(Document *doc, const unsigned char *str, const uint64_t len, uint64_t *start)
+{
+	uint64_t block, capacity;
+	unsigned char **tmp;
+
+	if (doc->add_length % DOCUMENT_PIECE_MAX + len > DOCUMENT_PIECE_MAX)
+		doc->add_length += DOCUMENT_PIECE_MAX - doc->add_length % DOCUMENT_PIECE_MAX;
+
+	block = doc->add_length / DOCUMENT_PIECE_MAX;
+	if (block >= doc->add_blocks) {
+		if (doc->add_blocks >= doc->add_capacity) {
+			capacity = (doc->add_capacity) ? doc->add_capacity * 2 : 16;
+			tmp = (unsigned char **) realloc(doc->add, sizeof(unsigned char *) * capacity);
+			if (tmp == NULL)
+				return 1;
+			doc->add = tmp;
+			doc->add_capacity = capacity;
+		}
+
+		doc->add[block] = (unsigned char *) pool_alloc(&doc->text);
+		if (doc->add[block] == NULL)
+			return 2;
+		++doc->add_blocks;
+	}
+
+	memcpy(doc->add[block] + doc->add_length % DOCUMENT_PIECE_MAX, str, len);
+	*start = doc->add_length;
+	doc->add_length += len;
+	return 0;
+}
+
+uint8_t document_new(Document *doc)
+{
+	if (doc == NULL)
+		return 1;
+
+	memset(doc, 0, sizeof(Document));
+	doc->seed = 2463534242u;
+	pool_init(&doc->nodes, sizeof(DocumentNode), DOCUMENT_NODES_PER_SLAB);
+	pool_init(&doc->text, DOCUMENT_PIECE_MAX, DOCUMENT_BLOCKS_PER_SLAB);
+	return 0;
+}
+
+/*
+	Counts the newlines in every page of the original buffer, reading the
+	file rather than the mapping so that none of it becomes resident
+*/
+static void *document_indexer_run(void *arg)
+{
+	DocumentPager *pager = (DocumentPager *) arg;
+	unsigned char *buf;
+	uint64_t page;
+	size_t done;
+	ssize_t n = 0;
+
+	buf = (unsigned char *) malloc(DOCUMENT_PAGE_SIZE);
+	if (buf == NULL)
+		return NULL;
+
+	for (page = 0; page < pager->pages && !__atomic_load_n(&pager->quit, __ATOMIC_RELAXED); ++page) {
+		for (done = 0; done < DOCUMENT_PAGE_SIZE; done += n) {
+			n = pread(pager->fd, buf + done, DOCUMENT_PAGE_SIZE - done, page * DOCUMENT_PAGE_SIZE + done);
+			if (n < 0 && errno == EINTR)
+				n = 0;
+			else if (n <= 0)
+				break;
+		}
+		/* Only the last page may come up short */
+		if (n < 0 || (done < DOCUMENT_PAGE_SIZE && page + 1 < pager->pages))
+			break;
+
+		pager->lines[page] = document_count_lines(buf, done);
+		__atomic_store_n(&pager->counted, page + 1, __ATOMIC_RELEASE);
+	}
+
+	free(buf);
+	return NULL;
+}
+
+/*
+	The original buffers that are mapped, so that a SIGBUS in one of them
+	can be told from any other. lost is set once part of the file behind
+	one went away. Slots are taken by setting start last and given back
+	by clearing it first, as the handler may look at them from anywhere
+*/
+static struct {
+	uintptr_t start;
+	uintptr_t end;
+	volatile sig_atomic_t lost;
+} document_maps[DOCUMENT_MAPS_MAX];
+static uintptr_t document_page_mask;
+
+/*
+	A read of the mapping past the end of the file, which another process
+	cut short after it was mapped (log rotation with copytruncate, say),
+	raises SIGBUS. Pages of zeros are mapped over everything from there to
+	the end of the buffer, so the read goes through, and what was lost
+	reads as NUL bytes. Any other SIGBUS kills the process as it would have
+*/
+static void document_sigbus(int sig, siginfo_t *info, void *ctx)
+{
+	uintptr_t addr = (uintptr_t) info->si_addr, start, end, page;
+	size_t i;
+
+	for (i = 0; i < DOCUMENT_MAPS_MAX; ++i) {
+		start = __atomic_load_n(&document_maps[i].start, __ATOMIC_ACQUIRE);
+		end = document_maps[i].end;
+		if (start == 0 || addr < start || addr >= end)
+			continue;
+		page = addr & document_page_mask;
+		if (mmap((void *) page, end - page, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) != MAP_FAILED) {
+			document_maps[i].lost = 1;
+			return;
+		}
+		break;
+	}
+	signal(sig, SIG_DFL);
+}
+
+/*
+	Guards the document's original buffer against the file being cut
+	short under it. Without a free slot, the buffer goes unguarded
+*/
+static void document_guard(const Document *doc)
+{
+	static uint8_t installed = 0;
+	struct sigaction act;
+	size_t i;
+
+	if (!installed) {
+		document_page_mask = ~((uintptr_t) sysconf(_SC_PAGESIZE) - 1);
+		memset(&act, 0, sizeof(act));
+		act.sa_sigaction = document_sigbus;
+		act.sa_flags = SA_SIGINFO;
+		sigemptyset(&act.sa_mask);
+		if (sigaction(SIGBUS, &act, NULL))
+			return;
+		installed = 1;
+	}
+
+	for (i = 0; i < DOCUMENT_MAPS_MAX; ++i) {
+		if (document_maps[i].start == 0) {
+			document_maps[i].end = (uintptr_t) doc->original + doc->original_length;
+			document_maps[i].lost = 0;
+			__atomic_store_n(&document_maps[i].start, (uintptr_t) doc->original, __ATOMIC_RELEASE);
+			return;
+		}
+	}
+}
+
+/*
+	Finds the slot guarding the document's original buffer. Returns
+	DOCUMENT_MAPS_MAX if it has none
+*/
+static size_t document_guard_slot(const Document *doc)
+{
+	size_t i;
+
+	for (i = 0; i < DOCUMENT_MAPS_MAX; ++i) {
+		if (doc->original != NULL && document_maps[i].start == (uintptr_t) doc->original)
+			break;
+	}
+	return i;
+}
+
+/*
+	Switches the document to large-file mode, starting the indexer
+*/
+static uint8_t document_pager_new(Document *doc, const int fd)
+{
+	DocumentPager *pager;
+	sigset_t all, saved;
+	int failed;
+
+	pager = (DocumentPager *) calloc(1, sizeof(DocumentPager));
+	if (pager == NULL)
+		return 1;
+	pager->pages = (doc->original_length + DOCUMENT_PAGE_SIZE - 1) / DOCUMENT_PAGE_SIZE;
+	pager->lines = (uint32_t *) malloc(sizeof(uint32_t) * pager->pages);
+	pager->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	doc->pager = pager;
+	if (pager->lines == NULL || pager->fd < 0) {
+		/* Paging still works, every page just gets counted when it is reached */
+		if (pager->fd >= 0)
+			close(pager->fd);
+		pager->fd = -1;
+		return 0;
+	}
+
+	/* Signals keep going to the main loop, as with the backup thread */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &saved);
+	failed = pthread_create(&pager->indexer, NULL, document_indexer_run, pager);
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	if (failed) {
+		close(pager->fd);
+		pager->fd = -1;
+	}
+	return 0;
+}
+
+static void document_pager_release(DocumentPager *pager)
+{
+	if (pager == NULL)
+		return;
+	if (pager->fd >= 0) {
+		__atomic_store_n(&pager->quit, 1, __ATOMIC_RELAXED);
+		pthread_join(pager->indexer, NULL);
+		close(pager->fd);
+	}
+	free(pager->lines);
+	free(pager);
+}
+
+uint8_t document_load(Document *doc, const int fd)
+{
+	struct stat st;
+	void *data;
+	uint8_t large;
+
+	if (doc == NULL || fd < 0)
+		return 1;
+	if (fstat(fd, &st))
+		return 2;
+	if (st.st_size == 0)
+		return 0;
+
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED)
+		return 3;
+	large = (uint64_t) st.st_size >= DOCUMENT_LARGE_SIZE;
+	madvise(data, st.st_size, (large) ? MADV_RANDOM : MADV_SEQUENTIAL);
+
+	doc->original = (unsigned char *) data;
+	doc->original_length = st.st_size;
+	doc->indexed = 0;
+	document_guard(doc);
+
+	if (large && document_pager_new(doc, fd))
+		return 4;
+	return 0;
+}
+
+/*
+	Turns the next chunks of the original buffer into pieces until the
+	tree holds at least `lines` newlines and more than `offset` bytes, or
+	the whole file has been taken in. Nothing past what is asked for gets
+	scanned, which is what keeps opening a file independent of its size
+*/
+static uint8_t document_index(Document *doc, const uint64_t lines, const uint64_t offset)
+{
+	uint64_t len, max = (doc->pager != NULL) ? DOCUMENT_PAGE_SIZE : DOCUMENT_PIECE_MAX, count, page;
+	DocumentNode *node;
+
+	while (doc->indexed < doc->original_length
+		&& (document_node_lines(doc->root) < lines || document_node_length(doc->root) <= offset)) {
+		len = doc->original_length - doc->indexed;
+		if (len > max)
+			len = max;
+
+		/* A page the indexer got through already is not read again */
+		page = doc->indexed / DOCUMENT_PAGE_SIZE;
+		if (doc->pager != NULL && page < __atomic_load_n(&doc->pager->counted, __ATOMIC_ACQUIRE)) {
+			count = doc->pager->lines[page];
+		} else {
+			document_page_in(doc, doc->indexed, len);
+			count = document_count_lines(doc->original + doc->indexed, len);
+		}
+
+		node = document_node_new(doc, DOCUMENT_ORIGINAL, doc->indexed, len, count);
+		if (node == NULL)
+			return 1;
+		doc->root = document_node_merge(doc->root, node);
+		doc->indexed += len;
+	}
+
+	return 0;
+}
+
+void document_release(Document *doc)
+{
+	size_t slot;
+
+	if (doc == NULL)
+		return;
+	document_pager_release(doc->pager);
+	slot = document_guard_slot(doc);
+	if (slot < DOCUMENT_MAPS_MAX)
+		__atomic_store_n(&document_maps[slot].start, 0, __ATOMIC_RELEASE);
+	if (doc->original != NULL)
+		munmap(doc->original, doc->original_length);
+	if (doc->add != NULL)
+		free(doc->add);
+
+	/* Every node and block goes at once, a slab at a time */
+	pool_release(&doc->nodes);
+	pool_release(&doc->text);
+	memset(doc, 0, sizeof(Document));
+}
+
+uint8_t document_lost(const Document *doc)
+{
+	size_t slot = document_guard_slot(doc);
+	return slot < DOCUMENT_MAPS_MAX && document_maps[slot].lost;
+}
+
+uint64_t document_length(const Document *doc)
+{
+	return document_node_length(doc->root) + doc->original_length - doc->indexed;
+}
+
+uint64_t document_line_count(Document *doc)
+{
+	document_index(doc, UINT64_MAX, 0);
+	return document_node_lines(doc->root) + 1;
+}
+
+uint8_t document_has_line(Document *doc, const uint64_t line)
+{
+	document_index(doc, line, 0);
+	return line <= document_node_lines(doc->root);
+}
+
+uint64_t document_line_offset(Document *doc, const uint64_t line)
+{
+	DocumentNode *node = doc->root;
+	uint64_t offset = 0, remaining = line, left;
+	const unsigned char *data, *nl;
+
+	if (line == 0)
+		return 0;
+	document_index(doc, line, 0);
+	if (line > document_node_lines(doc->root))
+		return document_node_length(doc->root);
+
+	/* Line n starts right after the n'th newline */
+	while (node != NULL) {
+		left = document_node_lines(node->left);
+		if (remaining <= left) {
+			node = node->left;
+			continue;
+		}
+
+		remaining -= left;
+		offset += document_node_length(node->left);
+		if (remaining <= node->piece.lines)
+			break;
+
+		remaining -= node->piece.lines;
+		offset += node->piece.length;
+		node = node->right;
+	}
+
+	document_piece_in(doc, &node->piece, 0, node->piece.length);
+	data = document_piece_data(doc, &node->piece);
+	for (nl = data - 1; nl != NULL && remaining--; )
+		nl = memchr(nl + 1, '\n', data + node->piece.length - nl - 1);
+
+	/* Newlines counted in text that has been lost since put the line at the piece's end */
+	if (nl == NULL)
+		return offset + node->piece.length;
+	return offset + (nl + 1 - data);
+}
+
+uint64_t document_line_at(Document *doc, const uint64_t offset)
+{
+	DocumentNode *node;
+	uint64_t ret = 0, remaining = offset, left;
+
+	document_index(doc, 0, offset);
+	node = doc->root;
+
+	while (node != NULL) {
+		left = document_node_length(node->left);
+		if (remaining < left) {
+			node = node->left;
+		} else if (remaining - left < node->piece.length) {
+			document_piece_in(doc, &node->piece, 0, remaining - left);
+			return ret + document_node_lines(node->left)
+				+ document_count_lines(document_piece_data(doc, &node->piece), remaining - left);
+		} else {
+			remaining -= left + node->piece.length;
+			ret += document_node_lines(node->left) + node->piece.lines;
+			node = node->right;
+		}
+	}
+
+	return ret;
+}
+
+uint64_t document_line_length(Document *doc, const uint64_t line)
+{
+	uint64_t start = document_line_offset(doc, line), next;
+
+	if (!document_has_line(doc, line + 1))
+		return document_length(doc) - start;
+	next = document_line_offset(doc, line + 1);
+	return (next > start) ? next - start - 1 : 0;
+}
+
+uint64_t document_chunk(const Document *doc, const uint64_t offset, const unsigned char **data)
+{
+	uint64_t k, n, indexed = document_node_length(doc->root);
+	DocumentNode *node;
+
+	/*
+		Past the tree lies the part of the file that was not indexed yet.
+		In large-file mode the run stops at the end of its page, so that
+		every page it covers has been charged to the pager
+	*/
+	if (offset >= indexed) {
+		k = doc->indexed + offset - indexed;
+		*data = doc->original + k;
+		if (k >= doc->original_length)
+			return 0;
+		n = doc->original_length - k;
+		if (doc->pager != NULL && n > DOCUMENT_PAGE_SIZE - k % DOCUMENT_PAGE_SIZE)
+			n = DOCUMENT_PAGE_SIZE - k % DOCUMENT_PAGE_SIZE;
+		document_page_in(doc, k, n);
+		return n;
+	}
+
+	node = document_find(doc, offset, &k);
+
+	document_piece_in(doc, &node->piece, k, node->piece.length - k);
+	*data = document_piece_data(doc, &node->piece) + k;
+	return node->piece.length - k;
+}
+
+uint64_t document_read(const Document *doc, const uint64_t offset, unsigned char *dst, const uint64_t len)
+{
+	uint64_t n, ret = 0;
+	const unsigned char *data;
+
+	while (ret < len && (n = document_chunk(doc, offset + ret, &data)) > 0) {
+		if (n > len - ret)
+			n = len - ret;
+		memcpy(dst + ret, data, n);
+		ret += n;
+	}
+
+	return ret;
+}
+
+uint8_t document_insert(Document *doc, const uint64_t offset, const unsigned char *str, const uint64_t len)
+{
+	uint64_t n, done, start;
+	DocumentNode *l, *r, *node;
+
+	if (doc == NULL || offset > document_length(doc))
+		return 1;
+	if (len == 0)
+		return 0;
+	if (document_index(doc, 0, offset))
+		return 1;
+
+	/*
+		Typing usually lands right after the previous insertion, in which
+		case the piece holding it can simply be stretched
+	*/
+	if (offset > 0 && (node = document_find(doc, offset - 1, &n)) != NULL && n + 1 == node->piece.length
+		&& node->piece.source == DOCUMENT_ADD && node->piece.start + node->piece.length == doc->add_length
+		&& doc->add_length % DOCUMENT_PIECE_MAX != 0 && doc->add_length % DOCUMENT_PIECE_MAX + len <= DOCUMENT_PIECE_MAX) {
+		if (document_append_add(doc, str, len, &start))
+			return 2;
+		document_node_extend(doc->root, offset, len, document_count_lines(str, len));
+		++doc->revision;
+		if (doc->journal != NULL)
+			journal_record(doc->journal, JOURNAL_INSERT, offset, str, len);
+		if (doc->undo != NULL)
+			undo_insert(doc->undo, offset, str, len);
+		return 0;
+	}
+
+	if (document_node_split(doc, doc->root, offset, &l, &r)) {
+		doc->root = document_node_merge(l, r);
+		return 3;
+	}
+
+	for (done = 0; done < len; done += n) {
+		n = len - done;
+		if (n > DOCUMENT_PIECE_MAX)
+			n = DOCUMENT_PIECE_MAX;
+
+		node = NULL;
+		if (document_append_add(doc, str + done, n, &start)
+			|| (node = document_node_new(doc, DOCUMENT_ADD, start, n, document_count_lines(str + done, n))) == NULL) {
+			/* What went in before running out stays in, and is recorded as such */
+			doc->root = document_node_merge(l, r);
+			++doc->revision;
+			if (doc->journal != NULL && done > 0)
+				journal_record(doc->journal, JOURNAL_INSERT, offset, str, done);
+			if (doc->undo != NULL)
+				undo_insert(doc->undo, offset, str, done);
+			return 4;
+		}
+		l = document_node_merge(l, node);
+	}
+
+	doc->root = document_node_merge(l, r);
+	++doc->revision;
+	if (doc->journal != NULL)
+		journal_record(doc->journal, JOURNAL_INSERT, offset, str, len);
+	if (doc->undo != NULL)
+		undo_insert(doc->undo, offset, str, len);
+	return 0;
+}
+
+/*
+	Copies the text of the subtree rooted at node to dst, returning how
+	many bytes that was
+*/
+static uint64_t document_node_copy(const Document *doc, const DocumentNode *node, unsigned char *dst)
+{
+	uint64_t n;
+
+	if (node == NULL)
+		return 0;
+	n = document_node_copy(doc, node->left, dst);
+	document_piece_in(doc, &node->piece, 0, node->piece.length);
+	memcpy(dst + n, document_piece_data(doc, &node->piece), node->piece.length);
+	n += node->piece.length;
+	return n + document_node_copy(doc, node->right, dst + n);
+}
+
+uint8_t document_delete(Document *doc, const uint64_t offset, const uint64_t len)
+{
+	DocumentNode *l, *m, *r;
+	unsigned char *dst;
+
+	if (doc == NULL || offset + len > document_length(doc))
+		return 1;
+	if (len == 0)
+		return 0;
+	if (document_index(doc, 0, offset + len))
+		return 1;
+
+	if (document_node_split(doc, doc->root, offset, &l, &r)) {
+		doc->root = document_node_merge(l, r);
+		return 2;
+	}
+	if (document_node_split(doc, r, len, &m, &r)) {
+		doc->root = document_node_merge(l, document_node_merge(m, r));
+		return 3;
+	}
+
+	/* The text has to be kept before it is gone */
+	if (doc->undo != NULL && (dst = undo_delete(doc->undo, offset, len)) != NULL)
+		document_node_copy(doc, m, dst);
+	document_node_release(doc, m);
+	doc->root = document_node_merge(l, r);
+	++doc->revision;
+	if (doc->journal != NULL)
+		journal_record(doc->journal, JOURNAL_DELETE, offset, NULL, len);
+	return 0;
+}
+
+static void document_node_write(const Document *doc, const DocumentNode *node, FILE *sink)
+{
+	if (node == NULL)
+		return;
+	document_node_write(doc, node->left, sink);
+	fwrite(document_piece_data(doc, &node->piece), sizeof(unsigned char), node->piece.length, sink);
+	document_node_write(doc, node->right, sink);
+}
+
+void document_write(const Document *doc, FILE *sink)
+{
+	document_node_write(doc, doc->root, sink);
+	fwrite(doc->original + doc->indexed, sizeof(unsigned char), doc->original_length - doc->indexed, sink);
+}
+
+static void document_node_collect(const Document *doc, const DocumentNode *node, DocumentSnapshot *snap)
+{
+	if (node == NULL)
+		return;
+	document_node_collect(doc, node->left, snap);
+	snap->spans[snap->count].data = document_piece_data(doc, &node->piece);
+	snap->spans[snap->count].length = node->piece.length;
+	++snap->count;
+	document_node_collect(doc, node->right, snap);
+}
+
+uint8_t document_snapshot(const Document *doc, DocumentSnapshot *snap)
+{
+	snap->count = 0;
+	snap->length = document_length(doc);
+	snap->revision = doc->revision;
+	snap->paged = (doc->pager != NULL) ? doc->original : NULL;
+	snap->paged_length = (doc->pager != NULL) ? doc->original_length : 0;
+	snap->spans = (DocumentSpan *) malloc(sizeof(DocumentSpan) * (doc->piece_count + 1));
+	if (snap->spans == NULL)
+		return 1;
+
+	document_node_collect(doc, doc->root, snap);
+	if (doc->indexed < doc->original_length) {
+		snap->spans[snap->count].data = doc->original + doc->indexed;
+		snap->spans[snap->count].length = doc->original_length - doc->indexed;
+		++snap->count;
+	}
+
+	return 0;
+}
+
+void document_snapshot_release(DocumentSnapshot *snap)
+{
+	if (snap->spans != NULL)
+		free(snap->spans);
+	snap->spans = NULL;
+	snap->count = snap->length = 0;
+}
+
+/*
+	Hands the whole pages of the original buffer inside [data, data + len)
+	back to the kernel, if the snapshot is of a large file
+*/
+static void document_snapshot_drop(const DocumentSnapshot *snap, const unsigned char *data, const uint64_t len)
+{
+	uint64_t size = (uint64_t) sysconf(_SC_PAGESIZE), start, end;
+
+	if (snap->paged == NULL || data < snap->paged || data >= snap->paged + snap->paged_length)
+		return;
+	start = ((uint64_t) (data - snap->paged) + size - 1) / size * size;
+	end = (uint64_t) (data - snap->paged + len) / size * size;
+	if (start < end)
+		madvise((void *) (snap->paged + start), end - start, MADV_DONTNEED);
+}
+
+uint8_t document_snapshot_write(const DocumentSnapshot *snap, const int fd)
+{
+	struct iovec iov[DOCUMENT_IOV_MAX];
+	uint64_t i = 0, skip = 0, total, done;
+	int count, j;
+	ssize_t n;
+
+	while (i < snap->count) {
+		/*
+			Gather as many spans as one writev takes, resuming mid-span.
+			For a large file, only as much as the pager keeps resident is
+			written at once
+		*/
+		total = 0;
+		for (count = 0; count < DOCUMENT_IOV_MAX && i + count < snap->count; ++count) {
+			iov[count].iov_base = (void *) (snap->spans[i + count].data + ((count) ? 0 : skip));
+			iov[count].iov_len = snap->spans[i + count].length - ((count) ? 0 : skip);
+			if (snap->paged != NULL && total + iov[count].iov_len >= DOCUMENT_PAGE_SIZE * DOCUMENT_PAGES_MAX) {
+				iov[count].iov_len = DOCUMENT_PAGE_SIZE * DOCUMENT_PAGES_MAX - total;
+				++count;
+				break;
+			}
+			total += iov[count].iov_len;
+		}
+
+		n = writev(fd, iov, count);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return 1;
+		}
+
+		for (j = 0, done = 0; j < count && done < (uint64_t) n; done += iov[j++].iov_len)
+			document_snapshot_drop(snap, (const unsigned char *) iov[j].iov_base,
+				((uint64_t) n - done < iov[j].iov_len) ? (uint64_t) n - done : iov[j].iov_len);
+
+		/* Skip past whatever made it out */
+		n += skip;
+		while (i < snap->count && (uint64_t) n >= snap->spans[i].length) {
+			n -= snap->spans[i].length;
+			++i;
+		}
+		skip = n;
+	}
+
+	return 0;
+}
+
+uint8_t document_save(const Document *doc, const char *path)
+{
+	DocumentSnapshot snap;
+	struct stat st;
+	char *tmpname, *dir;
+	uint8_t failed = 0;
+	mode_t mask;
+	int fd;
+
+	tmpname = (char *) malloc(sizeof(char) * (strlen(path) + 8));
+	if (tmpname == NULL)
+		return 1;
+	strcpy(tmpname, path);
+	strcat(tmpname, ".XXXXXX");
+
+	fd = mkstemp(tmpname);
+	if (fd < 0) {
+		free(tmpname);
+		return 2;
+	}
+
+	/* mkstemp makes the file private, give it the target's permissions */
+	if (!stat(path, &st)) {
+		fchmod(fd, st.st_mode & 07777);
+		if (fchown(fd, st.st_uid, st.st_gid)) {
+			/* Only root can give a file away, keep ours */
+		}
+	} else {
+		mask = umask(0);
+		umask(mask);
+		fchmod(fd, 0666 & ~mask);
+	}
+
+	if (document_snapshot(doc, &snap)) {
+		failed = 3;
+	} else {
+		if (document_snapshot_write(&snap, fd) || fsync(fd))
+			failed = 4;
+		document_snapshot_release(&snap);
+	}
+	if (close(fd) && !failed)
+		failed = 5;
+	if (!failed && rename(tmpname, path))
+		failed = 6;
+	if (failed) {
+		unlink(tmpname);
+		free(tmpname);
+		return failed;
+	}
+
+	/* Make the rename itself stick */
+	dir = strrchr(tmpname, '/');
+	if (dir != NULL)
+		*(dir + 1) = '\0';
+	else
+		strcpy(tmpname, ".");
+	fd = open(tmpname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+
+	free(tmpname);
+	return 0;
+}
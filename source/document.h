@@ -0,0 +1,258 @@
+#ifndef _DOCUMENT_H_INCLUDED
+#define _DOCUMENT_H_INCLUDED
+
+#include "pool.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/**
+ *	Largest number of bytes a single piece may span. Keeping pieces
+ *	small bounds the cost of re-counting newlines when one is split
+ *	(in large-file mode, pieces of the original span a whole page)
+ */
+static const uint64_t DOCUMENT_PIECE_MAX = 65536;
+
+/**
+ *	Files of at least DOCUMENT_LARGE_SIZE bytes are opened in large-file
+ *	mode, in which the original buffer is handled in pages of
+ *	DOCUMENT_PAGE_SIZE bytes and at most DOCUMENT_PAGES_MAX of them are
+ *	kept resident at a time
+ */
+#define DOCUMENT_LARGE_SIZE	((uint64_t) 256 << 20)
+#define DOCUMENT_PAGE_SIZE	((uint64_t) 1 << 20)
+#define DOCUMENT_PAGES_MAX	64
+
+/**
+ *	Most documents whose files are guarded against being cut short
+ *	while they are mapped, at once
+ */
+#define DOCUMENT_MAPS_MAX	8
+
+/**
+ *	How many tree nodes, and how many add blocks, are allocated at a time
+ */
+#define DOCUMENT_NODES_PER_SLAB		1024
+#define DOCUMENT_BLOCKS_PER_SLAB	16
+
+/**
+ *	The buffers a piece can refer to
+ */
+typedef enum _document_source {
+	DOCUMENT_ORIGINAL, DOCUMENT_ADD
+} DocumentSource;
+
+/**
+ *	Represents a span of text taken from one of the document's buffers
+ */
+typedef struct _document_piece {
+	DocumentSource source;
+	uint64_t start;
+	uint64_t length;
+	uint64_t lines;
+} DocumentPiece;
+
+/**
+ *	Node of the piece tree. The tree is a treap ordered by position in
+ *	the document; every node also keeps the number of bytes and newlines
+ *	held by its whole subtree, so that both offsets and line numbers can
+ *	be looked up in O(log n)
+ */
+typedef struct _document_node {
+	DocumentPiece piece;
+	uint64_t length;
+	uint64_t lines;
+	uint32_t priority;
+	struct _document_node *left;
+	struct _document_node *right;
+} DocumentNode;
+
+/**
+ *	Keeps the original buffer of a large file in check
+ *	lru holds the pages touched last, most recent first; a page that
+ *	falls off its end is handed back to the kernel, which reads it from
+ *	the file again if it is ever needed. The indexer thread reads the
+ *	file through a descriptor of its own, stores the number of newlines
+ *	in each page in lines and publishes how many pages it got through in
+ *	counted, so that indexing a page it has been through never touches
+ *	the mapping
+ */
+typedef struct _document_pager {
+	uint64_t lru[DOCUMENT_PAGES_MAX];
+	uint64_t resident;
+	uint32_t *lines;
+	uint64_t pages;
+	uint64_t counted;
+	pthread_t indexer;
+	int fd;
+	uint8_t quit;
+} DocumentPager;
+
+/**
+ *	Represents the text of a file as a piece table:
+ *		1. original - the file contents, mapped read-only and never modified
+ *		2. add - every byte ever inserted, only ever appended to, kept in
+ *		   blocks of DOCUMENT_PIECE_MAX bytes that never move
+ *	The document is the in-order concatenation of the pieces in the tree,
+ *	followed by original[indexed, original_length): the original buffer
+ *	is only cut into pieces (and scanned for newlines) once a lookup
+ *	reaches that far. If journal is set, every edit is also recorded there,
+ *	and if undo is set, there too along with the text it deletes.
+ *	Tree nodes come from the nodes pool and add blocks from the text
+ *	pool, so that both are released in bulk with the document. pager is
+ *	only set in large-file mode
+ */
+typedef struct _document {
+	unsigned char *original;
+	uint64_t original_length;
+	uint64_t indexed;
+	unsigned char **add;
+	uint64_t add_blocks;
+	uint64_t add_length;
+	uint64_t add_capacity;
+	DocumentNode *root;
+	uint64_t piece_count;
+	Pool nodes;
+	Pool text;
+	uint64_t revision;
+	uint32_t seed;
+	struct _journal *journal;
+	struct _undo *undo;
+	DocumentPager *pager;
+} Document;
+
+/**
+ *	Number of spans handed to a single writev
+ */
+#define DOCUMENT_IOV_MAX	1024
+
+/**
+ *	A contiguous run of text, pointing straight into one of the buffers
+ */
+typedef struct _document_span {
+	const unsigned char *data;
+	uint64_t length;
+} DocumentSpan;
+
+/**
+ *	The document as it was at some revision, frozen as a list of spans.
+ *	The buffers those point into are never modified, only appended to,
+ *	so a snapshot can be read from another thread while editing goes on.
+ *	In large-file mode paged is the original buffer, whose pages are
+ *	handed back to the kernel as soon as they have been written out
+ */
+typedef struct _document_snapshot {
+	DocumentSpan *spans;
+	uint64_t count;
+	uint64_t length;
+	uint64_t revision;
+	const unsigned char *paged;
+	uint64_t paged_length;
+} DocumentSnapshot;
+
+/**
+ *	Initialize an empty document
+ */
+extern uint8_t document_new(Document *doc);
+
+/**
+ *	Map the file behind fd as the document's original buffer. If another
+ *	process cuts the file short while it is mapped, whatever it lost
+ *	reads as NUL bytes from then on rather than raising SIGBUS
+ */
+extern uint8_t document_load(Document *doc, const int fd);
+
+/**
+ *	Check whether part of the document's file was lost to it being cut
+ *	short on disk
+ */
+extern uint8_t document_lost(const Document *doc);
+
+/**
+ *	Destroys the document and its buffers
+ */
+extern void document_release(Document *doc);
+
+/**
+ *	Get the number of bytes in the document
+ */
+extern uint64_t document_length(const Document *doc);
+
+/**
+ *	Get the number of lines in the document. An empty document
+ *	still has one (empty) line. This has to index the whole file, so
+ *	prefer document_has_line where possible
+ */
+extern uint64_t document_line_count(Document *doc);
+
+/**
+ *	Check whether the document has the specified line
+ */
+extern uint8_t document_has_line(Document *doc, const uint64_t line);
+
+/**
+ *	Get the byte offset at which the specified line starts
+ */
+extern uint64_t document_line_offset(Document *doc, const uint64_t line);
+
+/**
+ *	Get the line that the byte at offset belongs to
+ */
+extern uint64_t document_line_at(Document *doc, const uint64_t offset);
+
+/**
+ *	Get the length of the specified line, without its newline
+ */
+extern uint64_t document_line_length(Document *doc, const uint64_t line);
+
+/**
+ *	Points data at the contiguous run of text that starts at offset and
+ *	returns its length. Returns 0 at the end of the document
+ */
+extern uint64_t document_chunk(const Document *doc, const uint64_t offset, const unsigned char **data);
+
+/**
+ *	Copies up to len bytes starting at offset into dst. Returns the
+ *	number of bytes copied
+ */
+extern uint64_t document_read(const Document *doc, const uint64_t offset, unsigned char *dst, const uint64_t len);
+
+/**
+ *	Inserts len bytes of str at offset
+ */
+extern uint8_t document_insert(Document *doc, const uint64_t offset, const unsigned char *str, const uint64_t len);
+
+/**
+ *	Removes len bytes starting at offset
+ */
+extern uint8_t document_delete(Document *doc, const uint64_t offset, const uint64_t len);
+
+/**
+ *	Writes the whole document into sink
+ */
+extern void document_write(const Document *doc, FILE *sink);
+
+/**
+ *	Takes a snapshot of the document as it is now. Costs one span per
+ *	piece, none of the text is copied
+ */
+extern uint8_t document_snapshot(const Document *doc, DocumentSnapshot *snap);
+
+/**
+ *	Releases the span list of a snapshot
+ */
+extern void document_snapshot_release(DocumentSnapshot *snap);
+
+/**
+ *	Writes a snapshot to fd, gathering its spans with writev
+ */
+extern uint8_t document_snapshot_write(const DocumentSnapshot *snap, const int fd);
+
+/**
+ *	Saves the document to path without ever leaving it half written: the
+ *	text goes to a new file next to it, which is synced to disk and then
+ *	renamed over path. An existing file keeps its permissions
+ */
+extern uint8_t document_save(const Document *doc, const char *path);
+
+#endif /* _DOCUMENT_H_INCLUDED */
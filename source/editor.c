@@ -1,17 +1,44 @@
 #include "editor.h"
 #include "textproperties.h"
+#include "utf8.h"
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
 #include <signal.h>
 #include <unistd.h>
-#include <termios.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <sys/stat.h>
 
 Editor *gEditor = NULL;
 
-volatile sig_atomic_t DO_AUTO_BACKUP = 0;
+/*
+	Asks the terminal for its size, never taking less than the smallest
+	screen the editor can lay out, so that the text always has a row
+*/
+static void editor_size(Editor *editor)
+{
+	terminal_size(&editor->term, &editor->ttyInfo);
+	if (editor->ttyInfo.rows < SCREEN_MIN_ROWS)
+		editor->ttyInfo.rows = SCREEN_MIN_ROWS;
+	if (editor->ttyInfo.cols < SCREEN_MIN_COLS)
+		editor->ttyInfo.cols = SCREEN_MIN_COLS;
+}
 
 uint8_t editor_init(Editor *editor, const char *tgt)
 {
+	Terminal term;
+
+	terminal_tty(&term, STDOUT_FILENO);
+	return editor_init_terminal(editor, tgt, &term);
+}
+
+uint8_t editor_init_terminal(Editor *editor, const char *tgt, const Terminal *term)
+{
+	size_t i;
+
 	editor->tempname = (char *) malloc(sizeof(char) * (strlen(tgt) + 2));
 	editor->filename = tgt;
 
@@ -26,267 +53,1313 @@ uint8_t editor_init(Editor *editor, const char *tgt)
 		return 2;
 	fseek(editor->target, 0, SEEK_SET);
 
-	editor->backup = fopen(editor->tempname, "w");
-	if (editor->backup == NULL) {
-		return 3;
-	}
-
+	editor->pending_length = 0;
 	editor->is_dirty = 0;
-	editor->head = editor->cur = NULL;
-	editor->head = (TtyLineBufferList *) malloc(sizeof(TtyLineBufferList));
-	if (tty_line_buffer_list_init(editor->head))
+	editor->marked = 0;
+	editor->search_query[0] = '\0';
+	editor->search_fold = 0;
+	editor->found_length = 0;
+	editor->counting = 0;
+	search_init(&editor->search, NULL, 0, 0);
+	editor->show_stats = 0;
+	stats_init(&editor->stats);
+	editor->frame_interval = editor->frame_last = 0;
+	editor->lost = 0;
+	editor->key_kind = EDITOR_KEY_OTHER;
+	undo_new(&editor->undo, UNDO_BUDGET);
+	if (getenv("QWERTY_UNDO") != NULL && strtoull(getenv("QWERTY_UNDO"), NULL, 10) > 0)
+		editor->undo.budget = strtoull(getenv("QWERTY_UNDO"), NULL, 10) << 20;
+	if (getenv("QWERTY_FPS") != NULL && strtoul(getenv("QWERTY_FPS"), NULL, 10) > 0)
+		editor->frame_interval = 1000000000ULL / strtoul(getenv("QWERTY_FPS"), NULL, 10);
+	if (document_new(&editor->doc))
 		return 4;
-
-	editor->cur = editor->head;
+	journal_new(&editor->journal);
+	if (backup_init(&editor->backup, editor->tempname))
+		return 3;
+	if (tty_line_buffer_new(&editor->line))
+		return 4;
+	editor->line_no = editor->line_offset = editor->line_length = 0;
+	editor->line_dirty = 0;
 
 	// Set up screen buffer
-	tty_info_get(&editor->ttyInfo);
-	if (screen_new(&editor->screen, editor->ttyInfo.rows, editor->ttyInfo.cols)) {
+	editor->term = *term;
+	editor_size(editor);
+	if (screen_new(&editor->screen, &editor->term, editor->ttyInfo.rows, editor->ttyInfo.cols)) {
 		return 5;
 	}
+	viewport_init(&editor->view, editor->screen.max_row - POST_EDITOR - PRE_EDITOR, editor->screen.max_col);
+	highlight_init(&editor->hl, tgt);
+	for (i = 0; i < EDITOR_COLUMN_LINES; ++i) {
+		editor->columns[i].line = UINT64_MAX;
+		editor->columns[i].points = NULL;
+		editor->columns[i].count = editor->columns[i].capacity = 0;
+	}
+	editor->column_next = 0;
+	editor->scratch = NULL;
+	editor->scratch_size = 0;
+	editor->read_line = UINT64_MAX;
 
 	screen_init(&editor->screen, (const unsigned char *) tgt);
-	editor_load_from_file(editor);
+	if (editor_load_from_file(editor))
+		return 6;
+
+	if (input_init(&editor->input, STDIN_FILENO))
+		return 7;
+	/* Have the terminal bracket pastes, so they can be taken in whole */
+	terminal_write(&editor->term, (const unsigned char *) INPUT_PASTE_ON, sizeof(INPUT_PASTE_ON) - 1);
 
 	gEditor = editor;
 
 	return 0;
 }
 
+/*
+	Writes what the session spent its time on, and what the document's
+	pools hold, to the file QWERTY_STATS names
+*/
+static void editor_dump_stats(Editor *editor)
+{
+	const char *path = getenv("QWERTY_STATS");
+	const Pool *pools[2] = { &editor->doc.nodes, &editor->doc.text };
+	const char *names[2] = { "nodes", "text" };
+	FILE *out;
+	int i;
+
+	if (path == NULL || path[0] == '\0' || (out = fopen(path, "w")) == NULL)
+		return;
+
+	stats_dump(&editor->stats, out);
+	for (i = 0; i < 2; ++i) {
+		fprintf(out, "pool %s: %" PRIu64 " allocations, %" PRIu64 " reused, %" PRIu64 " released, %" PRIu64
+			" live, %" PRIu64 " slabs, %" PRIu64 " bytes\n", names[i], pools[i]->stats.allocations,
+			pools[i]->stats.reuses, pools[i]->stats.releases, pools[i]->stats.live, pools[i]->stats.slabs,
+			pools[i]->stats.bytes);
+	}
+	fclose(out);
+}
+
 void editor_release(Editor *editor)
 {
+	size_t i;
+
 	if (editor == NULL)
 		return;
+	editor_dump_stats(editor);
+	/* Hand over the last edits; the backup thread may still be reading the document */
+	editor_perform_backup(editor);
+	backup_release(&editor->backup);
+	if (editor->journal_restart)
+		unlink(editor->tempname);
+	journal_release(&editor->journal);
+	undo_release(&editor->undo);
 	if (editor->tempname != NULL)
 		free(editor->tempname);
-	if (editor->backup != NULL)
-		fclose(editor->backup);
 	if (editor->target != NULL)
 		fclose(editor->target);
-	tty_line_buffer_list_release(editor->head);
+	terminal_write(&editor->term, (const unsigned char *) INPUT_PASTE_OFF, sizeof(INPUT_PASTE_OFF) - 1);
+	input_release(&editor->input);
+	tty_line_buffer_release(&editor->line);
+	document_release(&editor->doc);
+	highlight_release(&editor->hl);
+	for (i = 0; i < EDITOR_COLUMN_LINES; ++i)
+		free(editor->columns[i].points);
+	free(editor->scratch);
 	screen_release(&editor->screen);
 }
 
-void editor_load_from_file(Editor *editor)
+uint8_t editor_load_from_file(Editor *editor)
 {
-	int c = 0;
+	struct stat st;
 	if (editor == NULL)
+		return 1;
+	if (document_load(&editor->doc, fileno(editor->target)))
+		return 2;
+	if (fstat(fileno(editor->target), &st))
+		return 3;
+	if (editor->doc.pager != NULL)
+		screen_set_status(&editor->screen, "Large file mode");
+
+	/* Pick up where a session that died left off */
+	journal_header(&editor->journal_header, &st);
+	editor->journal_restart = 1;
+	if (!journal_replay(&editor->doc, editor->tempname, &st, &editor->journal_size)) {
+		editor->journal_restart = 0;
+		editor->is_dirty = 1;
+		screen_set_status(&editor->screen, "Recovered from backup");
+	}
+	editor->doc.journal = &editor->journal;
+	editor->doc.undo = &editor->undo;
+
+	editor_checkout_line(editor, 0);
+	return 0;
+}
+
+/*
+	Counts the matches of the last search a step further, and says how
+	far it got. A count the document changed under is given up on, and
+	so is one that typing not yet in the document would throw off
+*/
+static void editor_count_matches(Editor *editor)
+{
+	char status[SCREEN_STATUS_MAX];
+	const SearchTally *tally = &editor->tally;
+	uint8_t ret;
+
+	ret = (editor->line_dirty) ? 2 : search_tally_step(&editor->search, &editor->doc, &editor->tally);
+	if (ret == 2) {
+		editor->counting = 0;
 		return;
-	do {
-		c = fgetc(editor->target);
-		if (c != EOF)
-			editor_input(editor, (unsigned char) c);
-	} while (c != EOF);
+	}
+	editor->counting = !ret;
 
-	screen_reset_col(&editor->screen);
-	screen_set_row_pos(&editor->screen, 0 + PRE_EDITOR);
-	editor->cur = editor->head;
+	if (ret)
+		snprintf(status, sizeof(status), "Match %" PRIu64 " of %" PRIu64 "%s", tally->before + 1, tally->count,
+			(editor->search_wrapped) ? ", wrapped" : "");
+	else if (tally->pos > tally->offset)
+		snprintf(status, sizeof(status), "Match %" PRIu64 " of %" PRIu64 "+%s", tally->before + 1, tally->count,
+			(editor->search_wrapped) ? ", wrapped" : "");
+	else
+		snprintf(status, sizeof(status), "Counting matches, %" PRIu64 " so far", tally->count);
+	screen_set_status(&editor->screen, status);
 }
 
 void editor_loopy(Editor *editor)
 {
-	unsigned char c = 0;
-	signal(SIGINT, editor_handle_sigint);
-	signal(SIGALRM, editor_perform_backup);
-	alarm(BACKUP_TIMEOUT);
+	struct pollfd fds[4];
+	struct itimerspec interval;
+	struct signalfd_siginfo info;
+	uint64_t expirations, start, now, batch, arrival = 0;
+	sigset_t mask;
+	int timer, signals, timeout;
+	uint8_t due = 1;
+
+	/*
+		Signals are picked up through a descriptor like everything else,
+		so they are handled between keys rather than in the middle of one
+	*/
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGINT);
+	sigaddset(&mask, SIGWINCH);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	signals = signalfd(-1, &mask, SFD_CLOEXEC);
+
+	timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	interval.it_interval.tv_sec = interval.it_value.tv_sec = BACKUP_TIMEOUT;
+	interval.it_interval.tv_nsec = interval.it_value.tv_nsec = 0;
+	timerfd_settime(timer, 0, &interval, NULL);
+
+	fds[0].fd = editor->input.fd;
+	fds[1].fd = timer;
+	fds[2].fd = signals;
+	fds[3].fd = editor->backup.notify;
+	fds[0].events = fds[1].events = fds[2].events = fds[3].events = POLLIN;
+
 	while(1) {
-		if (/*183 != c && 184 != c && 185 != c && 186 != c &&  178 != c && 176 != c && */ 169 != c)
-			screen_flush_out(&editor->screen);
-		c = editor_getch();
-		/*editor->is_dirty = 1;
-		screen_write(&editor->screen, c);*/
-		editor_input(editor, c);
-		usleep(200);
+		/*
+			Only draw when something changed, and no sooner than the
+			frame rate allows; a frame held back is drawn when its time
+			comes, with whatever else happened in the meantime
+		*/
+		now = stats_now();
+		timeout = -1;
+		if (due && now - editor->frame_last < editor->frame_interval) {
+			timeout = (editor->frame_interval - (now - editor->frame_last) + 999999) / 1000000;
+		} else if (due) {
+			start = now;
+			editor_render(editor);
+			if (!editor->lost && document_lost(&editor->doc)) {
+				/* Found out while drawing the text that is no longer there */
+				editor->lost = 1;
+				screen_set_status(&editor->screen, "File cut short on disk");
+			}
+			screen_compose(&editor->screen);
+			start = stats_record(&editor->stats, STATS_RENDER, start);
+			screen_send(&editor->screen);
+			start = stats_record(&editor->stats, STATS_WRITE, start);
+			stats_frame(&editor->stats, editor->screen.out.length);
+			if (arrival) {
+				/* The keys that came in have made it to the terminal */
+				stats_histogram_add(&editor->stats.stages[STATS_KEY], start - arrival);
+				arrival = 0;
+			}
+			editor->frame_last = now;
+			due = 0;
+		}
+
+		/* Matches are counted a step at a time while no key is waiting */
+		if (editor->counting) {
+			editor_count_matches(editor);
+			due = 1;
+			timeout = 0;
+		}
+
+		if (poll(fds, 4, timeout) <= 0)
+			continue;
+		due = 1;
+
+		if (fds[2].revents & POLLIN && read(signals, &info, sizeof(info)) == sizeof(info)) {
+			if (info.ssi_signo == SIGINT)
+				editor_handle_sigint(SIGINT);
+			else if (info.ssi_signo == SIGWINCH)
+				editor_resize(editor);
+		}
+
+		if (fds[1].revents & POLLIN && read(timer, &expirations, sizeof(expirations)) == sizeof(expirations)) {
+			start = stats_now();
+			editor_perform_backup(editor);
+			stats_record(&editor->stats, STATS_BACKUP, start);
+		}
+
+		if (fds[3].revents & POLLIN && read(fds[3].fd, &expirations, sizeof(expirations)) == sizeof(expirations))
+			editor_show_backup(editor);
+
+		if (fds[0].revents & (POLLIN | POLLHUP)) {
+			/*
+				Keys typed ahead of the screen are all handled before it
+				is drawn again, unless they keep coming for longer than
+				EDITOR_BATCH_MAX
+			*/
+			batch = stats_now();
+			if (!arrival)
+				arrival = batch;
+			do {
+				start = stats_now();
+				if (input_fill(&editor->input, 0) < 0 && editor->input.eof) {
+					/* Nobody left to type: keep the backup and leave */
+					editor_release(editor);
+					exit(0);
+				}
+				start = stats_record(&editor->stats, STATS_INPUT, start);
+				while (input_pending(&editor->input)) {
+					editor_input(editor, input_next(&editor->input));
+					start = stats_record(&editor->stats, STATS_EDIT, start);
+					++editor->stats.keys;
+				}
+			} while (start - batch < EDITOR_BATCH_MAX * 1000000ULL && input_ready(&editor->input));
+		}
+	}
+}
+
+void editor_resize(Editor *editor)
+{
+	editor_size(editor);
+	screen_release(&editor->screen);
+	if (screen_new(&editor->screen, &editor->term, editor->ttyInfo.rows, editor->ttyInfo.cols)) {
+		editor_release(editor);
+		exit(1);
+	}
+	screen_init(&editor->screen, (const unsigned char *) editor->filename);
+	editor_show_backup(editor);
+	viewport_resize(&editor->view, editor->screen.max_row - POST_EDITOR - PRE_EDITOR, editor->screen.max_col);
+}
+
+/*
+	Finds where a line of the document starts and how long it is. The
+	lines of a frame, and the ones the lexer goes through before them,
+	are asked for in order, so a line right after the one looked up last
+	is found by scanning for its newline alone rather than searching the
+	pieces from the start of the one it is in
+*/
+static uint64_t editor_locate_line(Editor *editor, const uint64_t line, uint64_t *offset)
+{
+	const unsigned char *data, *nl = NULL;
+	uint64_t len = 0, n;
+
+	if (editor->read_line != UINT64_MAX && editor->read_revision == editor->doc.revision) {
+		if (line == editor->read_line) {
+			*offset = editor->read_offset;
+			return editor->read_length;
+		}
+		if (line == editor->read_line + 1 && document_has_line(&editor->doc, line)) {
+			*offset = editor->read_offset + editor->read_length + 1;
+			while (nl == NULL && (n = document_chunk(&editor->doc, *offset + len, &data)) > 0) {
+				nl = (const unsigned char *) memchr(data, '\n', n);
+				len += (nl != NULL) ? (uint64_t) (nl - data) : n;
+			}
+			editor->read_line = line;
+			editor->read_offset = *offset;
+			editor->read_length = len;
+			return len;
+		}
+	}
+
+	*offset = document_line_offset(&editor->doc, line);
+	len = document_line_length(&editor->doc, line);
+	editor->read_line = line;
+	editor->read_offset = *offset;
+	editor->read_length = len;
+	editor->read_revision = editor->doc.revision;
+	return len;
+}
+
+/*
+	Hands out len bytes of a line from byte from on for the lexer, or all
+	of the rest of it if there are fewer: straight from the document or
+	the line being edited if they are in one piece there, gathered in
+	scratch otherwise
+*/
+static const unsigned char *editor_read_line(void *ctx, const uint64_t line, const uint64_t from, uint64_t *len)
+{
+	Editor *editor = (Editor *) ctx;
+	const unsigned char *data;
+	unsigned char *tmp;
+	uint64_t offset = 0, length, n;
+
+	/* The document may not have caught up with the line being edited */
+	length = (line == editor->line_no) ? editor->line.length : editor_locate_line(editor, line, &offset);
+	if (from >= length) {
+		*len = 0;
+		return NULL;
+	}
+	if (*len > length - from)
+		*len = length - from;
+
+	if (line == editor->line_no)
+		n = tty_line_buffer_span(&editor->line, from, &data);
+	else
+		n = document_chunk(&editor->doc, offset + from, &data);
+	if (n >= *len)
+		return data;
+
+	if (*len > editor->scratch_size) {
+		tmp = (unsigned char *) realloc(editor->scratch, *len);
+		if (tmp == NULL) {
+			*len = 0;
+			return NULL;
+		}
+		editor->scratch = tmp;
+		editor->scratch_size = *len;
+	}
+
+	if (line == editor->line_no) {
+		/* Either side of the gap */
+		memcpy(editor->scratch, data, n);
+		tty_line_buffer_span(&editor->line, from + n, &data);
+		memcpy(editor->scratch + n, data, *len - n);
+	} else {
+		*len = document_read(&editor->doc, offset + from, editor->scratch, *len);
 	}
+	return editor->scratch;
 }
 
-void editor_input(Editor *editor, const unsigned char in)
+uint8_t editor_commit_line(Editor *editor)
 {
-	size_t i = 0;
-	unsigned char tmp;
-	const char *str;
+	const unsigned char *str, *data;
+	unsigned char tail[256];
+	uint64_t prefix = 0, suffix = 0, max, n, m, i;
+
+	if (!editor->line_dirty)
+		return 0;
+
+	/*
+		Only the part of the line that changed is replaced, so the journal
+		and the undo log get the edit that was made rather than the line.
+		The line is read either side of the gap where it is, so the
+		insertion point does not have to be measured again
+	*/
+	max = (editor->line_length < editor->line.length) ? editor->line_length : editor->line.length;
+	while (prefix < max && (n = document_chunk(&editor->doc, editor->line_offset + prefix, &data)) > 0) {
+		m = tty_line_buffer_span(&editor->line, prefix, &str);
+		if (n > m)
+			n = m;
+		if (n > max - prefix)
+			n = max - prefix;
+		for (i = 0; i < n && data[i] == str[i]; ++i);
+		prefix += i;
+		if (i < n)
+			break;
+	}
+	max -= prefix;
+	while (suffix < max) {
+		n = (max - suffix < sizeof(tail)) ? max - suffix : sizeof(tail);
+		document_read(&editor->doc, editor->line_offset + editor->line_length - suffix - n, tail, n);
+		for (i = n; i > 0 && tail[i - 1] == tty_line_buffer_at(&editor->line, editor->line.length - suffix - n + i - 1); --i);
+		suffix += n - i;
+		if (i > 0)
+			break;
+	}
+
+	m = n = editor->line.length - prefix - suffix;
+	str = editor_read_line(editor, editor->line_no, prefix, &n);
+	if (n < m)
+		return 1;
+	if (document_delete(&editor->doc, editor->line_offset + prefix, editor->line_length - prefix - suffix))
+		return 2;
+	if (document_insert(&editor->doc, editor->line_offset + prefix, str, n))
+		return 3;
+
+	editor->line_length = editor->line.length;
+	editor->line_dirty = 0;
+	return 0;
+}
+
+/*
+	Gets the column checkpoints kept for line, taking the slot that was
+	used the longest ago if it has none
+*/
+static TtyColumnMarks *editor_column_marks(Editor *editor, const uint64_t line)
+{
+	TtyColumnMarks *marks;
+	size_t i;
+
+	for (i = 0; i < EDITOR_COLUMN_LINES; ++i)
+		if (editor->columns[i].line == line)
+			return &editor->columns[i];
+
+	marks = &editor->columns[editor->column_next];
+	editor->column_next = (editor->column_next + 1) % EDITOR_COLUMN_LINES;
+	marks->line = line;
+	marks->count = 0;
+	return marks;
+}
+
+static void editor_swap_columns(TtyColumnMarks *a, TtyColumnMarks *b)
+{
+	TtyColumnMarks tmp = *a;
+
+	*a = *b;
+	*b = tmp;
+}
+
+void editor_checkout_line(Editor *editor, const uint64_t line)
+{
+	TtyColumnMarks *marks;
+	unsigned char *text;
+	size_t i;
+
+	/* The column checkpoints of the line go back to a slot, and those of the new one come out of theirs */
+	editor_commit_line(editor);
+	if (editor->line.marks.count > 0) {
+		marks = editor_column_marks(editor, editor->line_no);
+		editor_swap_columns(marks, &editor->line.marks);
+		marks->line = editor->line_no;
+	}
+
+	editor->line_no = line;
+	editor->line_offset = document_line_offset(&editor->doc, line);
+	editor->line_length = document_line_length(&editor->doc, line);
+
+	/* The line goes in after the gap, which leaves the insertion point at its start */
+	text = tty_line_buffer_open(&editor->line, editor->line_length);
+	if (text != NULL)
+		document_read(&editor->doc, editor->line_offset, text, editor->line_length);
+	for (i = 0; i < EDITOR_COLUMN_LINES; ++i) {
+		if (editor->columns[i].line == line) {
+			editor_swap_columns(&editor->columns[i], &editor->line.marks);
+			editor->columns[i].line = UINT64_MAX;
+			editor->columns[i].count = 0;
+			break;
+		}
+	}
+}
+
+static uint64_t editor_count_lines(const unsigned char *str, const uint64_t len)
+{
+	const unsigned char *nl;
+	uint64_t lines = 0, i;
+
+	for (i = 0; (nl = (const unsigned char *) memchr(str + i, '\n', len - i)) != NULL; i = nl - str + 1)
+		++lines;
+	return lines;
+}
+
+/*
+	Records an edit of line from byte at on, which took the newlines of
+	the removed lines after it away and added added new lines after it,
+	with the lexer and the column checkpoints
+*/
+static void editor_edited(Editor *editor, const uint64_t line, const uint64_t at, const uint64_t removed, const uint64_t added)
+{
+	TtyColumnMarks *marks;
+	size_t i;
+
+	highlight_edit(&editor->hl, line, at, removed, added);
+	for (i = 0; i < EDITOR_COLUMN_LINES; ++i) {
+		marks = &editor->columns[i];
+		if (marks->line == UINT64_MAX || marks->line < line)
+			continue;
+		if (marks->line == line)
+			tty_column_marks_cut(marks, at);
+		else if (marks->line <= line + removed)
+			marks->line = UINT64_MAX;
+		else
+			marks->line = marks->line - removed + added;
+	}
+
+	/* The ones of the line being edited only last while it keeps its number */
+	if (editor->line_no == line)
+		tty_column_marks_cut(&editor->line.marks, at);
+	else if (editor->line_no > line && (removed || added))
+		editor->line.marks.count = 0;
+}
+
+/* Types len bytes that hold no newline into the line being edited */
+static void editor_line_insert(Editor *editor, const unsigned char *str, const uint64_t len)
+{
+	uint64_t before = editor->line.length, at = editor->line.insertionPoint;
+
+	tty_line_buffer_insert_span(&editor->line, str, len);
+	if (editor->line.length != before) {
+		editor->line_dirty = editor->is_dirty = 1;
+		editor_edited(editor, editor->line_no, at, 0, 0);
+	}
+}
+
+uint8_t editor_insert_span(Editor *editor, const unsigned char *str, const uint64_t len)
+{
+	uint64_t offset, lines;
+
+	editor->marked = 0;
+	if (editor->pending_length > 0) {
+		editor_line_insert(editor, editor->pending, editor->pending_length);
+		editor->pending_length = 0;
+	}
+
+	if (len == 0)
+		return 0;
+	if (memchr(str, '\n', len) == NULL) {
+		editor_line_insert(editor, str, len);
+		return 0;
+	}
+
+	/*
+		Text over several lines goes straight into the document as one
+		piece, rather than through the line buffer a line at a time
+	*/
+	if (editor_commit_line(editor))
+		return 1;
+	offset = editor->line_offset + editor->line.insertionPoint;
+	if (document_insert(&editor->doc, offset, str, len))
+		return 2;
+
+	lines = editor_count_lines(str, len);
+	editor_edited(editor, editor->line_no, offset - editor->line_offset, 0, lines);
+	editor->is_dirty = 1;
+
+	editor_checkout_line(editor, editor->line_no + lines);
+	tty_line_buffer_move_to(&editor->line, offset + len - editor->line_offset);
+	return 0;
+}
+
+uint8_t editor_delete_range(Editor *editor, const uint64_t from, const uint64_t to)
+{
+	uint64_t first, last, at;
+
+	editor->marked = 0;
+	if (from >= to)
+		return 0;
+	if (editor_commit_line(editor))
+		return 1;
+
+	first = document_line_at(&editor->doc, from);
+	last = document_line_at(&editor->doc, to);
+	at = from - document_line_offset(&editor->doc, first);
+	if (document_delete(&editor->doc, from, to - from))
+		return 2;
+	editor_edited(editor, first, at, last - first, 0);
+	editor->is_dirty = 1;
+
+	editor_checkout_line(editor, first);
+	tty_line_buffer_move_to(&editor->line, from - editor->line_offset);
+	return 0;
+}
+
+/* Makes an edit of the document on its own, outside of the line being edited */
+static uint8_t editor_apply(Editor *editor, const uint8_t insert, const uint64_t offset, const unsigned char *str, const uint64_t len)
+{
+	uint64_t line = document_line_at(&editor->doc, offset), lines = editor_count_lines(str, len);
+	uint64_t at = offset - document_line_offset(&editor->doc, line);
+
+	if ((insert) ? document_insert(&editor->doc, offset, str, len) : document_delete(&editor->doc, offset, len))
+		return 1;
+	editor_edited(editor, line, at, (insert) ? 0 : lines, (insert) ? lines : 0);
+	return 0;
+}
+
+/*
+	Undoes the last group of edits, or redoes the last one undone,
+	record by record. The cursor ends up where the last of them was
+	made; each costs as much as its own text, whatever the document's
+	size
+*/
+static uint8_t editor_replay(Editor *editor, const uint8_t redo)
+{
+	const UndoRecord *record;
+	uint64_t group, cursor = 0;
+	uint8_t insert;
+
+	editor->marked = 0;
+	editor_commit_line(editor);
+	undo_boundary(&editor->undo);
+	record = (redo) ? undo_next(&editor->undo) : undo_last(&editor->undo);
+	if (record == NULL) {
+		screen_set_status(&editor->screen, (redo) ? "Nothing to redo" : "Nothing to undo");
+		return 1;
+	}
+
+	/* Going back and forth through the log is not an edit to record in it */
+	editor->doc.undo = NULL;
+	group = record->group;
+	do {
+		/* Undoing an insertion deletes its text again, and the other way round */
+		insert = (record->op == UNDO_INSERT) == redo;
+		if (editor_apply(editor, insert, record->offset, undo_text(&editor->undo, record), record->length))
+			break;
+		cursor = record->offset + ((insert) ? record->length : 0);
+		if (redo) {
+			undo_forward(&editor->undo);
+			record = undo_next(&editor->undo);
+		} else {
+			undo_back(&editor->undo);
+			record = undo_last(&editor->undo);
+		}
+	} while (record != NULL && record->group == group);
+	editor->doc.undo = &editor->undo;
+
+	editor->is_dirty = 1;
+	editor_checkout_line(editor, document_line_at(&editor->doc, cursor));
+	tty_line_buffer_move_to(&editor->line, cursor - editor->line_offset);
+	return 0;
+}
+
+uint8_t editor_undo(Editor *editor)
+{
+	return editor_replay(editor, 0);
+}
+
+uint8_t editor_redo(Editor *editor)
+{
+	return editor_replay(editor, 1);
+}
+
+void editor_place_cursor(Editor *editor)
+{
+	screen_set_row_pos(&editor->screen, PRE_EDITOR + editor->line_no - editor->view.top_line);
+	screen_set_col(&editor->screen, editor->line.column - editor->view.left_col);
+}
+
+void editor_render(Editor *editor)
+{
+	char overlay[STATS_LINE_MAX];
+	uint16_t row;
+	uint8_t state;
+
+	if (editor->screen.mode != SCREEN_NORMAL)
+		return;
+
+	if (editor->show_stats) {
+		stats_format(&editor->stats, overlay, editor->screen.max_col - 4);
+		screen_set_overlay(&editor->screen, overlay);
+	}
+
+	viewport_show_line(&editor->view, editor->line_no);
+	viewport_show_column(&editor->view, editor->line.column);
+
+	/* Only the visible lines are lexed, each in the state the one above left */
+	state = highlight_line_state(&editor->hl, editor->view.top_line, editor_read_line, editor);
+	for (row = 0; row < editor->view.height; ++row)
+		state = editor_draw_line(editor, PRE_EDITOR + row, editor->view.top_line + row, state);
+	editor_place_cursor(editor);
+}
+
+/*
+	Finds the character of the len-byte line at offset that covers the
+	visual column col, and the column it starts at, from the checkpoint
+	in marks before it (which may be NULL). Runs of printable ASCII are
+	stepped over whole, so this costs one scan per chunk and one step
+	per tab or other character on the way
+*/
+static uint64_t editor_seek_column(Editor *editor, TtyColumnMarks *marks, const uint64_t offset, const uint64_t len, const uint64_t col, uint64_t *start)
+{
+	TtyColumnMark mark = tty_column_marks_find(marks, len, col);
+	const unsigned char *data;
+	unsigned char seq[4];
+	uint64_t pos = mark.offset, column = mark.column, n, run, next;
+	uint8_t step, width;
+
+	while (pos < len && column < col) {
+		/* A checkpoint's worth at a time, so that one can go in after each */
+		n = document_chunk(&editor->doc, offset + pos, &data);
+		if (n > len - pos)
+			n = len - pos;
+		if (n > TTY_COLUMN_CHECKPOINT)
+			n = TTY_COLUMN_CHECKPOINT;
+
+		while (n > 0 && column < col) {
+			if (data[0] >= 0x80) {
+				step = utf8_sequence_length(data[0]);
+				if (step > n && pos + n < len) {
+					/* The character goes on in the next chunk */
+					step = document_read(&editor->doc, offset + pos, seq, (len - pos < 4) ? len - pos : 4);
+					step = tty_char_width(seq, step, &width);
+				} else {
+					step = tty_char_width(data, n, &width);
+				}
+				if (column + width > col)
+					break;
+				column += width;
+				pos += step;
+				if (step >= n) {
+					n = 0;
+					break;
+				}
+				data += step;
+				n -= step;
+				continue;
+			}
+
+			run = utf8_printable_span(data, n);
+			if (column + run > col) {
+				pos += col - column;
+				column = col;
+				break;
+			}
+			column += run;
+			pos += run;
+			data += run;
+			n -= run;
+			if (n > 0 && data[0] < 0x80) {
+				/* A tab or a control byte */
+				next = tty_column_advance(column, data[0]);
+				if (next > col)
+					break;
+				column = next;
+				++pos;
+				++data;
+				--n;
+			}
+		}
+		tty_column_marks_add(marks, pos, column);
+		if (n > 0)
+			break;
+	}
+
+	*start = column;
+	return pos;
+}
+
+/*
+	Shows the parts of the len bytes from pos on in line that lie between
+	the mark and the cursor, or in the match the search is on, reversed,
+	in attrs, which only holds anything yet if lexed is set. Returns
+	whether any of it does
+*/
+static uint8_t editor_draw_region(Editor *editor, const uint64_t line, const uint64_t pos, const uint64_t len, uint8_t *attrs, const uint8_t lexed)
+{
+	uint64_t from[2], to[2], cursor, offset, i;
+	uint8_t regions = 0, r, shown = 0;
+
+	if ((!editor->marked && !editor->found_length) || len == 0
+		|| (line != editor->line_no && !document_has_line(&editor->doc, line)))
+		return 0;
+
+	if (editor->marked) {
+		cursor = editor->line_offset + editor->line.insertionPoint;
+		from[regions] = (editor->mark < cursor) ? editor->mark : cursor;
+		to[regions++] = (editor->mark < cursor) ? cursor : editor->mark;
+	}
+	if (editor->found_length) {
+		from[regions] = editor->found;
+		to[regions++] = editor->found + editor->found_length;
+	}
+
+	if (line == editor->line_no)
+		offset = editor->line_offset;
+	else
+		editor_locate_line(editor, line, &offset);
+	offset += pos;
+
+	for (r = 0; r < regions; ++r) {
+		if (to[r] <= offset || from[r] >= offset + len)
+			continue;
+		if (!lexed && !shown)
+			memset(attrs, SCREEN_ATTR_NORMAL, len);
+		for (i = (from[r] > offset) ? from[r] - offset : 0; i < len && offset + i < to[r]; ++i)
+			attrs[i] = SCREEN_ATTR_REVERSED;
+		shown = 1;
+	}
+	return shown;
+}
+
+uint8_t editor_draw_line(Editor *editor, const uint16_t row, const uint64_t line, const uint8_t state)
+{
+	unsigned char text[4 * editor->view.width];
+	uint8_t attrs[4 * editor->view.width];
+	const unsigned char *data;
+	TtyColumnMarks *marks;
+	uint64_t i, pos = 0, start = 0, offset, len = 0, length = 0, n;
+	uint8_t end;
+
+	/*
+		Only the slice of the line inside the viewport is fetched: at
+		most four bytes per column (a whole character, even for the last
+		one), from the character covering left_col. Marks past that are
+		cut off
+	*/
+	if (line == editor->line_no) {
+		length = editor->line.length;
+		pos = tty_line_buffer_seek_column(&editor->line, editor->view.left_col, &start);
+		while (pos + len < length && len < sizeof(text)) {
+			n = tty_line_buffer_span(&editor->line, pos + len, &data);
+			if (n > sizeof(text) - len)
+				n = sizeof(text) - len;
+			memcpy(text + len, data, n);
+			len += n;
+		}
+	} else if (document_has_line(&editor->doc, line)) {
+		len = length = editor_locate_line(editor, line, &offset);
+		marks = (len > TTY_COLUMN_CHECKPOINT && editor->view.left_col > 0) ? editor_column_marks(editor, line) : NULL;
+		pos = editor_seek_column(editor, marks, offset, len, editor->view.left_col, &start);
+		len -= pos;
+		if (len > sizeof(text))
+			len = sizeof(text);
+		len = document_read(&editor->doc, offset + pos, text, len);
+	}
+
+	/* Anything past the newline belongs to the next line */
+	for (i = 0; i < len && text[i] != '\n'; ++i);
+
+	if (editor->hl.language == HIGHLIGHT_NONE || (line != editor->line_no && !document_has_line(&editor->doc, line))) {
+		end = state;
+		if (!editor_draw_region(editor, line, pos, i, attrs, 0)) {
+			screen_set_line(&editor->screen, row, text, NULL, i, start, editor->view.left_col);
+			return end;
+		}
+	} else {
+		/* What a byte is depends on the line before it, so the line is lexed up to the slice */
+		end = highlight_slice(&editor->hl, line, state, length, editor_read_line, editor, attrs, pos, i);
+		editor_draw_region(editor, line, pos, i, attrs, 1);
+	}
+	screen_set_line(&editor->screen, row, text, attrs, i, start, editor->view.left_col);
+	return end;
+}
+
+void editor_move_to_line(Editor *editor, const uint64_t line)
+{
+	uint64_t col = editor->line.column;
+
+	editor_checkout_line(editor, line);
+	tty_line_buffer_move_to_column(&editor->line, col);
+}
+
+void editor_goto_line(Editor *editor, uint64_t line)
+{
+	if (!document_has_line(&editor->doc, line))
+		line = document_line_count(&editor->doc) - 1;
+
+	editor_checkout_line(editor, line);
+	editor->view.top_line = line;
+}
+
+uint8_t editor_prompt(Editor *editor, const char *question, char *answer, const size_t size)
+{
+	size_t len = 0;
+	InputKey in;
+
+	answer[0] = '\0';
+	do {
+		screen_prompt(&editor->screen, question, answer);
+		screen_flush_out(&editor->screen);
+		in = editor_getch(editor);
+		if (in == INPUT_KEY_NONE && editor->input.eof)
+			return 1;
+		switch (in) {
+		case '\n':
+		case '\r':
+			screen_add_menu(&editor->screen);
+			return (len) ? 0 : 1;
+
+		case '\b':
+		case 127:
+			if (len)
+				answer[--len] = '\0';
+		break;
+
+		default:
+			if (in >= ' ' && in < 127 && len + 1 < size) {
+				answer[len++] = in;
+				answer[len] = '\0';
+			}
+		}
+	} while (1);
+}
+
+/*
+	Finds the next match of the search from offset from on, going round
+	to the top of the document if there is none below. Sets wrapped if
+	it had to. Returns non-zero if there is no match at all
+*/
+static uint8_t editor_search_from(Editor *editor, const uint64_t from, uint64_t *match, uint8_t *wrapped)
+{
+	uint64_t end = document_length(&editor->doc);
+
+	*wrapped = 0;
+	if (!search_find(&editor->search, &editor->doc, from, end, match))
+		return 0;
+	if (!search_find(&editor->search, &editor->doc, 0, (from < end) ? from : end, match)) {
+		*wrapped = 1;
+		return 0;
+	}
+	return 1;
+}
+
+/* Puts the cursor at offset, on whatever line that is */
+static void editor_move_to_offset(Editor *editor, const uint64_t offset)
+{
+	editor_checkout_line(editor, document_line_at(&editor->doc, offset));
+	tty_line_buffer_move_to(&editor->line, offset - editor->line_offset);
+}
+
+void editor_search(Editor *editor)
+{
+	char query[SEARCH_MAX + 1], question[48], status[SCREEN_STATUS_MAX];
+	uint64_t origin, match = 0;
+	size_t len = 0;
+	uint8_t found = 0, wrapped = 0, changed = 0, done = 0;
+	InputKey in;
+
+	editor_commit_line(editor);
+	editor->counting = 0;
+	origin = editor->line_offset + editor->line.insertionPoint;
+	query[0] = '\0';
+
+	while (!done) {
+		if (changed) {
+			/* Every change to the text looks again from where the search started */
+			search_init(&editor->search, (const unsigned char *) query, len, editor->search_fold);
+			found = len > 0 && !editor_search_from(editor, origin, &match, &wrapped);
+			changed = 0;
+			editor_move_to_offset(editor, (found) ? match : origin);
+			editor->found = match;
+			editor->found_length = (found) ? len : 0;
+		}
+
+		snprintf(question, sizeof(question), "Search%s%s:", (editor->search_fold) ? " [any case]" : "",
+			(len > 0 && !found) ? " [not found]" : (found && wrapped) ? " [wrapped]" : "");
+		/* The text behind the prompt follows the match */
+		editor->screen.mode = SCREEN_NORMAL;
+		editor_render(editor);
+		screen_prompt(&editor->screen, question, query);
+		screen_flush_out(&editor->screen);
+
+		in = editor_getch(editor);
+		if (in == INPUT_KEY_NONE && editor->input.eof)
+			in = INPUT_KEY_ESCAPE;
+		switch (in) {
+		case '\n':
+		case '\r':
+			done = 1;
+		break;
+
+		case 23: /* Ctrl+W - Next match, or the last search again */
+			if (len == 0 && editor->search_query[0] != '\0') {
+				strcpy(query, editor->search_query);
+				len = strlen(query);
+				changed = 1;
+			} else if (found) {
+				found = !editor_search_from(editor, match + 1, &match, &wrapped);
+				editor_move_to_offset(editor, match);
+				editor->found = match;
+			}
+		break;
+
+		case INPUT_ALT | 'c': /* Alt+C - Match case or not */
+		case INPUT_ALT | 'C':
+			editor->search_fold = !editor->search_fold;
+			changed = 1;
+		break;
+
+		case INPUT_KEY_ESCAPE:
+			editor_move_to_offset(editor, origin);
+			editor->found_length = 0;
+			screen_set_status(&editor->screen, "Cancelled");
+			return;
+
+		case '\b':
+		case 127:
+			/* A character at a time, however many bytes it takes */
+			while (len > 0 && utf8_is_continuation((unsigned char) query[len - 1]))
+				--len;
+			if (len > 0)
+				--len;
+			query[len] = '\0';
+			changed = 1;
+		break;
+
+		default:
+			if ((in == '\t' || (in >= ' ' && in <= 0xFF && in != 127)) && len < SEARCH_MAX) {
+				query[len++] = in;
+				query[len] = '\0';
+				changed = 1;
+			}
+		}
+	}
+
+	if (len == 0)
+		return;
+	strcpy(editor->search_query, query);
+	if (!found) {
+		snprintf(status, sizeof(status), "\"%.*s\" not found", (int) (sizeof(status) - 16), query);
+		screen_set_status(&editor->screen, status);
+		return;
+	}
+
+	/* The first step is counted now, which on most files is all of them */
+	search_tally_start(&editor->tally, &editor->doc, match);
+	editor->search_wrapped = wrapped;
+	editor_count_matches(editor);
+}
+
+/*
+	Types a byte of UTF-8. The bytes of a character are held back in
+	pending until the last of them comes in, and go into the line
+	together, so the line never holds half of one; a byte that cannot
+	continue what is pending lets it through as it is
+*/
+static void editor_input_byte(Editor *editor, const unsigned char c)
+{
+	if (editor->pending_length > 0 && !utf8_is_continuation(c)) {
+		editor_line_insert(editor, editor->pending, editor->pending_length);
+		editor->pending_length = 0;
+	}
+
+	if (editor->pending_length > 0 || utf8_sequence_length(c) > 1) {
+		editor->pending[editor->pending_length++] = c;
+		if (editor->pending_length < utf8_sequence_length(editor->pending[0]))
+			return;
+		editor_line_insert(editor, editor->pending, editor->pending_length);
+		editor->pending_length = 0;
+		return;
+	}
+
+	editor_line_insert(editor, &c, 1);
+}
+
+static EditorKeyKind editor_key_kind(const InputKey in)
+{
+	if (in == '\b' || in == 127 || in == INPUT_KEY_DEL)
+		return EDITOR_KEY_DELETE;
+	if (in == '\t' || (in >= ' ' && in <= 0xFF))
+		return EDITOR_KEY_TYPE;
+	return EDITOR_KEY_OTHER;
+}
+
+void editor_input(Editor *editor, const InputKey in)
+{
+	const unsigned char *str;
+	uint64_t i = 0;
+	size_t len;
+	InputKey key;
+	EditorKeyKind kind = editor_key_kind(in);
+	char answer[24];
+
+	/*
+		Keys of one kind in a row are undone together, anything else on
+		its own. The line is committed first, so that the edits in it go
+		into the group they were made in
+	*/
+	if (kind == EDITOR_KEY_OTHER || kind != editor->key_kind) {
+		editor_commit_line(editor);
+		undo_boundary(&editor->undo);
+	}
+	editor->key_kind = kind;
+	editor->found_length = 0;
 
 	switch (in) {
 	case '\n':
 	case '\r':
-		tty_line_buffer_list_new(&editor->cur);
+		/* Split the line at the cursor */
+		editor->marked = 0;
+		if (editor_commit_line(editor))
+			break;
+		i = editor->line_offset + editor->line.insertionPoint;
+		if (document_insert(&editor->doc, i, (const unsigned char *) "\n", 1))
+			break;
+		editor_edited(editor, editor->line_no, i - editor->line_offset, 0, 1);
 		editor->is_dirty = 1;
-		if (editor->cur->next == NULL) {
-			screen_advance_row(&editor->screen);
-			screen_reset_col(&editor->screen);
-		} else {
-			/*
-				We have to shift the screen-buffer down by one
-			*/
-			screen_advance_row(&editor->screen);
-			screen_shift_down(&editor->screen);
-			screen_reset_col(&editor->screen);
-		}
+		editor_checkout_line(editor, editor->line_no + 1);
 	break;
 
 	case '\b':
 	case 127:
-		if (editor->cur->line.insertionPoint || editor->cur->line.length) {
-			if (editor->cur->line.buffer[editor->cur->line.insertionPoint - 1] == '\t') {
-				screen_move_col_left(&editor->screen);
-				screen_delete(&editor->screen);
-				screen_move_col_left(&editor->screen);
-				screen_delete(&editor->screen);
-				screen_move_col_left(&editor->screen);
-				screen_delete(&editor->screen);
-			}
-			for (i = editor->cur->line.insertionPoint - 1; i < editor->cur->line.length; ++i)
-				editor->cur->line.buffer[i] = editor->cur->line.buffer[i + 1];
-			--editor->cur->line.insertionPoint;
-			--editor->cur->line.length;
-			editor->is_dirty = 1;
-			screen_move_col_left(&editor->screen);
-			screen_delete(&editor->screen);
+		/* The marks on a character go with it */
+		editor->marked = 0;
+		i = tty_line_buffer_prev_grapheme(&editor->line);
+		while (editor->line.insertionPoint > i && !tty_line_buffer_delete_back(&editor->line)) {
+			editor->line_dirty = editor->is_dirty = 1;
+			editor_edited(editor, editor->line_no, editor->line.insertionPoint, 0, 0);
 		}
 	break;
 
-	case 11: /* Ctrl+K - Cut Line */
-		if (editor->cur->prev == NULL) {
+	case 11: /* Ctrl+K - Cut Line, or the region if the mark is set */
+		if (editor->marked) {
+			i = editor->line_offset + editor->line.insertionPoint;
+			if (editor->mark < i)
+				editor_delete_range(editor, editor->mark, i);
+			else
+				editor_delete_range(editor, i, editor->mark);
+			break;
+		}
+		if (editor_commit_line(editor))
+			break;
+		i = editor->line_no;
+		if (!document_has_line(&editor->doc, 1)) {
 			/*
 				If there's only one line, then simply empty the line's buffer
 			*/
-			memset(editor->cur->line.buffer, 0, BUFSIZE);
-			screen_clear_line(&editor->screen);
-			screen_reset_col(&editor->screen);
-			if (editor->cur->next != NULL) {
-				screen_shift_up(&editor->screen, NULL);
-			}
-			screen_retreat_row(&editor->screen);
+			document_delete(&editor->doc, 0, editor->line_length);
+			editor_edited(editor, 0, 0, 0, 0);
+			editor_checkout_line(editor, 0);
+		} else if (!document_has_line(&editor->doc, i + 1)) {
+			/*
+				The last line has no newline of its own, so it takes
+				the one before it along
+			*/
+			document_delete(&editor->doc, editor->line_offset - 1, editor->line_length + 1);
+			editor_edited(editor, i - 1, 0, 1, 0);
+			editor_checkout_line(editor, i - 1);
 		} else {
-			if (!tty_line_buffer_list_del(&editor->cur)) {
-				if (tty_line_buffer_list_length(editor->head) > editor->screen.max_row) {
-					tty_line_buffer_list_grab_line_at(editor->head, editor->screen.max_row, &str);
-					screen_shift_up(&editor->screen, str);
-				} else {
-					screen_shift_up(&editor->screen, NULL);
-				}
-			}
+			document_delete(&editor->doc, editor->line_offset, editor->line_length + 1);
+			editor_edited(editor, i, 0, 1, 0);
+			editor_checkout_line(editor, i);
 		}
+		editor->is_dirty = 1;
 	break;
 
 	case 15: /* Ctrl+O - Save file */
 		screen_ask(&editor->screen, "Save file?");
-        screen_flush_out(&editor->screen);
-        do {
-            tmp = editor_getch();
-            switch (tmp) {
-            case 'y':
-            case 'Y':
-                editor_flush(editor, editor->filename, editor->target);
-            case 'n':
-            case 'N':
-            case 'c':
-            case 'C':
-                tmp = 0;
-            break;
-            }
-        } while (tmp != 0);
+		screen_flush_out(&editor->screen);
+		do {
+			key = editor_getch(editor);
+			switch (key) {
+			case 'y':
+			case 'Y':
+				if (editor_flush(editor, editor->filename))
+					screen_set_status(&editor->screen, "Save failed");
+				key = 0;
+			break;
+
+			case 'n':
+			case 'N':
+			case 'c':
+			case 'C':
+				key = 0;
+			break;
+			}
+			if (key == INPUT_KEY_NONE && editor->input.eof)
+				key = 0;
+		} while (key != 0);
+	break;
+
+	case 20: /* Ctrl+T - Show stats */
+		editor->show_stats = !editor->show_stats;
+		if (!editor->show_stats)
+			screen_set_overlay(&editor->screen, NULL);
 	break;
 
-	case 169: /* DEL key */
-		if (editor->cur->line.insertionPoint < editor->cur->line.length && editor->cur->line.length != 0) {
-			for (i = editor->cur->line.insertionPoint; i < editor->cur->line.length - 1 && editor->cur->line.buffer[i] != '\0'; ++i)
-                editor->cur->line.buffer[i] = editor->cur->line.buffer[i + 1];
-			editor->is_dirty = 1;
-			screen_delete(&editor->screen);
+	case 30: /* Ctrl+^ - Set or unset the mark */
+		if (editor->marked || editor_commit_line(editor)) {
+			editor->marked = 0;
+			screen_set_status(&editor->screen, "Mark unset");
+			break;
 		}
+		editor->mark = editor->line_offset + editor->line.insertionPoint;
+		editor->marked = 1;
+		screen_set_status(&editor->screen, "Mark set");
 	break;
 
-	case 178: /* HOME key */
-		editor->cur->line.insertionPoint = 0;
-		screen_reset_col(&editor->screen);
+	case 23: /* Ctrl+W - Search */
+		editor_search(editor);
 	break;
 
-	case 176: /* END key */
-		editor->cur->line.insertionPoint = editor->cur->line.length;
-		for (i = 0, tmp = 0; i < editor->cur->line.length; ++i)
-			tmp += (editor->cur->line.buffer[i] == '\t') ? TAB_SIZE : 1;
-		screen_set_col(&editor->screen, (unsigned int) tmp);
+	case 31: /* Ctrl+_ - Go to line */
+		if (!editor_prompt(editor, "Go to line:", answer, sizeof(answer)) && (i = strtoull(answer, NULL, 10)) > 0)
+			editor_goto_line(editor, i - 1);
 	break;
 
-	case 183: /* UP arrow key */
-		if (editor->cur->prev != NULL) {
-			i = editor->cur->line.insertionPoint;
-			editor->cur = editor->cur->prev;
-			editor->cur->line.insertionPoint = (editor->cur->line.length <= i) ? editor->cur->line.length : i;
-			screen_retreat_row(&editor->screen);
-			for (i = 0, tmp = 0; i < editor->cur->line.insertionPoint; ++i)
-				tmp += (editor->cur->line.buffer[i] == '\t') ? TAB_SIZE : 1;
-			screen_set_col(&editor->screen, tmp);
+	case INPUT_KEY_DEL:
+		/* What the line is down to once the grapheme is gone */
+		editor->marked = 0;
+		i = editor->line.length - (tty_line_buffer_next_grapheme(&editor->line) - editor->line.insertionPoint);
+		while (editor->line.length > i && !tty_line_buffer_delete_forward(&editor->line)) {
+			editor->line_dirty = editor->is_dirty = 1;
+			editor_edited(editor, editor->line_no, editor->line.insertionPoint, 0, 0);
 		}
 	break;
 
-	case 184: /* DOWN arrow key */
-		if (editor->cur->next != NULL) {
-			i = editor->cur->line.insertionPoint;
-			editor->cur = editor->cur->next;
-			editor->cur->line.insertionPoint = (i >= editor->cur->line.length) ? editor->cur->line.length : i;
-			screen_advance_row(&editor->screen);
-			for (i = 0, tmp = 0; i < editor->cur->line.insertionPoint; ++i)
-				tmp += (editor->cur->line.buffer[i] == '\t') ? TAB_SIZE : 1;
-			screen_set_col(&editor->screen, tmp);
-		}
+	case INPUT_KEY_PASTE:
+		str = input_paste(&editor->input, &len);
+		editor_insert_span(editor, str, len);
+		input_paste_clear(&editor->input);
 	break;
 
-	case 186: /* LEFT arrow key */
-		editor->cur->line.insertionPoint -= (editor->cur->line.insertionPoint) ? 1 : 0;
-		for (i = 0, tmp = 0; i < editor->cur->line.insertionPoint; ++i)
-			tmp += (editor->cur->line.buffer[i] == '\t') ? TAB_SIZE : 1;
-		screen_set_col(&editor->screen, tmp);
+	case INPUT_ALT | 'u': /* Alt+U - Undo */
+	case INPUT_ALT | 'U':
+		editor_undo(editor);
 	break;
 
-	case 185: /* RIGHT arrow key */
-		editor->cur->line.insertionPoint += (editor->cur->line.insertionPoint < editor->cur->line.length) ? 1 : 0;
-		for (i = 0, tmp = 0; i < editor->cur->line.insertionPoint; ++i)
-			tmp += (editor->cur->line.buffer[i] == '\t') ? TAB_SIZE : 1;
-		screen_set_col(&editor->screen, tmp);
+	case INPUT_ALT | 'e': /* Alt+E - Redo */
+	case INPUT_ALT | 'E':
+		editor_redo(editor);
 	break;
 
-	case '\t':
-		if (editor->cur->line.length <= editor->cur->line.insertionPoint) {
-			screen_insert_tab(&editor->screen);
-			editor->cur->line.buffer[editor->cur->line.insertionPoint++] = in;
-		} else {
-			screen_insert_tab_here(&editor->screen, editor->cur->line.insertionPoint);
-			for (i = editor->cur->line.length; i > editor->cur->line.insertionPoint; --i) {
-				editor->cur->line.buffer[i] = editor->cur->line.buffer[i-1];
-				screen_putc_here(&editor->screen, editor->cur->line.buffer[i], i + TAB_SIZE);
-			}
-			++editor->cur->line.insertionPoint;
-		}
-		++editor->cur->line.length;
-		editor->is_dirty = 1;
+	case INPUT_KEY_HOME:
+		tty_line_buffer_move_to(&editor->line, 0);
+	break;
+
+	case INPUT_KEY_END:
+		tty_line_buffer_move_to(&editor->line, editor->line.length);
+	break;
+
+	case INPUT_KEY_UP:
+		if (editor->line_no > 0)
+			editor_move_to_line(editor, editor->line_no - 1);
+	break;
+
+	case INPUT_KEY_DOWN:
+		if (document_has_line(&editor->doc, editor->line_no + 1))
+			editor_move_to_line(editor, editor->line_no + 1);
+	break;
+
+	/*
+		A page moves the view and the cursor by the same number of
+		lines, so the cursor keeps its row on the screen
+	*/
+	case INPUT_KEY_PAGE_UP:
+		i = (editor->line_no > editor->view.height) ? editor->line_no - editor->view.height : 0;
+		editor->view.top_line -= (editor->view.top_line > editor->line_no - i) ? editor->line_no - i : editor->view.top_line;
+		editor_move_to_line(editor, i);
+	break;
+
+	case INPUT_KEY_PAGE_DOWN:
+		i = editor->line_no + editor->view.height;
+		if (!document_has_line(&editor->doc, i))
+			i = document_line_count(&editor->doc) - 1;
+		editor->view.top_line += i - editor->line_no;
+		editor_move_to_line(editor, i);
+	break;
+
+	case INPUT_KEY_LEFT:
+		tty_line_buffer_move_to(&editor->line, tty_line_buffer_prev_grapheme(&editor->line));
+	break;
+
+	case INPUT_KEY_RIGHT:
+		tty_line_buffer_move_to(&editor->line, tty_line_buffer_next_grapheme(&editor->line));
 	break;
 
 	default:
-		if (editor->cur->line.length <= editor->cur->line.insertionPoint)
-			editor->cur->line.buffer[editor->cur->line.insertionPoint++] = in;
-		else {
-			for (i = editor->cur->line.length; i > editor->cur->line.insertionPoint; --i) {
-				editor->cur->line.buffer[i] = editor->cur->line.buffer[i-1];
-				screen_putc_here(&editor->screen, editor->cur->line.buffer[i], i);
-			}
-			editor->cur->line.buffer[editor->cur->line.insertionPoint++] = in;
-		}
-		screen_putc(&editor->screen, in);
-		++editor->cur->line.length;
-		editor->is_dirty = 1;
+		/* Keys we have no binding for */
+		if (in > 0xFF)
+			break;
+		editor->marked = 0;
+		editor_input_byte(editor, in);
 	}
 	screen_add_menu(&editor->screen);
-	if (DO_AUTO_BACKUP) {
-		DO_AUTO_BACKUP = 0;
-		editor_flush(editor, editor->tempname, editor->backup);
-	}
 }
 
 uint8_t editor_safe_exit(Editor *editor)
 {
-	unsigned char in;
+	InputKey in;
 	if (editor == NULL)
 		return 2;
 	if (editor->is_dirty) {
@@ -294,11 +1367,17 @@ uint8_t editor_safe_exit(Editor *editor)
 		screen_ask(&editor->screen, "Really quit?");
 		screen_flush_out(&editor->screen);
 		do {
-			in = editor_getch();
+			in = editor_getch(editor);
+			if (in == INPUT_KEY_NONE && editor->input.eof)
+				return 1;
 			switch (in) {
 			case 'y':
 			case 'Y':
-				editor_flush(editor, editor->filename, editor->target);
+				/* Stay if the file could not be saved */
+				if (editor_flush(editor, editor->filename)) {
+					screen_set_status(&editor->screen, "Save failed");
+					return 0;
+				}
 				return 1;
 
 			case 'n':
@@ -315,90 +1394,118 @@ uint8_t editor_safe_exit(Editor *editor)
 
 void editor_handle_sigint(int signum)
 {
-    signal(signum, SIG_IGN);
     if(editor_safe_exit(gEditor)) {
 	   	editor_release(gEditor);
 		gEditor = NULL;
-		system("stty sane");
 	    exit(0);
 	} else {
 		screen_add_menu(&gEditor->screen);
 		screen_flush_out(&gEditor->screen);
-		signal(signum, editor_handle_sigint);
-	}
-}
-
-unsigned char editor_getch() {
-	unsigned char buf = 0, arrow = 0;
-	struct termios oldstuff;
-	struct termios newstuff;
-
-	tcgetattr(STDIN_FILENO, &oldstuff);
-	newstuff = oldstuff;                  /* save old attributes               */
-	newstuff.c_lflag &= ~(ICANON | ECHO); /* reset "canonical" and "echo" flags*/
-	newstuff.c_cc[VMIN] = 1;
-	newstuff.c_cc[VTIME] = 0;
-	tcsetattr(STDIN_FILENO, TCSANOW, &newstuff); /* set new attributes         */
-	buf = getchar();
-
-	//printf("CHAR=[%d] ", buf);
-
-	if (buf == 27) {
-		arrow = buf & 0xFF;
-		arrow += getchar() & 0xFF;
-		//printf("ARROW.1[%d]", arrow);
-		arrow += getchar() & 0xFF;
-		//printf("ARROW.2[%d]", arrow);
-		switch (arrow) {
-		case 169:	/* DEL key */
-		case 176:	/* END key */
-		case 178:	/* HOME key */
-		case 183:	/* UP arrow key */
-		case 184:	/* DOWN arrow key */
-		case 185:	/* RIGHT arrow key */
-		case 186:	/* LEFT arrow key */
-			break;
-		default: arrow = 0;
-		}
-		if (0 != arrow)
-			buf = arrow;
 	}
+}
 
-	tcsetattr(STDIN_FILENO, TCSANOW, &oldstuff); /* restore old attributes     */
+InputKey editor_getch(Editor *editor)
+{
+	return input_next(&editor->input);
+}
 
-	if (buf == 0x04)
-		buf = EOF;
+uint8_t editor_flush(Editor *editor, const char *fname)
+{
+	char status[SCREEN_STATUS_MAX];
+	struct timespec start, end;
+	struct stat st;
+	uint8_t failed;
 
-	return (buf);
+	if (editor == NULL)
+		return 1;
+
+	editor_commit_line(editor);
+
+	/*
+		The document maps the target as its original buffer, so the file
+		is never written in place: document_save writes a new one and
+		moves it over the old
+	*/
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	failed = document_save(&editor->doc, fname);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if (failed)
+		return 2;
+
+	snprintf(status, sizeof(status), "Saved %" PRIu64 " bytes in %.1f ms", document_length(&editor->doc),
+		(end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) / 1e6);
+	screen_set_status(&editor->screen, status);
+
+	if (!strcmp(fname, editor->filename) && !stat(fname, &st)) {
+		/* The journal so far is for the old file, start a new one */
+		journal_header(&editor->journal_header, &st);
+		journal_clear(&editor->journal);
+		editor->journal_restart = 1;
+		editor->is_dirty = 0;
+	}
+
+	return 0;
 }
 
-void editor_flush(Editor *editor, const char *fname, FILE *sink)
+void editor_perform_backup(Editor *editor)
 {
-	TtyLineBufferList *cur = NULL;
-	size_t i = 0;
+	DocumentSnapshot snap;
+	uint64_t length;
 
 	if (editor == NULL)
 		return;
-	if (sink == NULL)
-		return;
 
-	freopen(fname, "w", sink);
+	editor_commit_line(editor);
+	length = editor->journal.length;
+	if (length == 0)
+		return;
 
-	cur = editor->head;
-	while (cur != NULL) {
-		for (i = 0; i < cur->line.length; ++i)
-			fputc(cur->line.buffer[i], sink);
-		cur = cur->next;
-		if (cur != NULL)
-			fputc('\n', sink);
+	if (editor->journal_restart) {
+		backup_restart(&editor->backup, &editor->journal_header, NULL);
+		editor->journal_size = sizeof(JournalHeader);
+		editor->journal_restart = 0;
+	} else if (editor->journal_size + length > JOURNAL_COMPACT_MIN
+		&& editor->journal_size + length > document_length(&editor->doc)) {
+		/* Replaying the journal would cost more than the text itself: compact */
+		if (document_snapshot(&editor->doc, &snap))
+			return;
+		editor->journal_size = sizeof(JournalHeader) + sizeof(JournalRecord) + snap.length;
+		backup_restart(&editor->backup, &editor->journal_header, &snap);
+		journal_clear(&editor->journal);
+		editor_show_backup(editor);
+		return;
 	}
+
+	if (backup_append(&editor->backup, &editor->journal))
+		return;
+	editor->journal_size += length;
+	editor_show_backup(editor);
 }
 
-void editor_perform_backup(int signum)
+void editor_show_backup(Editor *editor)
 {
-	signal(SIGALRM, SIG_IGN);
-	//editor_flush(gEditor, gEditor->tempname, gEditor->backup);
-	DO_AUTO_BACKUP = 1;
-	signal(SIGALRM, editor_perform_backup);
-	alarm(BACKUP_TIMEOUT);
+	char status[SCREEN_STATUS_MAX];
+	struct tm when;
+	time_t last;
+
+	switch (backup_status(&editor->backup, &last)) {
+	case BACKUP_IDLE:
+		status[0] = '\0';
+	break;
+
+	case BACKUP_RUNNING:
+		strcpy(status, "Backing up...");
+	break;
+
+	case BACKUP_DONE:
+		localtime_r(&last, &when);
+		strftime(status, sizeof(status), "Backup %H:%M:%S", &when);
+	break;
+
+	case BACKUP_FAILED:
+		strcpy(status, "Backup failed");
+	break;
+	}
+
+	screen_set_status(&editor->screen, status);
 }
@@ -2,23 +2,123 @@
 #define _EDITOR_H_INCLUDED
 
 #include "tty.h"
+#include "terminal.h"
 #include "screen.h"
+#include "document.h"
+#include "input.h"
+#include "backup.h"
+#include "viewport.h"
+#include "highlight.h"
+#include "stats.h"
+#include "undo.h"
+#include "search.h"
 
 #define BACKUP_TIMEOUT	5
 
+/**
+ *	Longest time (in milliseconds) keys that keep coming are taken in
+ *	before a frame is drawn for them
+ */
+#define EDITOR_BATCH_MAX	50
+
+/**
+ *	Number of long lines other than the one being edited whose column
+ *	checkpoints are kept
+ */
+#define EDITOR_COLUMN_LINES	32
+
+/**
+ *	What a key does, as far as undoing it goes
+ *		1. EDITOR_KEY_OTHER - anything else, which is undone on its own
+ *		2. EDITOR_KEY_TYPE - types a byte
+ *		3. EDITOR_KEY_DELETE - deletes a character
+ *	Keys of the same kind in a row are undone together
+ */
+typedef enum _editor_key_kind {
+	EDITOR_KEY_OTHER, EDITOR_KEY_TYPE, EDITOR_KEY_DELETE
+} EditorKeyKind;
+
 /**
  *	Represents an editor-session
+ *	The screen is drawn on term, which ttyInfo has the size of.
+ *	The text lives in doc. The line under the cursor is checked out of
+ *	it into line, a gap buffer, so that typing stays cheap; it is
+ *	written back (committed) before anything else reads the document.
+ *	line_offset and line_length describe where that line sits in doc.
+ *	Edits to doc are recorded in undo, grouped by the keys that made
+ *	them (key_kind is the kind of the last one), and in journal until the
+ *	backup thread takes them; journal_size is how big the journal file will be by then, and
+ *	journal_restart is set while the file still has to be started over
+ *	for the current version of the target. view is the part of the
+ *	document shown in the editor's rows of the screen, coloured by hl.
+ *	columns holds the column checkpoints of the long lines drawn last,
+ *	the slot at column_next taken next; the line being edited takes its
+ *	own out of them while it is checked out. scratch is where lines that are not in one piece are gathered to be
+ *	lexed. read_line is the last line looked up in doc, which starts at
+ *	read_offset and is read_length bytes long as of revision
+ *	read_revision, so that lines read one after another are found from
+ *	the one before. pending holds the first bytes of a UTF-8 character being
+ *	typed until the rest of it comes in. While marked is set, mark is
+ *	the offset in doc of the other end of the region from the cursor;
+ *	any edit drops it. search is the last search made, for the text in
+ *	search_query, ignoring case if search_fold is set; the match it is
+ *	on, found_length bytes at found, is shown until the next key. While
+ *	counting is set, tally is counting its matches between keys, for the
+ *	match found on a search that wrapped if search_wrapped is set. stats
+ *	times every stage a key goes through, and is shown on the menu bar
+ *	while show_stats is set. Frames are drawn at least frame_interval
+ *	nanoseconds apart (0 for no limit), the last one at frame_last. lost
+ *	is set once the editor has said that the file was cut short on disk
  */
 typedef struct _editor {
+	Terminal term;
 	TtyInfo ttyInfo;
 	const char *filename;
 	char *tempname;
 	FILE *target;
-	FILE *backup;
-	TtyLineBufferList *head;
-	TtyLineBufferList *cur;
+	Backup backup;
+	Journal journal;
+	JournalHeader journal_header;
+	uint64_t journal_size;
+	uint8_t journal_restart;
+	Undo undo;
+	EditorKeyKind key_kind;
+	Document doc;
+	TtyLineBuffer line;
+	uint64_t line_no;
+	uint64_t line_offset;
+	uint64_t line_length;
+	uint8_t line_dirty;
 	Screen screen;
+	Viewport view;
+	Highlight hl;
+	TtyColumnMarks columns[EDITOR_COLUMN_LINES];
+	uint64_t column_next;
+	unsigned char *scratch;
+	uint64_t scratch_size;
+	uint64_t read_line;
+	uint64_t read_offset;
+	uint64_t read_length;
+	uint64_t read_revision;
+	Input input;
+	unsigned char pending[4];
+	uint8_t pending_length;
 	uint8_t is_dirty;
+	uint8_t marked;
+	uint64_t mark;
+	Search search;
+	char search_query[SEARCH_MAX + 1];
+	uint8_t search_fold;
+	uint64_t found;
+	uint64_t found_length;
+	SearchTally tally;
+	uint8_t counting;
+	uint8_t search_wrapped;
+	Stats stats;
+	uint8_t show_stats;
+	uint64_t frame_interval;
+	uint64_t frame_last;
+	uint8_t lost;
 } Editor;
 
 /**
@@ -27,15 +127,21 @@ typedef struct _editor {
 extern Editor *gEditor;
 
 /**
- *  Callback to handle SIGINT
+ *  Handle SIGINT, as picked up by the main loop
  */
 extern void editor_handle_sigint(int signum);
 
 /**
- *	Initialize editor
+ *	Initialize editor, on the terminal on standard output
  */
 extern uint8_t editor_init(Editor *editor, const char *tgt);
 
+/**
+ *	Initialize editor, drawing on term. Keys are still read from
+ *	standard input
+ */
+extern uint8_t editor_init_terminal(Editor *editor, const char *tgt, const Terminal *term);
+
 /**
  *	Cleanup editor session
  */
@@ -44,10 +150,98 @@ extern void editor_release(Editor *editor);
 /**
  *	Load file contents if content already exists
  */
-extern void editor_load_from_file(Editor *editor);
+extern uint8_t editor_load_from_file(Editor *editor);
+
+/**
+ *	Write the line being edited back into the document
+ */
+extern uint8_t editor_commit_line(Editor *editor);
 
 /**
- *	Editor's main loop
+ *	Commit the current line and check out the specified one
+ */
+extern void editor_checkout_line(Editor *editor, const uint64_t line);
+
+/**
+ *	Insert len bytes of text at the cursor in one go, however many lines
+ *	it spans, leaving the cursor after it
+ */
+extern uint8_t editor_insert_span(Editor *editor, const unsigned char *str, const uint64_t len);
+
+/**
+ *	Delete the text from offset from up to offset to in one go, however
+ *	many lines it spans, leaving the cursor where it started
+ */
+extern uint8_t editor_delete_range(Editor *editor, const uint64_t from, const uint64_t to);
+
+/**
+ *	Revert the last group of edits, leaving the cursor where they were
+ *	made. Returns non-zero if there is nothing to undo
+ */
+extern uint8_t editor_undo(Editor *editor);
+
+/**
+ *	Make the last group of edits that was undone again. Returns non-zero
+ *	if there is nothing to redo
+ */
+extern uint8_t editor_redo(Editor *editor);
+
+/**
+ *	Move the screen cursor to the visual column of the insertion point
+ */
+extern void editor_place_cursor(Editor *editor);
+
+/**
+ *	Draw the lines in the viewport into the screen, scrolling first if
+ *	the cursor is outside of it
+ */
+extern void editor_render(Editor *editor);
+
+/**
+ *	Draw the specified line of the document into a row of the screen,
+ *	highlighting it from the lexer state it starts in. Returns the state
+ *	it ends in
+ */
+extern uint8_t editor_draw_line(Editor *editor, const uint16_t row, const uint64_t line, const uint8_t state);
+
+/**
+ *	Move the cursor to the specified line, keeping its visual column
+ *	rather than its byte offset so that it stays put over tabs
+ */
+extern void editor_move_to_line(Editor *editor, const uint64_t line);
+
+/**
+ *	Jump to the specified line, bringing it to the top of the screen
+ */
+extern void editor_goto_line(Editor *editor, uint64_t line);
+
+/**
+ *	Read a line of text from the user into answer. Returns non-zero if
+ *	nothing was entered
+ */
+extern uint8_t editor_prompt(Editor *editor, const char *question, char *answer, const size_t size);
+
+/**
+ *	Search for text as it is typed in, from the cursor on and then from
+ *	the top, moving the cursor to the match. Ctrl+W goes on to the next
+ *	match (or brings back the last search if nothing was typed yet),
+ *	Alt+C switches case on or off and Escape goes back to where the
+ *	search started. Enter leaves the cursor on the match and counts the
+ *	matches
+ */
+extern void editor_search(Editor *editor);
+
+/**
+ *	Rebuild the screen after the terminal changed size
+ */
+extern void editor_resize(Editor *editor);
+
+/**
+ *	Editor's main loop. Waits on the terminal, the backup timer and
+ *	signals at once, and handles each as soon as it is ready. Keys that
+ *	come in while others are being handled are taken in with them, and
+ *	the screen is drawn once for the lot. QWERTY_FPS caps how many
+ *	frames are drawn a second
  */
 extern void editor_loopy(Editor *editor);
 
@@ -59,21 +253,30 @@ extern uint8_t editor_safe_exit(Editor *editor);
 /**
  *	Respond to input
  */
-extern void editor_input(Editor *editor, const unsigned char in);
+extern void editor_input(Editor *editor, const InputKey in);
+
+/**
+ *	Grab the next key
+ */
+extern InputKey editor_getch(Editor *editor);
 
 /**
- *	Grab a character
+ *	Save the document to the specified file, reporting how long it took
+ *	in the status area. If it could not be saved, telling the user is
+ *	left to the caller
  */
-extern unsigned char editor_getch();
+extern uint8_t editor_flush(Editor *editor, const char *fname);
 
 /**
- *	Flush lines to specified file
+ *	Backup data, run every BACKUP_TIMEOUT seconds by the main loop. Only
+ *	hands the edits made since the last run to the backup thread, or a
+ *	snapshot once the journal has grown bigger than the document
  */
-extern void editor_flush(Editor *editor, const char *fname, FILE *sink);
+extern void editor_perform_backup(Editor *editor);
 
 /**
- *	Backup data every five seconds
+ *	Show the state of the backup in the status area
  */
-extern void editor_perform_backup(int signum);
+extern void editor_show_backup(Editor *editor);
 
 #endif /* _EDITOR_H_INCLUDED */
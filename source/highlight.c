@@ -0,0 +1,729 @@
+#define _GNU_SOURCE
+#include "highlight.h"
+#include "screen.h"
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+/*
+	States a line can end in, per language. 0 is where every file starts.
+	A comment to the end of the line never carries over: the states for
+	those only ever start a checkpoint inside one
+*/
+enum {
+	C_NORMAL, C_COMMENT, C_LINE_COMMENT
+};
+
+enum {
+	SHELL_NORMAL, SHELL_DOUBLE, SHELL_SINGLE, SHELL_COMMENT
+};
+
+/*
+	INI lines carry nothing over, these are only ever the state part of a
+	line is in: the start of it, or the kind of text it is in
+*/
+enum {
+	INI_START, INI_PLAIN, INI_COMMENT, INI_SECTION, INI_KEY
+};
+
+static const char *C_KEYWORDS[] = {
+	"break", "case", "continue", "default", "do", "else", "enum", "extern", "for", "goto", "if",
+	"inline", "register", "restrict", "return", "sizeof", "static", "struct", "switch", "typedef",
+	"union", "volatile", "while", "const", NULL
+};
+
+static const char *C_TYPES[] = {
+	"char", "double", "float", "int", "long", "short", "signed", "unsigned", "void", "size_t",
+	"ssize_t", "int8_t", "int16_t", "int32_t", "int64_t", "uint8_t", "uint16_t", "uint32_t",
+	"uint64_t", "FILE", NULL
+};
+
+static const char *SHELL_KEYWORDS[] = {
+	"if", "then", "else", "elif", "fi", "for", "while", "until", "do", "done", "case", "esac", "in",
+	"function", "select", "return", "local", "export", "readonly", "shift", "exit", NULL
+};
+
+static const char *JSON_KEYWORDS[] = {
+	"true", "false", "null", NULL
+};
+
+/*
+	Where the attribute of each byte goes: attrs holds the bytes from
+	from up to to of the line. The text being lexed starts at byte base
+	of the line, and if marks is set, the checkpoints the lexer gets past
+	are added to it
+*/
+typedef struct _highlight_paint {
+	uint8_t *attrs;
+	uint64_t from;
+	uint64_t to;
+	uint64_t base;
+	HighlightLongLine *marks;
+} HighlightPaint;
+
+static void highlight_paint(const HighlightPaint *p, uint64_t start, uint64_t end, const uint8_t attr)
+{
+	if (p->attrs == NULL)
+		return;
+	start += p->base;
+	end += p->base;
+	if (start < p->from)
+		start = p->from;
+	if (end > p->to)
+		end = p->to;
+	for (; start < end; ++start)
+		p->attrs[start - p->from] = attr;
+}
+
+/*
+	Adds a checkpoint at byte i of the text, where the lexer is about to
+	start on a token in state, if the last one is far enough behind
+*/
+static void highlight_mark(const HighlightPaint *p, const uint64_t i, const uint8_t state)
+{
+	HighlightLongLine *ll = p->marks;
+	HighlightCheckpoint *tmp;
+
+	if (ll == NULL || p->base + i < ll->points[ll->count - 1].offset + HIGHLIGHT_CHECKPOINT)
+		return;
+	if (ll->count == ll->capacity) {
+		tmp = (HighlightCheckpoint *) realloc(ll->points, sizeof(HighlightCheckpoint) * ll->capacity * 2);
+		if (tmp == NULL)
+			return;
+		ll->points = tmp;
+		ll->capacity *= 2;
+	}
+	ll->points[ll->count].offset = p->base + i;
+	ll->points[ll->count++].state = state;
+}
+
+/*
+	Adds the checkpoints in a run of the text from i up to j that the
+	lexer can start over from anywhere in, in state
+*/
+static void highlight_mark_run(const HighlightPaint *p, uint64_t i, const uint64_t j, const uint8_t state)
+{
+	uint64_t next;
+
+	if (p->marks == NULL)
+		return;
+	for (; i < j; i = next) {
+		highlight_mark(p, i, state);
+		next = p->marks->points[p->marks->count - 1].offset + HIGHLIGHT_CHECKPOINT - p->base;
+		if (next <= i)
+			break;
+	}
+}
+
+static uint8_t highlight_is_word(const unsigned char c)
+{
+	return isalnum(c) || c == '_';
+}
+
+/*
+	Whether the len bytes of word are one of the words in list
+*/
+static uint8_t highlight_in_list(const char **list, const unsigned char *word, const uint64_t len)
+{
+	for (; *list != NULL; ++list) {
+		if (strlen(*list) == len && !memcmp(*list, word, len))
+			return 1;
+	}
+	return 0;
+}
+
+/*
+	Finds the end of a quoted run that starts just past its opening
+	quote at i. Returns len if the line ends first
+*/
+static uint64_t highlight_skip_quoted(const unsigned char *text, const uint64_t len, uint64_t i, const unsigned char quote)
+{
+	for (; i < len; ++i) {
+		if (text[i] == '\\')
+			++i;
+		else if (text[i] == quote)
+			return i + 1;
+	}
+	return len;
+}
+
+static uint8_t highlight_lex_c(uint8_t state, const unsigned char *text, const uint64_t len, const HighlightPaint *p)
+{
+	uint64_t i = 0, j;
+	const unsigned char *end;
+
+	for (j = 0; j < len && isspace(text[j]); ++j);
+	if (p->base == 0 && state == C_NORMAL && j < len && text[j] == '#') {
+		/* A preprocessor directive */
+		for (++j; j < len && isspace(text[j]); ++j);
+		for (; j < len && highlight_is_word(text[j]); ++j);
+		highlight_paint(p, 0, j, SCREEN_ATTR_BLUE);
+		i = j;
+	}
+
+	while (i < len) {
+		highlight_mark(p, i, state);
+		if (state == C_LINE_COMMENT) {
+			highlight_paint(p, i, len, SCREEN_ATTR_CYAN);
+			return C_NORMAL;
+		}
+		if (state == C_COMMENT) {
+			end = (const unsigned char *) memmem(text + i, len - i, "*/", 2);
+			j = (end != NULL) ? (uint64_t) (end - text) + 2 : len;
+			highlight_paint(p, i, j, SCREEN_ATTR_CYAN);
+			highlight_mark_run(p, i, (end != NULL) ? j - 2 : len, C_COMMENT);
+			if (end == NULL)
+				return C_COMMENT;
+			state = C_NORMAL;
+			i = j;
+			continue;
+		}
+
+		if (text[i] == '/' && i + 1 < len && text[i + 1] == '*') {
+			state = C_COMMENT;
+			highlight_paint(p, i, i + 2, SCREEN_ATTR_CYAN);
+			i += 2;
+		} else if (text[i] == '/' && i + 1 < len && text[i + 1] == '/') {
+			highlight_paint(p, i, len, SCREEN_ATTR_CYAN);
+			highlight_mark_run(p, i, len, C_LINE_COMMENT);
+			i = len;
+		} else if (text[i] == '"' || text[i] == '\'') {
+			j = highlight_skip_quoted(text, len, i + 1, text[i]);
+			highlight_paint(p, i, j, SCREEN_ATTR_RED);
+			i = j;
+		} else if (isdigit(text[i]) || (text[i] == '.' && i + 1 < len && isdigit(text[i + 1]))) {
+			for (j = i + 1; j < len && (highlight_is_word(text[j]) || text[j] == '.'); ++j);
+			highlight_paint(p, i, j, SCREEN_ATTR_MAGENTA);
+			i = j;
+		} else if (highlight_is_word(text[i])) {
+			for (j = i + 1; j < len && highlight_is_word(text[j]); ++j);
+			if (highlight_in_list(C_KEYWORDS, text + i, j - i))
+				highlight_paint(p, i, j, SCREEN_ATTR_YELLOW);
+			else if (highlight_in_list(C_TYPES, text + i, j - i))
+				highlight_paint(p, i, j, SCREEN_ATTR_GREEN);
+			i = j;
+		} else {
+			++i;
+		}
+	}
+	return state;
+}
+
+/*
+	Paints a variable starting at the $ at i, returning where it ends
+*/
+static uint64_t highlight_shell_variable(const unsigned char *text, const uint64_t len, const uint64_t i, const HighlightPaint *p)
+{
+	uint64_t j = i + 1;
+
+	if (j < len && text[j] == '{') {
+		for (; j < len && text[j] != '}'; ++j);
+		j += (j < len) ? 1 : 0;
+	} else if (j < len && highlight_is_word(text[j])) {
+		for (; j < len && highlight_is_word(text[j]); ++j);
+	} else if (j < len && text[j] != '\0' && strchr("@*#?$!-", text[j]) != NULL) {
+		++j;
+	} else {
+		return j;
+	}
+	highlight_paint(p, i, j, SCREEN_ATTR_MAGENTA);
+	return j;
+}
+
+static uint8_t highlight_lex_shell(uint8_t state, const unsigned char *text, const uint64_t len, const HighlightPaint *p)
+{
+	uint64_t i = 0, j;
+
+	while (i < len) {
+		/* Starting over right after a blank tells a comment from a # in a word */
+		if (state != SHELL_NORMAL || (i > 0 && isspace(text[i - 1])))
+			highlight_mark(p, i, state);
+		if (state == SHELL_COMMENT) {
+			highlight_paint(p, i, len, SCREEN_ATTR_CYAN);
+			return SHELL_NORMAL;
+		}
+		if (state == SHELL_SINGLE) {
+			for (j = i; j < len && text[j] != '\''; ++j);
+			highlight_paint(p, i, (j < len) ? j + 1 : len, SCREEN_ATTR_RED);
+			highlight_mark_run(p, i, j, SHELL_SINGLE);
+			if (j == len)
+				return SHELL_SINGLE;
+			state = SHELL_NORMAL;
+			i = j + 1;
+			continue;
+		}
+
+		if (state == SHELL_DOUBLE) {
+			/* Variables are still expanded inside double quotes */
+			for (j = i; j < len && text[j] != '"'; ++j) {
+				if (text[j] == '\\') {
+					highlight_paint(p, j, j + 2, SCREEN_ATTR_RED);
+					++j;
+				} else if (text[j] == '$') {
+					j = highlight_shell_variable(text, len, j, p) - 1;
+				} else {
+					highlight_paint(p, j, j + 1, SCREEN_ATTR_RED);
+				}
+			}
+			if (j >= len)
+				return SHELL_DOUBLE;
+			highlight_paint(p, j, j + 1, SCREEN_ATTR_RED);
+			state = SHELL_NORMAL;
+			i = j + 1;
+			continue;
+		}
+
+		if (text[i] == '\\') {
+			i += 2;
+		} else if (text[i] == '#' && (i == 0 || isspace(text[i - 1]))) {
+			highlight_paint(p, i, len, SCREEN_ATTR_CYAN);
+			highlight_mark_run(p, i, len, SHELL_COMMENT);
+			i = len;
+		} else if (text[i] == '\'') {
+			highlight_paint(p, i, i + 1, SCREEN_ATTR_RED);
+			state = SHELL_SINGLE;
+			++i;
+		} else if (text[i] == '"') {
+			highlight_paint(p, i, i + 1, SCREEN_ATTR_RED);
+			state = SHELL_DOUBLE;
+			++i;
+		} else if (text[i] == '$') {
+			i = highlight_shell_variable(text, len, i, p);
+		} else if (highlight_is_word(text[i])) {
+			for (j = i + 1; j < len && (highlight_is_word(text[j]) || text[j] == '-'); ++j);
+			if (highlight_in_list(SHELL_KEYWORDS, text + i, j - i))
+				highlight_paint(p, i, j, SCREEN_ATTR_YELLOW);
+			i = j;
+		} else {
+			++i;
+		}
+	}
+	return state;
+}
+
+static uint8_t highlight_lex_json(const unsigned char *text, const uint64_t len, const HighlightPaint *p)
+{
+	uint64_t i = 0, j, k;
+
+	while (i < len) {
+		highlight_mark(p, i, 0);
+		if (text[i] == '"') {
+			j = highlight_skip_quoted(text, len, i + 1, '"');
+			/* A string followed by a colon is a key */
+			for (k = j; k < len && isspace(text[k]); ++k);
+			highlight_paint(p, i, j, (k < len && text[k] == ':') ? SCREEN_ATTR_BLUE : SCREEN_ATTR_RED);
+			i = j;
+		} else if (isdigit(text[i]) || text[i] == '-') {
+			for (j = i + 1; j < len && (isalnum(text[j]) || (text[j] != '\0' && strchr(".+-", text[j]) != NULL)); ++j);
+			highlight_paint(p, i, j, SCREEN_ATTR_MAGENTA);
+			i = j;
+		} else if (isalpha(text[i])) {
+			for (j = i + 1; j < len && isalpha(text[j]); ++j);
+			if (highlight_in_list(JSON_KEYWORDS, text + i, j - i))
+				highlight_paint(p, i, j, SCREEN_ATTR_YELLOW);
+			i = j;
+		} else {
+			++i;
+		}
+	}
+	return 0;
+}
+
+static uint8_t highlight_lex_ini(uint8_t state, const unsigned char *text, const uint64_t len, const HighlightPaint *p)
+{
+	uint64_t i = 0, j;
+
+	if (state == INI_START) {
+		for (; i < len && isspace(text[i]); ++i);
+		if (i == len)
+			return 0;
+		if (text[i] == ';' || text[i] == '#') {
+			state = INI_COMMENT;
+		} else if (text[i] == '[') {
+			state = INI_SECTION;
+		} else {
+			/* Only a name followed by = or : is a key; until one is seen, nothing can be marked */
+			for (j = i; j < len && text[j] != '=' && text[j] != ':'; ++j);
+			if (j == len)
+				return 0;
+			state = INI_KEY;
+		}
+	}
+
+	/* A line is one run of a kind of text, then plain text to its end */
+	switch (state) {
+	case INI_COMMENT:
+		j = len;
+		highlight_paint(p, i, j, SCREEN_ATTR_CYAN);
+	break;
+
+	case INI_SECTION:
+		for (j = i; j < len && text[j] != ']'; ++j);
+		j += (j < len) ? 1 : 0;
+		highlight_paint(p, i, j, SCREEN_ATTR_BOLD_BLUE);
+	break;
+
+	case INI_KEY:
+		for (j = i; j < len && text[j] != '=' && text[j] != ':'; ++j);
+		highlight_paint(p, i, j, SCREEN_ATTR_YELLOW);
+	break;
+
+	default:
+		j = i;
+	}
+	highlight_mark_run(p, i, j, state);
+	highlight_mark_run(p, j, len, INI_PLAIN);
+	return 0;
+}
+
+void highlight_init(Highlight *hl, const char *filename)
+{
+	size_t i;
+
+	memset(hl, 0, sizeof(Highlight));
+	hl->language = highlight_language(filename);
+	for (i = 0; i < HIGHLIGHT_LONG_LINES; ++i)
+		hl->longs[i].line = UINT64_MAX;
+}
+
+void highlight_release(Highlight *hl)
+{
+	size_t i;
+
+	for (i = 0; i < HIGHLIGHT_LONG_LINES; ++i) {
+		free(hl->longs[i].points);
+		hl->longs[i].points = NULL;
+		hl->longs[i].line = UINT64_MAX;
+		hl->longs[i].count = hl->longs[i].capacity = 0;
+	}
+	free(hl->states);
+	free(hl->guesses);
+	hl->states = hl->guesses = NULL;
+	hl->count = hl->capacity = hl->valid = hl->settled = 0;
+	hl->guess_first = hl->guess_count = hl->guess_capacity = 0;
+}
+
+HighlightLanguage highlight_language(const char *filename)
+{
+	static const char *c[] = { "c", "h", "cc", "cpp", "cxx", "hh", "hpp", "hxx", NULL };
+	static const char *shell[] = { "sh", "bash", "zsh", "ksh", NULL };
+	static const char *json[] = { "json", NULL };
+	static const char *ini[] = { "ini", "cfg", "conf", "desktop", "service", NULL };
+	const char *base = strrchr(filename, '/'), *ext;
+
+	base = (base != NULL) ? base + 1 : filename;
+	ext = strrchr(base, '.');
+	if (ext == NULL || ext == base)
+		return HIGHLIGHT_NONE;
+	++ext;
+
+	if (highlight_in_list(c, (const unsigned char *) ext, strlen(ext)))
+		return HIGHLIGHT_C;
+	if (highlight_in_list(shell, (const unsigned char *) ext, strlen(ext)))
+		return HIGHLIGHT_SHELL;
+	if (highlight_in_list(json, (const unsigned char *) ext, strlen(ext)))
+		return HIGHLIGHT_JSON;
+	if (highlight_in_list(ini, (const unsigned char *) ext, strlen(ext)))
+		return HIGHLIGHT_INI;
+	return HIGHLIGHT_NONE;
+}
+
+/*
+	Whether what a line ends in carries over to the next one. Otherwise
+	every line starts in state 0
+*/
+static uint8_t highlight_carries(const HighlightLanguage language)
+{
+	return language == HIGHLIGHT_C || language == HIGHLIGHT_SHELL;
+}
+
+static uint8_t highlight_run(const HighlightLanguage language, const uint8_t state, const unsigned char *text,
+	const uint64_t len, const HighlightPaint *p)
+{
+	switch (language) {
+	case HIGHLIGHT_C:
+		return highlight_lex_c(state, text, len, p);
+	case HIGHLIGHT_SHELL:
+		return highlight_lex_shell(state, text, len, p);
+	case HIGHLIGHT_JSON:
+		return highlight_lex_json(text, len, p);
+	case HIGHLIGHT_INI:
+		return highlight_lex_ini(state, text, len, p);
+	default:
+		return 0;
+	}
+}
+
+uint8_t highlight_lex(const HighlightLanguage language, const uint8_t state, const unsigned char *text,
+	const uint64_t len, uint8_t *attrs, const uint64_t from, const uint64_t count)
+{
+	HighlightPaint p;
+
+	p.attrs = attrs;
+	p.from = from;
+	p.to = from + count;
+	p.base = 0;
+	p.marks = NULL;
+	if (attrs != NULL)
+		memset(attrs, SCREEN_ATTR_NORMAL, count);
+	return highlight_run(language, state, text, len, &p);
+}
+
+/*
+	Makes room for count states in array, which has room for capacity
+*/
+static uint8_t highlight_reserve(uint8_t **array, uint64_t *capacity, const uint64_t count)
+{
+	uint64_t size;
+	uint8_t *tmp;
+
+	if (count <= *capacity)
+		return 0;
+	size = (*capacity) ? *capacity : 256;
+	while (size < count)
+		size *= 2;
+
+	tmp = (uint8_t *) realloc(*array, size);
+	if (tmp == NULL)
+		return 1;
+	*array = tmp;
+	*capacity = size;
+	return 0;
+}
+
+/*
+	Gets the state line starts in, from the guesses, lexing on from the
+	last of them if line is not too far past it, and starting them over
+	HIGHLIGHT_SYNC_LINES above line otherwise
+*/
+static uint8_t highlight_guess(Highlight *hl, const uint64_t line, HighlightReader read, void *ctx)
+{
+	const unsigned char *text;
+	uint64_t i, len;
+	uint8_t state = 0;
+
+	if (hl->guess_count == 0 || line <= hl->guess_first || line - 1 > hl->guess_first + hl->guess_count + HIGHLIGHT_SYNC_LINES) {
+		hl->guess_first = line - HIGHLIGHT_SYNC_LINES;
+		hl->guess_count = 0;
+	}
+	if (line - 1 < hl->guess_first + hl->guess_count)
+		return hl->guesses[line - 1 - hl->guess_first];
+
+	if (highlight_reserve(&hl->guesses, &hl->guess_capacity, line - hl->guess_first)) {
+		/* No room to keep them: guess once more, for this line alone */
+		hl->guess_count = 0;
+		for (i = line - HIGHLIGHT_SYNC_LINES; i < line; ++i) {
+			len = UINT64_MAX;
+			text = read(ctx, i, 0, &len);
+			state = highlight_lex(hl->language, state, text, len, NULL, 0, 0);
+		}
+		return state;
+	}
+
+	if (hl->guess_count)
+		state = hl->guesses[hl->guess_count - 1];
+	for (i = hl->guess_first + hl->guess_count; i < line; ++i) {
+		len = UINT64_MAX;
+		text = read(ctx, i, 0, &len);
+		state = highlight_lex(hl->language, state, text, len, NULL, 0, 0);
+		hl->guesses[hl->guess_count++] = state;
+	}
+	return state;
+}
+
+uint8_t highlight_line_state(Highlight *hl, const uint64_t line, HighlightReader read, void *ctx)
+{
+	const unsigned char *text;
+	uint64_t i, len;
+	uint8_t state = 0;
+
+	if (!highlight_carries(hl->language) || line == 0)
+		return 0;
+	if (line <= hl->valid)
+		return hl->states[line - 1];
+
+	/* Too far to catch up with: make a guess, and leave the cache alone */
+	if (line - hl->valid > HIGHLIGHT_SYNC_LINES)
+		return highlight_guess(hl, line, read, ctx);
+	if (highlight_reserve(&hl->states, &hl->capacity, line)) {
+		for (i = line - ((line > HIGHLIGHT_SYNC_LINES) ? HIGHLIGHT_SYNC_LINES : line); i < line; ++i) {
+			len = UINT64_MAX;
+			text = read(ctx, i, 0, &len);
+			state = highlight_lex(hl->language, state, text, len, NULL, 0, 0);
+		}
+		return state;
+	}
+
+	if (hl->valid)
+		state = hl->states[hl->valid - 1];
+	while (hl->valid < line) {
+		i = hl->valid;
+		len = UINT64_MAX;
+		text = read(ctx, i, 0, &len);
+		state = highlight_lex(hl->language, state, text, len, NULL, 0, 0);
+		if (i < hl->count && i + 1 >= hl->settled && hl->states[i] == state) {
+			/* Back in step with what the lines after the edit were lexed in */
+			hl->valid = hl->count;
+			state = hl->states[hl->count - 1];
+			continue;
+		}
+		hl->states[i] = state;
+		if (++hl->valid > hl->count)
+			hl->count = hl->valid;
+	}
+	return hl->states[line - 1];
+}
+
+/*
+	Gets the checkpoints of line, lexed from state, taking the slot that
+	was used the longest ago if it has none yet. NULL if there is no room
+	for them
+*/
+static HighlightLongLine *highlight_long_line(Highlight *hl, const uint64_t line, const uint8_t state)
+{
+	HighlightLongLine *ll = NULL;
+	size_t i;
+
+	for (i = 0; i < HIGHLIGHT_LONG_LINES && ll == NULL; ++i)
+		if (hl->longs[i].line == line)
+			ll = &hl->longs[i];
+	if (ll == NULL) {
+		ll = &hl->longs[hl->long_next];
+		hl->long_next = (hl->long_next + 1) % HIGHLIGHT_LONG_LINES;
+		ll->line = line;
+		ll->count = 0;
+	}
+
+	/* Lexed from another state, none of the checkpoints hold */
+	if (ll->count == 0 || ll->start != state) {
+		if (ll->capacity == 0) {
+			ll->points = (HighlightCheckpoint *) malloc(sizeof(HighlightCheckpoint) * 64);
+			if (ll->points == NULL) {
+				ll->line = UINT64_MAX;
+				return NULL;
+			}
+			ll->capacity = 64;
+		}
+		ll->start = state;
+		ll->points[0].offset = 0;
+		ll->points[0].state = state;
+		ll->count = 1;
+		ll->ended = 0;
+	}
+	return ll;
+}
+
+uint8_t highlight_slice(Highlight *hl, const uint64_t line, const uint8_t state, const uint64_t length,
+	HighlightReader read, void *ctx, uint8_t *attrs, const uint64_t from, const uint64_t count)
+{
+	HighlightLongLine *ll = NULL;
+	HighlightPaint p;
+	const unsigned char *text;
+	uint64_t lo = 0, hi, mid, len;
+	uint8_t end;
+
+	p.attrs = attrs;
+	p.from = from;
+	p.to = from + count;
+	p.base = 0;
+	p.marks = NULL;
+	memset(attrs, SCREEN_ATTR_NORMAL, count);
+	if (hl->language == HIGHLIGHT_NONE)
+		return 0;
+	if (length > HIGHLIGHT_CHECKPOINT)
+		ll = highlight_long_line(hl, line, state);
+	if (ll == NULL) {
+		len = length;
+		text = read(ctx, line, 0, &len);
+		return highlight_run(hl->language, state, text, len, &p);
+	}
+
+	/* The last checkpoint at or before from */
+	for (hi = ll->count; hi - lo > 1; ) {
+		mid = lo + (hi - lo) / 2;
+		if (ll->points[mid].offset <= from)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	p.base = ll->points[lo].offset;
+	p.marks = ll;
+
+	/*
+		Past the slice only a little is needed to finish the tokens in
+		it, unless the state the line ends in is not known yet
+	*/
+	len = (highlight_carries(hl->language) && !ll->ended) ? length : from + count + HIGHLIGHT_LOOKAHEAD;
+	if (len > length)
+		len = length;
+	len -= p.base;
+	text = read(ctx, line, p.base, &len);
+	end = highlight_run(hl->language, ll->points[lo].state, text, len, &p);
+	if (!ll->ended && p.base + len == length) {
+		ll->ended = 1;
+		ll->end = end;
+	}
+	return highlight_carries(hl->language) ? ll->end : 0;
+}
+
+void highlight_edit(Highlight *hl, const uint64_t line, const uint64_t at, const uint64_t removed, const uint64_t added)
+{
+	uint64_t settled = line + added + 1, tail, k;
+	HighlightLongLine *ll;
+	size_t i;
+
+	if (hl->language == HIGHLIGHT_NONE)
+		return;
+
+	/*
+		The checkpoints of the edited line before the edit still hold,
+		those of the lines it took in are gone and the rest move along
+	*/
+	for (i = 0; i < HIGHLIGHT_LONG_LINES; ++i) {
+		ll = &hl->longs[i];
+		if (ll->line == UINT64_MAX || ll->line < line) {
+			continue;
+		} else if (ll->line == line) {
+			for (k = 1; k < ll->count && ll->points[k].offset < at; ++k);
+			ll->count = k;
+			ll->ended = 0;
+		} else if (ll->line <= line + removed) {
+			ll->line = UINT64_MAX;
+		} else {
+			ll->line = ll->line - removed + added;
+		}
+	}
+
+	/* Guesses from the edited line on are stale, the ones after it move along */
+	if (line + removed < hl->guess_first)
+		hl->guess_first = hl->guess_first - removed + added;
+	else if (line < hl->guess_first)
+		hl->guess_count = 0;
+	else if (line < hl->guess_first + hl->guess_count)
+		hl->guess_count = line - hl->guess_first;
+
+	/* An earlier edit that has not settled yet stays in the region to re-lex */
+	if (hl->valid < hl->settled && hl->settled > line + removed && hl->settled - removed + added > settled)
+		settled = hl->settled - removed + added;
+
+	if (line + removed < hl->count) {
+		/*
+			The state the edited lines used to end in moves to the new
+			last one of them, and the states after it move along
+		*/
+		tail = hl->count - line - removed;
+		if (highlight_reserve(&hl->states, &hl->capacity, line + added + tail)) {
+			hl->count = hl->valid = (line < hl->valid) ? line : hl->valid;
+			hl->settled = 0;
+			return;
+		}
+		memmove(hl->states + line + added, hl->states + line + removed, tail);
+		hl->count = line + added + tail;
+	} else if (line < hl->count) {
+		hl->count = line;
+	}
+
+	if (line < hl->valid)
+		hl->valid = line;
+	hl->settled = settled;
+}
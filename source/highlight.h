@@ -0,0 +1,143 @@
+#ifndef _HIGHLIGHT_H_INCLUDED
+#define _HIGHLIGHT_H_INCLUDED
+
+#include <stdint.h>
+
+/**
+ *	How far past the last line with a known state a lookup may be before
+ *	the lexer gives up on the lines in between, and starts over that many
+ *	lines above in the initial state instead
+ */
+#define HIGHLIGHT_SYNC_LINES	1000
+
+/**
+ *	Lines longer than HIGHLIGHT_CHECKPOINT bytes keep the state of the
+ *	lexer about every that many bytes through them, for the last
+ *	HIGHLIGHT_LONG_LINES such lines drawn, so that showing part of one
+ *	only takes lexing from the checkpoint before it. That part is lexed
+ *	HIGHLIGHT_LOOKAHEAD bytes further on, so that a word or key cut off
+ *	by the edge of the screen is still seen whole
+ */
+#define HIGHLIGHT_CHECKPOINT	4096
+#define HIGHLIGHT_LONG_LINES	32
+#define HIGHLIGHT_LOOKAHEAD	256
+
+/**
+ *	The languages that can be highlighted
+ */
+typedef enum _highlight_language {
+	HIGHLIGHT_NONE, HIGHLIGHT_C, HIGHLIGHT_SHELL, HIGHLIGHT_JSON, HIGHLIGHT_INI
+} HighlightLanguage;
+
+/**
+ *	Hands out len bytes of a line (without its newline) from byte from
+ *	on to be lexed, setting len to fewer if the line ends first; a len of
+ *	UINT64_MAX reads the rest of the line. The text only has to stay
+ *	around until the next call
+ */
+typedef const unsigned char *(*HighlightReader)(void *ctx, const uint64_t line, const uint64_t from, uint64_t *len);
+
+/**
+ *	A point in a long line, at offset, that the lexer can start over
+ *	from in state
+ */
+typedef struct _highlight_checkpoint {
+	uint64_t offset;
+	uint8_t state;
+} HighlightCheckpoint;
+
+/**
+ *	The checkpoints of a long line, which starts in state start. points
+ *	holds count of them, in order, the first one at the start of the
+ *	line; if ended is set, the line is known to end in state end. line
+ *	is UINT64_MAX while the slot is free
+ */
+typedef struct _highlight_long_line {
+	uint64_t line;
+	uint8_t start;
+	HighlightCheckpoint *points;
+	uint64_t count;
+	uint64_t capacity;
+	uint8_t ended;
+	uint8_t end;
+} HighlightLongLine;
+
+/**
+ *	Represents the highlighting of a document
+ *	A lexer goes through a line in the state the line before left it in,
+ *	and what state a line ends in is all that carries over to the next
+ *	one (the inside of a comment, say). states[i] is the state line i
+ *	ends in, for the first count lines; only the first valid of them are
+ *	known to be up to date. An edit drops valid back to the line it
+ *	touched and sets settled past the last such line: once a line from
+ *	there on ends in the same state as before, so does every line after
+ *	it, and the rest of the cache is up to date again.
+ *	A line too far past valid to catch up with is lexed from
+ *	HIGHLIGHT_SYNC_LINES above it in the initial state instead. What
+ *	those lines end in is only a guess, so it is kept apart from states:
+ *	guesses[i] is the state line guess_first + i was guessed to end in,
+ *	for the first guess_count lines from there, and the lines around the
+ *	one looked up are not guessed at again on every frame. longs are the
+ *	checkpoints of long lines, the slot at long_next taken next
+ */
+typedef struct _highlight {
+	HighlightLanguage language;
+	uint8_t *states;
+	uint64_t count;
+	uint64_t capacity;
+	uint64_t valid;
+	uint64_t settled;
+	uint8_t *guesses;
+	uint64_t guess_first;
+	uint64_t guess_count;
+	uint64_t guess_capacity;
+	HighlightLongLine longs[HIGHLIGHT_LONG_LINES];
+	uint64_t long_next;
+} Highlight;
+
+/**
+ *	Set up highlighting for a file, picking the language by its name
+ */
+extern void highlight_init(Highlight *hl, const char *filename);
+
+/**
+ *	Destroys the state cache
+ */
+extern void highlight_release(Highlight *hl);
+
+/**
+ *	Pick the language of a file by its name
+ */
+extern HighlightLanguage highlight_language(const char *filename);
+
+/**
+ *	Lex len bytes of a line, starting in state, and return the state the
+ *	line ends in. If attrs is not NULL, the ScreenAttr of every byte from
+ *	from up to from + count is stored in attrs[0, count)
+ */
+extern uint8_t highlight_lex(const HighlightLanguage language, const uint8_t state, const unsigned char *text,
+	const uint64_t len, uint8_t *attrs, const uint64_t from, const uint64_t count);
+
+/**
+ *	Get the state line starts in, lexing (through read) whatever lines
+ *	above it are not up to date in the cache
+ */
+extern uint8_t highlight_line_state(Highlight *hl, const uint64_t line, HighlightReader read, void *ctx);
+
+/**
+ *	Get the ScreenAttr of the count bytes of line from byte from on into
+ *	attrs, for a line length bytes long that starts in state, reading it
+ *	through read. Returns the state the line ends in. A long line is
+ *	lexed from the checkpoint before from rather than from its start, and
+ *	only to its end the first time after it changed
+ */
+extern uint8_t highlight_slice(Highlight *hl, const uint64_t line, const uint8_t state, const uint64_t length,
+	HighlightReader read, void *ctx, uint8_t *attrs, const uint64_t from, const uint64_t count);
+
+/**
+ *	Record an edit of line from byte at on, which took the newlines of
+ *	the removed lines after it away and added added new lines after it
+ */
+extern void highlight_edit(Highlight *hl, const uint64_t line, const uint64_t at, const uint64_t removed, const uint64_t added);
+
+#endif /* _HIGHLIGHT_H_INCLUDED */
@@ -0,0 +1,292 @@
+#include "input.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+
+uint8_t input_init(Input *input, const int fd)
+{
+	struct termios raw;
+
+	if (input == NULL)
+		return 1;
+
+	memset(input, 0, sizeof(Input));
+	input->fd = fd;
+	input->state = INPUT_GROUND;
+
+	/* Not a terminal (a pipe or a file): nothing to switch */
+	if (tcgetattr(fd, &input->saved))
+		return 0;
+
+	raw = input->saved;
+	raw.c_iflag &= ~(IXON | ICRNL);
+	raw.c_lflag &= ~(ICANON | ECHO | IEXTEN);
+	raw.c_cc[VMIN] = 1;
+	raw.c_cc[VTIME] = 0;
+	if (tcsetattr(fd, TCSANOW, &raw))
+		return 2;
+
+	input->raw = 1;
+	return 0;
+}
+
+void input_release(Input *input)
+{
+	if (input == NULL)
+		return;
+	free(input->paste);
+	input->paste = NULL;
+	input->paste_length = input->paste_start = input->paste_capacity = 0;
+	if (!input->raw)
+		return;
+	tcsetattr(input->fd, TCSANOW, &input->saved);
+	input->raw = 0;
+}
+
+const unsigned char *input_paste(const Input *input, size_t *len)
+{
+	*len = (input->pasting) ? input->paste_start : input->paste_length;
+	return input->paste;
+}
+
+void input_paste_clear(Input *input)
+{
+	size_t used = (input->pasting) ? input->paste_start : input->paste_length;
+
+	memmove(input->paste, input->paste + used, input->paste_length - used);
+	input->paste_length -= used;
+	input->paste_start -= used;
+}
+
+static void input_push(Input *input, const InputKey key)
+{
+	if (input->count >= INPUT_QUEUE_SIZE)
+		return;
+	input->queue[(input->head + input->count) % INPUT_QUEUE_SIZE] = key;
+	++input->count;
+}
+
+/*
+	Maps the final byte of a CSI or SS3 sequence (and its numeric
+	parameter, for the ESC [ n ~ form) to a key
+*/
+static InputKey input_decode_final(const unsigned char c, const uint16_t param)
+{
+	switch (c) {
+	case 'A': return INPUT_KEY_UP;
+	case 'B': return INPUT_KEY_DOWN;
+	case 'C': return INPUT_KEY_RIGHT;
+	case 'D': return INPUT_KEY_LEFT;
+	case 'H': return INPUT_KEY_HOME;
+	case 'F': return INPUT_KEY_END;
+	case '~':
+		switch (param) {
+		case 1:
+		case 7: return INPUT_KEY_HOME;
+		case 2: return INPUT_KEY_INSERT;
+		case 3: return INPUT_KEY_DEL;
+		case 4:
+		case 8: return INPUT_KEY_END;
+		case 5: return INPUT_KEY_PAGE_UP;
+		case 6: return INPUT_KEY_PAGE_DOWN;
+		}
+	}
+	return INPUT_KEY_NONE;
+}
+
+static void input_paste_put(Input *input, const unsigned char *data, const size_t len)
+{
+	unsigned char *tmp;
+	size_t capacity = (input->paste_capacity) ? input->paste_capacity : INPUT_QUEUE_SIZE;
+
+	if (input->paste_length + len > input->paste_capacity) {
+		while (capacity < input->paste_length + len)
+			capacity *= 2;
+		tmp = (unsigned char *) realloc(input->paste, capacity);
+		/* Out of memory: the rest of the paste is lost */
+		if (tmp == NULL)
+			return;
+		input->paste = tmp;
+		input->paste_capacity = capacity;
+	}
+	memcpy(input->paste + input->paste_length, data, len);
+	input->paste_length += len;
+}
+
+/*
+	Takes a byte of pasted text, watching for the end marker. Terminals
+	send the line ends of a paste the way Enter would, as '\r', so
+	"\r\n" and lone '\r' both become '\n'
+*/
+static void input_paste_byte(Input *input, const unsigned char c)
+{
+	static const unsigned char end[] = INPUT_PASTE_END;
+	unsigned char nl = '\n';
+
+	if (c == end[input->paste_match]) {
+		if (++input->paste_match < sizeof(end) - 1)
+			return;
+		input->pasting = input->paste_match = input->paste_cr = 0;
+		input_push(input, INPUT_KEY_PASTE);
+		return;
+	}
+
+	/* Not the end after all: what looked like it was text */
+	if (input->paste_match) {
+		input_paste_put(input, end, input->paste_match);
+		input->paste_match = input->paste_cr = 0;
+		if (c == end[0]) {
+			input->paste_match = 1;
+			return;
+		}
+	}
+
+	if (c == '\n' && input->paste_cr) {
+		input->paste_cr = 0;
+		return;
+	}
+	input->paste_cr = (c == '\r');
+	input_paste_put(input, (c == '\r') ? &nl : &c, 1);
+}
+
+static void input_decode(Input *input, const unsigned char c)
+{
+	InputKey key;
+
+	if (input->pasting) {
+		input_paste_byte(input, c);
+		return;
+	}
+
+	switch (input->state) {
+	case INPUT_GROUND:
+		if (c == 27)
+			input->state = INPUT_ESC;
+		else
+			input_push(input, c);
+	break;
+
+	case INPUT_ESC:
+		if (c == '[') {
+			input->state = INPUT_CSI;
+			input->param = 0;
+		} else if (c == 'O') {
+			input->state = INPUT_SS3;
+		} else if (c == 27) {
+			input_push(input, INPUT_KEY_ESCAPE);
+		} else {
+			input_push(input, INPUT_ALT | c);
+			input->state = INPUT_GROUND;
+		}
+	break;
+
+	case INPUT_CSI:
+		if (c >= '0' && c <= '9') {
+			input->param = input->param * 10 + (c - '0');
+		} else if (c == '~' && input->param == 200) {
+			input->pasting = 1;
+			input->paste_start = input->paste_length;
+			input->state = INPUT_GROUND;
+		} else if (c >= 0x40 && c <= 0x7E) {
+			key = input_decode_final(c, input->param);
+			if (key != INPUT_KEY_NONE)
+				input_push(input, key);
+			input->state = INPUT_GROUND;
+		} else if (c < 0x20 || c > 0x3F) {
+			/* Not part of any sequence we know, start over */
+			input->state = INPUT_GROUND;
+		}
+	break;
+
+	case INPUT_SS3:
+		key = input_decode_final(c, 0);
+		if (key != INPUT_KEY_NONE)
+			input_push(input, key);
+		input->state = INPUT_GROUND;
+	break;
+	}
+}
+
+int input_fill(Input *input, const uint8_t block)
+{
+	unsigned char buf[INPUT_QUEUE_SIZE];
+	struct pollfd pfd;
+	ssize_t n, i, room;
+	int total = 0;
+	uint8_t wait = block;
+
+	pfd.fd = input->fd;
+	pfd.events = POLLIN;
+
+	/* Never read more than the queue could take, one key per byte */
+	while ((room = INPUT_QUEUE_SIZE - input->count) > 0) {
+		if (!wait) {
+			/*
+				Only wait if we're in the middle of an escape sequence
+				or a paste, the rest of it should be right behind
+			*/
+			n = poll(&pfd, 1, (input->state == INPUT_GROUND && !input->pasting) ? 0 : INPUT_ESC_TIMEOUT);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0) {
+				if (input->state == INPUT_ESC)
+					input_push(input, INPUT_KEY_ESCAPE);
+				input->state = INPUT_GROUND;
+				break;
+			}
+		}
+
+		n = read(input->fd, buf, room);
+		if (n < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			input->eof = 1;
+			return -1;
+		}
+		if (n == 0) {
+			input->eof = 1;
+			return (total) ? total : -1;
+		}
+
+		for (i = 0; i < n; ++i)
+			input_decode(input, buf[i]);
+		total += n;
+		wait = 0;
+
+		if (n < room && input->state == INPUT_GROUND && !input->pasting)
+			break;
+	}
+
+	return total;
+}
+
+uint8_t input_ready(const Input *input)
+{
+	struct pollfd pfd;
+
+	pfd.fd = input->fd;
+	pfd.events = POLLIN;
+	return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLIN | POLLHUP));
+}
+
+uint8_t input_pending(const Input *input)
+{
+	return input->count > 0;
+}
+
+InputKey input_next(Input *input)
+{
+	InputKey key;
+
+	while (!input_pending(input)) {
+		if (input_fill(input, 1) < 0)
+			return INPUT_KEY_NONE;
+	}
+
+	key = input->queue[input->head];
+	input->head = (input->head + 1) % INPUT_QUEUE_SIZE;
+	--input->count;
+	return key;
+}
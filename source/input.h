@@ -0,0 +1,138 @@
+#ifndef _INPUT_H_INCLUDED
+#define _INPUT_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include <termios.h>
+
+/**
+ *	Number of decoded keys the input queue can hold
+ */
+#define INPUT_QUEUE_SIZE	4096
+
+/**
+ *	How long (in milliseconds) to wait for the rest of an escape
+ *	sequence before treating ESC as a key on its own
+ */
+#define INPUT_ESC_TIMEOUT	25
+
+/**
+ *	A decoded key. Plain bytes are passed through as their own value,
+ *	everything else is one of the INPUT_KEY_* values below. A key that
+ *	was pressed together with Alt has INPUT_ALT set
+ */
+typedef uint16_t InputKey;
+
+enum {
+	INPUT_KEY_UP = 0x100,
+	INPUT_KEY_DOWN,
+	INPUT_KEY_RIGHT,
+	INPUT_KEY_LEFT,
+	INPUT_KEY_HOME,
+	INPUT_KEY_END,
+	INPUT_KEY_INSERT,
+	INPUT_KEY_DEL,
+	INPUT_KEY_PAGE_UP,
+	INPUT_KEY_PAGE_DOWN,
+	INPUT_KEY_ESCAPE,
+	INPUT_KEY_PASTE,
+	INPUT_KEY_NONE
+};
+
+#define INPUT_ALT	0x8000
+
+/**
+ *	What the terminal sends around pasted text once bracketed paste is
+ *	on, and the sequences that turn it on and off
+ */
+#define INPUT_PASTE_START	"\033[200~"
+#define INPUT_PASTE_END	"\033[201~"
+#define INPUT_PASTE_ON	"\033[?2004h"
+#define INPUT_PASTE_OFF	"\033[?2004l"
+
+/**
+ *	States of the escape sequence decoder
+ *		1. INPUT_GROUND - plain bytes
+ *		2. INPUT_ESC - saw ESC
+ *		3. INPUT_CSI - inside ESC [ ...
+ *		4. INPUT_SS3 - saw ESC O
+ */
+typedef enum _input_state {
+	INPUT_GROUND, INPUT_ESC, INPUT_CSI, INPUT_SS3
+} InputState;
+
+/**
+ *	Represents the terminal's input side: the terminal is switched to
+ *	raw mode once, and bytes are read in bulk and decoded into a queue
+ *	of keys. Pasted text is not decoded: while pasting is set, bytes go
+ *	into paste as they are (with line ends turned into '\n') until the
+ *	end marker, paste_match bytes of which have been seen so far, and
+ *	then a single INPUT_KEY_PASTE is queued for all of it. The paste
+ *	still coming in starts at paste_start
+ */
+typedef struct _input {
+	int fd;
+	struct termios saved;
+	uint8_t raw;
+	uint8_t eof;
+	InputState state;
+	uint16_t param;
+	uint8_t pasting;
+	uint8_t paste_match;
+	uint8_t paste_cr;
+	unsigned char *paste;
+	size_t paste_length;
+	size_t paste_start;
+	size_t paste_capacity;
+	InputKey queue[INPUT_QUEUE_SIZE];
+	uint16_t head;
+	uint16_t count;
+} Input;
+
+/**
+ *	Set up input on fd, switching the terminal to raw mode if it is one
+ */
+extern uint8_t input_init(Input *input, const int fd);
+
+/**
+ *	Restore the terminal to the state it was found in, and drop any
+ *	pasted text
+ */
+extern void input_release(Input *input);
+
+/**
+ *	Get the text pasted so far. Everything pasted before an
+ *	INPUT_KEY_PASTE came out of the queue is there, so the first of
+ *	several such keys gets all of it and the rest find nothing
+ */
+extern const unsigned char *input_paste(const Input *input, size_t *len);
+
+/**
+ *	Forget the text pasted so far, once it has been used
+ */
+extern void input_paste_clear(Input *input);
+
+/**
+ *	Read whatever bytes are available and decode them into the queue.
+ *	Blocks for the first byte if block is set. Returns the number of
+ *	bytes read, or -1 once the input is closed
+ */
+extern int input_fill(Input *input, const uint8_t block);
+
+/**
+ *	Check whether bytes are waiting to be read, without reading them
+ */
+extern uint8_t input_ready(const Input *input);
+
+/**
+ *	Check whether decoded keys are waiting in the queue
+ */
+extern uint8_t input_pending(const Input *input);
+
+/**
+ *	Get the next key, waiting for one if the queue is empty. Returns
+ *	INPUT_KEY_NONE once the input is closed
+ */
+extern InputKey input_next(Input *input);
+
+#endif /* _INPUT_H_INCLUDED */
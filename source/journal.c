@@ -0,0 +1,161 @@
+#include "journal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+void journal_new(Journal *journal)
+{
+	journal->data = NULL;
+	journal->length = journal->capacity = 0;
+}
+
+void journal_release(Journal *journal)
+{
+	if (journal->data != NULL)
+		free(journal->data);
+	journal_new(journal);
+}
+
+void journal_clear(Journal *journal)
+{
+	journal->length = 0;
+}
+
+static uint8_t journal_reserve(Journal *journal, const size_t need)
+{
+	size_t capacity;
+	unsigned char *tmp;
+
+	if (need <= journal->capacity)
+		return 0;
+
+	capacity = (journal->capacity) ? journal->capacity : 4096;
+	while (capacity < need)
+		capacity *= 2;
+	tmp = (unsigned char *) realloc(journal->data, capacity);
+	if (tmp == NULL)
+		return 1;
+	journal->data = tmp;
+	journal->capacity = capacity;
+	return 0;
+}
+
+uint8_t journal_record(Journal *journal, const JournalOp op, const uint64_t offset, const unsigned char *str, const uint64_t len)
+{
+	JournalRecord record;
+
+	if (journal_reserve(journal, journal->length + sizeof(JournalRecord) + ((op == JOURNAL_DELETE) ? 0 : len)))
+		return 1;
+
+	record.op = op;
+	record.offset = offset;
+	record.length = len;
+	memcpy(journal->data + journal->length, &record, sizeof(JournalRecord));
+	journal->length += sizeof(JournalRecord);
+	if (op != JOURNAL_DELETE) {
+		memcpy(journal->data + journal->length, str, len);
+		journal->length += len;
+	}
+
+	return 0;
+}
+
+uint8_t journal_append(Journal *journal, const Journal *other)
+{
+	if (journal_reserve(journal, journal->length + other->length))
+		return 1;
+	memcpy(journal->data + journal->length, other->data, other->length);
+	journal->length += other->length;
+	return 0;
+}
+
+void journal_header(JournalHeader *header, const struct stat *st)
+{
+	memset(header, 0, sizeof(JournalHeader));
+	memcpy(header->magic, JOURNAL_MAGIC, sizeof(header->magic));
+	header->size = st->st_size;
+	header->mtime_sec = st->st_mtim.tv_sec;
+	header->mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+/*
+	Applies the records in data to doc, stopping at the first one that is
+	cut short (the editor died while it was being written) or does not
+	fit the document. Returns how many bytes of data were applied
+*/
+static uint64_t journal_apply(Document *doc, const unsigned char *data, const uint64_t length)
+{
+	JournalRecord record;
+	uint64_t pos = 0, next;
+
+	while (pos + sizeof(JournalRecord) <= length) {
+		memcpy(&record, data + pos, sizeof(JournalRecord));
+		next = pos + sizeof(JournalRecord);
+
+		switch (record.op) {
+		case JOURNAL_INSERT:
+			if (record.length > length - next || document_insert(doc, record.offset, data + next, record.length))
+				return pos;
+			next += record.length;
+		break;
+
+		case JOURNAL_DELETE:
+			if (document_delete(doc, record.offset, record.length))
+				return pos;
+		break;
+
+		case JOURNAL_CONTENTS:
+			if (record.length > length - next || document_delete(doc, 0, document_length(doc))
+				|| document_insert(doc, 0, data + next, record.length))
+				return pos;
+			next += record.length;
+		break;
+
+		default:
+			return pos;
+		}
+		pos = next;
+	}
+
+	return pos;
+}
+
+uint8_t journal_replay(Document *doc, const char *path, const struct stat *st, uint64_t *size)
+{
+	JournalHeader header, expected;
+	struct stat jst;
+	unsigned char *data;
+	int fd;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 1;
+	if (fstat(fd, &jst) || (uint64_t) jst.st_size < sizeof(JournalHeader)
+		|| jst.st_mtim.tv_sec < st->st_mtim.tv_sec) {
+		close(fd);
+		return 2;
+	}
+
+	data = (unsigned char *) mmap(NULL, jst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return 3;
+
+	/* Only a journal written against this very version of the target */
+	journal_header(&expected, st);
+	memcpy(&header, data, sizeof(JournalHeader));
+	if (memcmp(&header, &expected, sizeof(JournalHeader))) {
+		munmap(data, jst.st_size);
+		return 4;
+	}
+
+	*size = sizeof(JournalHeader) + journal_apply(doc, data + sizeof(JournalHeader), jst.st_size - sizeof(JournalHeader));
+	munmap(data, jst.st_size);
+
+	/* Drop a torn record at the end, new records go right after the good ones */
+	if (*size < (uint64_t) jst.st_size && truncate(path, *size))
+		return 5;
+	return 0;
+}
@@ -0,0 +1,95 @@
+#ifndef _JOURNAL_H_INCLUDED
+#define _JOURNAL_H_INCLUDED
+
+#include "document.h"
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+#define JOURNAL_MAGIC	"QWERTYJ1"
+
+/**
+ *	A journal is rewritten from a snapshot once it has grown past this
+ *	many bytes and past the size of the document itself
+ */
+#define JOURNAL_COMPACT_MIN	(1 << 20)
+
+/**
+ *	Kinds of records in a journal
+ *		1. JOURNAL_INSERT - bytes inserted at an offset
+ *		2. JOURNAL_DELETE - a number of bytes removed at an offset
+ *		3. JOURNAL_CONTENTS - the whole text of the document, written
+ *		   when a journal is compacted
+ */
+typedef enum _journal_op {
+	JOURNAL_INSERT = 'i', JOURNAL_DELETE = 'd', JOURNAL_CONTENTS = 's'
+} JournalOp;
+
+/**
+ *	Starts every journal file. It names the version of the target that
+ *	the records apply to, by its size and modification time
+ */
+typedef struct _journal_header {
+	char magic[8];
+	uint64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+} JournalHeader;
+
+/**
+ *	Each record is a record header followed, for JOURNAL_INSERT and
+ *	JOURNAL_CONTENTS, by length bytes of text
+ */
+typedef struct _journal_record {
+	uint8_t op;
+	uint64_t offset;
+	uint64_t length;
+} __attribute__((packed)) JournalRecord;
+
+/**
+ *	Edit records waiting to be appended to the journal file
+ */
+typedef struct _journal {
+	unsigned char *data;
+	size_t length;
+	size_t capacity;
+} Journal;
+
+/**
+ *	Initialize an empty record buffer
+ */
+extern void journal_new(Journal *journal);
+
+/**
+ *	Releases the record buffer
+ */
+extern void journal_release(Journal *journal);
+
+/**
+ *	Forget every record in the buffer, keeping its memory
+ */
+extern void journal_clear(Journal *journal);
+
+/**
+ *	Append a record to the buffer. str may be NULL for JOURNAL_DELETE
+ */
+extern uint8_t journal_record(Journal *journal, const JournalOp op, const uint64_t offset, const unsigned char *str, const uint64_t len);
+
+/**
+ *	Append every record in other to the buffer
+ */
+extern uint8_t journal_append(Journal *journal, const Journal *other);
+
+/**
+ *	Fill in the header of a journal for the target described by st
+ */
+extern void journal_header(JournalHeader *header, const struct stat *st);
+
+/**
+ *	Apply the journal at path to doc, provided it was written for the
+ *	target described by st and is newer than it. Stores the size of the
+ *	journal in size. Returns non-zero if there was nothing to recover
+ */
+extern uint8_t journal_replay(Document *doc, const char *path, const struct stat *st, uint64_t *size);
+
+#endif /* _JOURNAL_H_INCLUDED */
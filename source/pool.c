@@ -0,0 +1,64 @@
+#include "pool.h"
+#include <stdlib.h>
+#include <string.h>
+
+void pool_init(Pool *pool, const size_t size, const size_t per_slab)
+{
+	memset(pool, 0, sizeof(Pool));
+
+	/* Room for the free list link, and every object stays aligned */
+	pool->size = (size < sizeof(void *)) ? sizeof(void *) : size;
+	pool->size = (pool->size + sizeof(uint64_t) - 1) & ~(sizeof(uint64_t) - 1);
+	pool->per_slab = (per_slab) ? per_slab : 1;
+}
+
+void *pool_alloc(Pool *pool)
+{
+	PoolSlab *slab;
+	void *ptr;
+
+	if (pool->free_list != NULL) {
+		ptr = pool->free_list;
+		pool->free_list = *(void **) ptr;
+		++pool->stats.reuses;
+	} else {
+		if (pool->next == pool->end) {
+			slab = (PoolSlab *) malloc(sizeof(PoolSlab) + pool->size * pool->per_slab);
+			if (slab == NULL)
+				return NULL;
+			slab->next = pool->slabs;
+			pool->slabs = slab;
+			pool->next = (unsigned char *) (slab + 1);
+			pool->end = pool->next + pool->size * pool->per_slab;
+			++pool->stats.slabs;
+			pool->stats.bytes += sizeof(PoolSlab) + pool->size * pool->per_slab;
+		}
+		ptr = pool->next;
+		pool->next += pool->size;
+	}
+
+	++pool->stats.allocations;
+	++pool->stats.live;
+	return ptr;
+}
+
+void pool_free(Pool *pool, void *ptr)
+{
+	if (ptr == NULL)
+		return;
+	*(void **) ptr = pool->free_list;
+	pool->free_list = ptr;
+	++pool->stats.releases;
+	--pool->stats.live;
+}
+
+void pool_release(Pool *pool)
+{
+	PoolSlab *slab, *next;
+
+	for (slab = pool->slabs; slab != NULL; slab = next) {
+		next = slab->next;
+		free(slab);
+	}
+	pool_init(pool, pool->size, pool->per_slab);
+}
@@ -0,0 +1,67 @@
+#ifndef _POOL_H_INCLUDED
+#define _POOL_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ *	Header of every slab. The objects follow it in the same allocation
+ */
+typedef struct _pool_slab {
+	struct _pool_slab *next;
+} PoolSlab;
+
+/**
+ *	Allocation counters of a pool
+ *		1. allocations - objects handed out, in total
+ *		2. reuses - how many of those came off the free list
+ *		3. releases - objects given back
+ *		4. live - objects handed out and not given back
+ *		5. slabs - slabs allocated
+ *		6. bytes - bytes held by those slabs
+ */
+typedef struct _pool_stats {
+	uint64_t allocations;
+	uint64_t reuses;
+	uint64_t releases;
+	uint64_t live;
+	uint64_t slabs;
+	uint64_t bytes;
+} PoolStats;
+
+/**
+ *	Hands out objects of one size, carved from slabs of per_slab objects
+ *	at a time. Objects given back go on a free list and are handed out
+ *	again first; the slabs themselves are only freed all at once
+ */
+typedef struct _pool {
+	size_t size;
+	size_t per_slab;
+	PoolSlab *slabs;
+	unsigned char *next;
+	unsigned char *end;
+	void *free_list;
+	PoolStats stats;
+} Pool;
+
+/**
+ *	Set up a pool of objects of size bytes, per_slab to a slab
+ */
+extern void pool_init(Pool *pool, const size_t size, const size_t per_slab);
+
+/**
+ *	Get an object from the pool, or NULL if no memory is left
+ */
+extern void *pool_alloc(Pool *pool);
+
+/**
+ *	Give an object back to the pool
+ */
+extern void pool_free(Pool *pool, void *ptr);
+
+/**
+ *	Free every slab of the pool at once, along with every object in them
+ */
+extern void pool_release(Pool *pool);
+
+#endif /* _POOL_H_INCLUDED */
@@ -1,203 +1,278 @@
 #include "screen.h"
 #include "colours.h"
 #include "textproperties.h"
+#include "utf8.h"
 #include <stdlib.h>
 #include <string.h>
 #include <inttypes.h>
 
-uint8_t screen_new(Screen *screen, const uint16_t rows, const uint16_t cols)
+/*
+	The escapes each attribute id is drawn with. colours.h only has them
+	as variables, so the table is filled in by screen_new
+*/
+static ScreenCharFormat screen_formats[SCREEN_ATTR_COUNT];
+
+static void screen_formats_init(void)
+{
+	memset(screen_formats, 0, sizeof(screen_formats));
+	screen_formats[SCREEN_ATTR_BOLD].fmt[0] = BOLD;
+	screen_formats[SCREEN_ATTR_UNDERLINED].fmt[0] = UNDERLINED;
+	screen_formats[SCREEN_ATTR_REVERSED].fmt[0] = REVERSED;
+	screen_formats[SCREEN_ATTR_RED].fmt[1] = FG_RED;
+	screen_formats[SCREEN_ATTR_GREEN].fmt[1] = FG_GREEN;
+	screen_formats[SCREEN_ATTR_YELLOW].fmt[1] = FG_YELLOW;
+	screen_formats[SCREEN_ATTR_BLUE].fmt[1] = FG_BLUE;
+	screen_formats[SCREEN_ATTR_MAGENTA].fmt[1] = FG_MAGENTA;
+	screen_formats[SCREEN_ATTR_CYAN].fmt[1] = FG_CYAN;
+	screen_formats[SCREEN_ATTR_BOLD_BLUE].fmt[0] = BOLD;
+	screen_formats[SCREEN_ATTR_BOLD_BLUE].fmt[1] = FG_BLUE;
+	screen_formats[SCREEN_ATTR_BOLD_MAGENTA].fmt[0] = BOLD;
+	screen_formats[SCREEN_ATTR_BOLD_MAGENTA].fmt[1] = FG_MAGENTA;
+}
+
+uint8_t screen_new(Screen *screen, const Terminal *term, const uint16_t rows, const uint16_t cols)
 {
-	size_t i;
 	if (screen == NULL)
 		return 1;
 
-	screen->buffer = (unsigned char **) malloc(sizeof(unsigned char*) * (rows - 1));
-	if (screen->buffer == NULL) {
+	screen->buffer = (ScreenCell *) calloc((size_t) (rows - 1) * cols, sizeof(ScreenCell));
+	screen->front = (ScreenCell *) calloc((size_t) (rows - 1) * cols, sizeof(ScreenCell));
+	screen->dirty = (uint8_t *) malloc(sizeof(uint8_t) * (rows - 1));
+	if (screen->buffer == NULL || screen->front == NULL || screen->dirty == NULL) {
 		return 3;
 	}
+	screen_formats_init();
 
-	for (i = 0; i < rows - 1; ++i) {
-		screen->buffer[i] = (unsigned char *) malloc(sizeof(unsigned char) * cols);
-		memset(screen->buffer[i], 0, cols);
-	}
+	screen->out.data = NULL;
+	screen->out.length = screen->out.capacity = 0;
+	screen->term = term;
+	screen->fresh = 1;
+	screen->attr = SCREEN_ATTR_NORMAL;
+	screen->cursor.row = screen->cursor.col = UINT16_MAX;
 
 	screen->max_row = rows - 1;
 	screen->max_col = cols;
 	screen->pos.row = 0;
 	screen->pos.col = 0;
 	screen->mode = SCREEN_NORMAL;
+	screen->status[0] = '\0';
+	screen->overlay[0] = '\0';
 
 	return 0;
 }
 
-void screen_init(Screen *screen, const unsigned char *filename)
+/*
+	Makes a single byte the glyph of a cell. A control byte that gets this
+	far (in a file name, say) would reach the terminal as it is, so it
+	shows up as a '?' instead
+*/
+static void screen_cell_put(ScreenCell *cell, const unsigned char c)
 {
-	size_t i, len;
-	for(i = 0; i < screen->max_col; ++i)
-		screen->buffer[0][i] = '#';
-	strcpy((char *)  screen->buffer[0] + 4, "[ qwerty 0.1 ]");
-	screen->buffer[0][18] = '#';
-	len = (int) (strlen((const char *) filename) / 2);
-	screen->buffer[0][(int)(screen->max_col / 2) - len - 1] = ' ';
-	screen->buffer[0][(int)(screen->max_col / 2) - len - 2] = '[';
-	strcpy((char *) screen->buffer[0] + (int)(screen->max_col / 2) - len, (const char *) filename);
-	screen->buffer[0][(int)(screen->max_col / 2) + len] = ' ';
-	screen->buffer[0][(int)(screen->max_col / 2) + len + 1] = ']';
-	screen->pos.row = 2;
-	screen_add_menu(screen);
+	memset(cell->glyph, 0, SCREEN_GLYPH_MAX);
+	cell->glyph[0] = (text_is_control(c)) ? '?' : c;
 }
 
-void screen_release(Screen *screen)
+/*
+	Makes the n bytes of a character the glyph of a cell. Anything that
+	is not valid UTF-8 shows up as a replacement character
+*/
+static void screen_cell_put_char(ScreenCell *cell, const unsigned char *s, const uint64_t n, const uint32_t cp)
 {
-	size_t i;
-	for (i = 0; i < screen->max_row; ++i)
-		free(screen->buffer[i]);
-	free(screen->buffer);
+	memset(cell->glyph, 0, SCREEN_GLYPH_MAX);
+	if (cp == UTF8_REPLACEMENT && n == 1)
+		memcpy(cell->glyph, "\xEF\xBF\xBD", 3);
+	else
+		memcpy(cell->glyph, s, n);
 }
 
-uint8_t screen_write(Screen *screen, const unsigned char c)
+/*
+	Adds a combining mark to the glyph of a cell, if there is room left
+*/
+static void screen_cell_append(ScreenCell *cell, const unsigned char *s, const uint64_t n)
 {
-	uint8_t skip = 0;
-	size_t idx = 0;
+	uint64_t len;
 
-	if (screen->mode != SCREEN_NORMAL)
-		return 1;
+	for (len = 0; len < SCREEN_GLYPH_MAX && cell->glyph[len] != '\0'; ++len);
+	if (len + n <= SCREEN_GLYPH_MAX)
+		memcpy(cell->glyph + len, s, n);
+}
+
+/*
+	Draws a control character in caret notation, '^' and then c, from col
+	on, keeping to the columns between left and right. Returns the column
+	after it
+*/
+static uint64_t screen_put_caret(ScreenCell *cells, uint64_t col, const uint64_t left, const uint64_t right,
+	const unsigned char c, const uint8_t attr)
+{
+	uint64_t next = col + CONTROL_WIDTH;
 
-	switch (c) {
-	case '\r':
-	case '\n':
-		screen->pos.row += (screen->pos.row < screen->max_row - POST_EDITOR) ? 1 : 0;
-		screen->pos.col = 0;
-		skip = 1;
-	break;
-
-	case '\t':
-		screen->pos.col += 4;
-		skip = 1;
-	break;
-
-	case '\b':
-	case 127:
-		--screen->pos.col;
-		screen_delete(screen);
-		skip = 1;
-	break;
-
-	case 178: /* HOME key */
-		screen->pos.col = 0;
-		skip = 1;
-	break;
-
-	case 176: /* END key */
-		for (idx = 0; screen->buffer[screen->pos.row][idx] != '\0'; ++idx);
-		screen->pos.col = idx;
-		skip = 1;
-	break;
-
-	case 183: /* UP arrow key */
-		screen->pos.row -= (screen->pos.row > PRE_EDITOR) ? 1 : 0;
-		skip = 1;
-	break;
-
-	case 184: /* DOWN arrow key */
-		screen->pos.row += (screen->pos.row < screen->max_row - POST_EDITOR) ? 1 : 0;
-		if (screen->buffer[screen->pos.row][0] == '\0' && screen->buffer[screen->pos.row][1] == '\0')
-			screen->pos.col = 0;
-		skip = 1;
-	break;
-
-	case 186: /* LEFT arrow key */
-		--screen->pos.col;
-	 	skip = 1;
-	break;
-
-	case 185: /* RIGHT arrow key */
-		screen->pos.col += (screen->pos.col + 1 < screen->max_col) ? 1 : 0;
-		if (screen->buffer[screen->pos.row][screen->pos.col] == '\0')
-			--screen->pos.col;
-		skip = 1;
-	break;
+	for (; col < next && col < right; ++col) {
+		if (col >= left) {
+			screen_cell_put(&cells[col - left], (col + 1 < next) ? '^' : c);
+			cells[col - left].attr = attr;
+		}
 	}
+	return next;
+}
 
-	if (screen->pos.row < screen->max_row && screen->pos.col < screen->max_col && !skip)
-		screen->buffer[screen->pos.row][screen->pos.col++] = c;
-	else
-		return 1;
-	return 0;
+/*
+	Copies str into a row from col on, cutting it off at the edge. The
+	two bytes of a C1 control show up as a single '?'
+*/
+static void screen_put_text(Screen *screen, const uint16_t row, size_t col, const char *str)
+{
+	ScreenCell *cells = screen_row(screen, row);
+
+	for (; *str != '\0' && col < screen->max_col; ++str, ++col) {
+		if ((unsigned char)str[0] == 0xC2 && text_is_c1((unsigned char)str[1])) {
+			screen_cell_put(&cells[col], '?');
+			++str;
+		} else {
+			screen_cell_put(&cells[col], *str);
+		}
+	}
+	screen->dirty[row] = 1;
 }
 
-ScreenState screen_putc(Screen *screen, const unsigned char c)
+/*
+	Fills a whole row with the glyph c
+*/
+static void screen_fill_row(Screen *screen, const uint16_t row, const unsigned char c)
 {
+	ScreenCell *cells = screen_row(screen, row);
 	size_t i;
-	if (screen->pos.col >= screen->max_col) {
-		/*	NOT IMPLEMENTED!
-			The screen buffer isn't enough to place this character.
-			We need to scroll right (FOR THIS LINE ALONE!)
-		*/
-	}
-	if ('\t' == c) {
-		for (i = 0; i < TAB_SIZE; ++i)
-			screen->buffer[screen->pos.row][screen->pos.col++] = ' ';
-		//screen->pos.col += TAB_SIZE;
-	} else {
-		screen->buffer[screen->pos.row][screen->pos.col++] = c;
+
+	for (i = 0; i < screen->max_col; ++i) {
+		screen_cell_put(&cells[i], c);
+		cells[i].attr = SCREEN_ATTR_NORMAL;
 	}
-	return SCR_NORMAL;
+	screen->dirty[row] = 1;
 }
 
-void screen_putc_here(Screen *screen, const unsigned char c, const uint16_t col)
+void screen_init(Screen *screen, const unsigned char *filename)
 {
-	screen->buffer[screen->pos.row][col] = c;
+	size_t len, middle = screen->max_col / 2;
+
+	screen_fill_row(screen, 0, '#');
+	screen_put_text(screen, 0, 4, "[ qwerty 0.1 ]");
+	/* The program name is drawn in bold */
+	screen_set_attr(screen, 0, 5, 16, SCREEN_ATTR_BOLD);
+	len = strlen((const char *) filename) / 2;
+	screen_put_text(screen, 0, middle - len - 2, "[ ");
+	screen_put_text(screen, 0, middle - len, (const char *) filename);
+	screen_put_text(screen, 0, middle + len, " ]");
+	screen->pos.row = 2;
+	screen_add_menu(screen);
+	screen_touch(screen, 0, screen->max_row - 1);
 }
 
-ScreenState screen_advance_row(Screen *screen)
+void screen_release(Screen *screen)
 {
-	if (screen->pos.row >= screen->max_row - POST_EDITOR - 1)
-		return SCR_SCROLL_BOTTOM;
-	++screen->pos.row;
-	return SCR_NORMAL;
+	free(screen->buffer);
+	free(screen->front);
+	free(screen->dirty);
+	free(screen->out.data);
 }
 
-ScreenState screen_retreat_row(Screen *screen)
+ScreenCell *screen_row(const Screen *screen, const uint16_t row)
 {
-	if (screen->pos.row <= PRE_EDITOR)
-		return SCR_SCROLL_TOP;
-	--screen->pos.row;
-	return SCR_NORMAL;
+	return screen->buffer + (size_t) row * screen->max_col;
 }
 
-ScreenState screen_shift_down(Screen *screen)
+void screen_set_attr(Screen *screen, const uint16_t row, const uint16_t col, const uint16_t end, const uint8_t attr)
 {
+	ScreenCell *cells = screen_row(screen, row);
 	size_t i;
-	if (screen->pos.row >= screen->max_row - POST_EDITOR - 1) {
-		/*
-			We need to scroll the entire buffer
-		*/
-		return SCR_SCROLL_BOTTOM;
-	}
-	for (i = screen->max_row - POST_EDITOR - 2; i >= screen->pos.row; --i) {
-		memcpy(screen->buffer[i + 1], screen->buffer[i], screen->max_col);
-	}
-	memset(screen->buffer[screen->pos.row], 0, screen->max_col);
-	return SCR_NORMAL;
+
+	for (i = col; i < end && i < screen->max_col; ++i)
+		cells[i].attr = attr;
+	screen->dirty[row] = 1;
 }
 
-ScreenState screen_shift_up(Screen *screen, const char *lastline)
+void screen_touch(Screen *screen, const uint16_t first, const uint16_t last)
 {
 	size_t i;
-	for (i = screen->pos.row; i < screen->max_row - POST_EDITOR - 1; ++i) {
-		memcpy(screen->buffer[i], screen->buffer[i + 1], screen->max_col);
-	}
-	if (lastline != NULL) {
-		memset(screen->buffer[screen->max_row - POST_EDITOR - 1], 0, screen->max_col);
-		strcpy((char *) screen->buffer[screen->max_row - POST_EDITOR - 1], lastline);
-	}
-	return SCR_NORMAL;
+	for (i = first; i <= last && i < screen->max_row; ++i)
+		screen->dirty[i] = 1;
 }
 
-void screen_reset_col(Screen *screen)
+void screen_set_line(Screen *screen, const uint16_t row, const unsigned char *str, const uint8_t *attrs,
+	const uint64_t len, const uint64_t start, const uint64_t left)
 {
-	screen->pos.col = 0;
+	uint64_t i = 0, end, n, col = start, next, right = left + screen->max_col;
+	ScreenCell *cells = screen_row(screen, row), *last = NULL;
+	uint8_t attr = SCREEN_ATTR_NORMAL, width;
+	uint32_t cp;
+
+	screen->dirty[row] = 1;
+	memset(cells, 0, sizeof(ScreenCell) * screen->max_col);
+	while (i < len && col < right) {
+		/* Runs of plain ASCII go a byte to a column, with nothing to decode */
+		for (end = i + utf8_ascii_span(str + i, len - i); i < end && col < right; ++i, col = next) {
+			if (attrs != NULL)
+				attr = attrs[i];
+			if ('\t' == str[i]) {
+				/* Up to the next tab stop, which may start left of the row */
+				next = (col / TAB_SIZE + 1) * TAB_SIZE;
+				for (; col < next && col < right; ++col) {
+					if (col >= left) {
+						screen_cell_put(&cells[col - left], ' ');
+						cells[col - left].attr = attr;
+					}
+				}
+			} else if (text_is_control(str[i])) {
+				/* Never sent as it is: ESC would start a sequence of its own */
+				last = NULL;
+				next = screen_put_caret(cells, col, left, right, str[i] ^ 0x40, attr);
+			} else {
+				next = col + 1;
+				if (col >= left) {
+					last = &cells[col - left];
+					screen_cell_put(last, str[i]);
+					last->attr = attr;
+				}
+			}
+		}
+		if (i >= len || col >= right)
+			break;
+
+		if (attrs != NULL)
+			attr = attrs[i];
+		n = utf8_decode(str + i, len - i, &cp);
+		if (text_is_c1(cp)) {
+			/* U+009B is CSI, so C1 controls get the same treatment */
+			last = NULL;
+			col = screen_put_caret(cells, col, left, right, cp - 0x40, attr);
+			i += n;
+			continue;
+		}
+		width = utf8_width(cp);
+		if (width == 0) {
+			/* A mark goes in with the character before it */
+			if (last != NULL)
+				screen_cell_append(last, str + i, n);
+		} else if (col >= left && col + width <= right) {
+			last = &cells[col - left];
+			screen_cell_put_char(last, str + i, n, cp);
+			last->attr = attr;
+			if (width == 2) {
+				screen_cell_put(last + 1, SCREEN_GLYPH_WIDE);
+				last[1].attr = attr;
+			}
+		} else {
+			/* Half a wide character: whatever half is on the row is blank */
+			last = NULL;
+			for (next = col; next < col + width && next < right; ++next) {
+				if (next >= left) {
+					screen_cell_put(&cells[next - left], ' ');
+					cells[next - left].attr = attr;
+				}
+			}
+		}
+		col += width;
+		i += n;
+	}
 }
 
 ScreenState screen_set_col(Screen *screen, const uint16_t pos)
@@ -209,133 +284,304 @@ ScreenState screen_set_col(Screen *screen, const uint16_t pos)
 	return SCR_NORMAL;
 }
 
-ScreenState screen_insert_tab(Screen *screen)
+ScreenState screen_set_row_pos(Screen *screen, const uint16_t pos)
 {
-	size_t i;
-	if ((screen->pos.col + TAB_SIZE) > screen->max_col) {
-		return SCR_SCROLL_RIGHT;
-	}
-	for (i = 0; i < TAB_SIZE; ++i)
-		screen->buffer[screen->pos.row][screen->pos.col++] = ' ';
-	//printf("\nSCREEN POS: %d\n", screen->pos.col);
+	if (pos > screen->max_row)
+		return SCR_SCROLL_BOTTOM;
+	screen->pos.row = pos;
 	return SCR_NORMAL;
 }
 
-ScreenState screen_insert_tab_here(Screen *screen, const uint16_t col)
+static void screen_output_append(ScreenOutput *out, const void *data, const size_t len)
 {
-	size_t i;
-	if (col > screen->max_col) {
-		return SCR_SCROLL_RIGHT;
+	size_t capacity;
+	unsigned char *tmp;
+
+	if (out->capacity - out->length < len) {
+		capacity = (out->capacity) ? out->capacity : 4096;
+		while (capacity - out->length < len)
+			capacity *= 2;
+
+		tmp = (unsigned char *) realloc(out->data, capacity);
+		if (tmp == NULL)
+			return;
+
+		out->data = tmp;
+		out->capacity = capacity;
 	}
-	screen->pos.col = col;
-	for (i = 0; i < TAB_SIZE; ++i)
-		screen->buffer[screen->pos.row][screen->pos.col++] = ' ';
-	return SCR_NORMAL;
+
+	memcpy(out->data + out->length, data, len);
+	out->length += len;
 }
 
-ScreenState screen_set_row_pos(Screen *screen, const uint16_t pos)
+/*
+	Appends the escape that moves the terminal cursor to (row, col)
+*/
+static void screen_output_move(ScreenOutput *out, const uint16_t row, const uint16_t col)
 {
-	if (pos > screen->max_row)
-		return SCR_SCROLL_BOTTOM;
-	screen->pos.row = pos;
-	return SCR_NORMAL;
+	char seq[24];
+	int len = snprintf(seq, sizeof(seq), "\033[%u;%uH", row + 1, col + 1);
+	screen_output_append(out, seq, len);
 }
 
-ScreenState screen_move_col_right(Screen *screen)
+/*
+	Makes sure the terminal draws with attr from here on. SGR settings
+	add up, so switching between two formats goes through a reset
+*/
+static void screen_output_attr(Screen *screen, const uint8_t attr)
 {
-	if (screen->pos.col >= screen->max_col)
-		return SCR_SCROLL_RIGHT;
-	++screen->pos.col;
-	return SCR_NORMAL;
+	const unsigned char *seq;
+	size_t i;
+
+	if (screen->attr == attr)
+		return;
+	if (screen->attr != SCREEN_ATTR_NORMAL)
+		screen_output_append(&screen->out, FGBG_RESET, strlen((const char *) FGBG_RESET));
+	for (i = 0; i < 3; ++i) {
+		seq = screen_formats[attr].fmt[i];
+		if (seq != NULL)
+			screen_output_append(&screen->out, seq, strlen((const char *) seq));
+	}
+	screen->attr = attr;
 }
 
-ScreenState screen_move_col_left(Screen *screen)
+/*
+	Number of columns in a row up to and including its last glyph
+*/
+static size_t screen_cells_length(const ScreenCell *cells, const size_t max)
 {
-	if (screen->pos.col <= 0)
-		return SCR_SCROLL_LEFT;
-	--screen->pos.col;
-	return SCR_NORMAL;
+	size_t len;
+	for (len = max; len > 0 && cells[len - 1].glyph[0] == '\0'; --len);
+	return len;
 }
 
-void screen_delete(Screen *screen)
+/*
+	Copies what has to be sent for a cell into out, returning how many
+	bytes that is: nothing for the right half of a wide character
+*/
+static uint64_t screen_cell_bytes(const ScreenCell *cell, unsigned char *out)
 {
-	size_t i;
-	for (i = screen->pos.col; i < screen->max_col - 1 && screen->buffer[screen->pos.row][i] != '\0'; ++i)
-		screen->buffer[screen->pos.row][i] = screen->buffer[screen->pos.row][i + 1];
+	uint64_t len;
+
+	if (cell->glyph[0] == '\0') {
+		*out = ' ';
+		return 1;
+	}
+	if (cell->glyph[0] == SCREEN_GLYPH_WIDE)
+		return 0;
+	for (len = 0; len < SCREEN_GLYPH_MAX && cell->glyph[len] != '\0'; ++len)
+		out[len] = cell->glyph[len];
+	return len;
 }
 
-void screen_clear_line(Screen *screen)
+/*
+	Whether two cells look the same on the terminal
+*/
+static uint8_t screen_cells_equal(const ScreenCell *a, const ScreenCell *b)
 {
-	memset(screen->buffer[screen->pos.row], 0, screen->max_col);
+	return !memcmp(a->glyph, b->glyph, SCREEN_GLYPH_MAX) && a->attr == b->attr;
 }
 
-void screen_update_cursor(Screen *screen)
+/*
+	Fills a row with str, expanding tabs to the terminal's 8-column stops
+*/
+static void screen_set_text(Screen *screen, const uint16_t row, const char *str)
 {
+	ScreenCell *cells = screen_row(screen, row);
+	size_t col = 0;
+
+	screen->dirty[row] = 1;
+	memset(cells, 0, sizeof(ScreenCell) * screen->max_col);
+	for (; *str != '\0' && col < screen->max_col; ++str) {
+		if ('\t' == *str) {
+			do {
+				screen_cell_put(&cells[col++], ' ');
+			} while (col % 8 && col < screen->max_col);
+		} else {
+			screen_cell_put(&cells[col++], *str);
+		}
+	}
+}
 
+void screen_update_cursor(Screen *screen)
+{
+	if (screen->cursor.row == screen->pos.row && screen->cursor.col == screen->pos.col)
+		return;
+	screen_output_move(&screen->out, screen->pos.row, screen->pos.col);
+	screen->cursor = screen->pos;
 }
 
-void screen_flush_out(Screen *screen)
+void screen_compose(Screen *screen)
 {
-	size_t i, j;
+	size_t i, j, k, bytes, first, last, blen, flen;
+	ScreenCell *cells, *front;
+	unsigned char run[256];
+
 	if (screen == NULL)
 		return;
 
+	screen->out.length = 0;
+	if (screen->fresh) {
+		/* Nothing we drew is on the terminal yet: start from a blank one */
+		screen_output_append(&screen->out, "\033[0m\033[H\033[2J", 11);
+		memset(screen->front, 0, sizeof(ScreenCell) * screen->max_row * screen->max_col);
+		screen_touch(screen, 0, screen->max_row - 1);
+		screen->cursor.row = screen->cursor.col = UINT16_MAX;
+		screen->attr = SCREEN_ATTR_NORMAL;
+		screen->fresh = 0;
+	}
+
 	for (i = 0; i < screen->max_row; ++i) {
-		for (j = 0; j < screen->max_col && screen->buffer[i][j] != '\0'; ++j) {
-			if (!i && j == 5) {
-				putchar('\033');
-				putchar('[');
-				putchar('1');
-				putchar('m');
-			}
-			if (!i && j == 16) {
-				putchar('\033');
-				putchar('[');
-				putchar('0');
-				putchar('m');
-			}
-			if ( i == screen->pos.row && j == ((screen->pos.col > 0) ? screen->pos.col - 1 : 0)) {
-				putchar('\033');
-				putchar('[');
-				putchar('7');
-				putchar('m');
-				putchar(screen->buffer[i][j]);
-				putchar('\033');
-				putchar('[');
-				putchar('0');
-				putchar('m');
-			} else
-				putchar(screen->buffer[i][j]);
+		if (!screen->dirty[i])
+			continue;
+		screen->dirty[i] = 0;
+
+		/*
+			Find the span that differs between what is on the terminal and
+			what should be; past its last glyph a row is blank
+		*/
+		cells = screen_row(screen, i);
+		front = screen->front + i * screen->max_col;
+		blen = screen_cells_length(cells, screen->max_col);
+		flen = screen_cells_length(front, screen->max_col);
+		for (first = 0; first < blen && first < flen && screen_cells_equal(cells + first, front + first); ++first);
+		if (first == blen && first == flen)
+			continue;
+
+		if (blen == flen) {
+			for (last = blen; last > first && screen_cells_equal(cells + last - 1, front + last - 1); --last);
+		} else {
+			last = (blen > flen) ? blen : flen;
 		}
-		putchar('\n');
-		fflush(stdout);
+
+		/* Wide characters are only ever sent whole */
+		if (first > 0 && (cells[first].glyph[0] == SCREEN_GLYPH_WIDE || front[first].glyph[0] == SCREEN_GLYPH_WIDE))
+			--first;
+		if (last < blen && cells[last].glyph[0] == SCREEN_GLYPH_WIDE)
+			++last;
+
+		if (screen->cursor.row != i || screen->cursor.col != first)
+			screen_output_move(&screen->out, i, first);
+
+		/* One SGR sequence per run of cells drawn with the same format */
+		for (j = first; j < last && j < blen; j = k) {
+			screen_output_attr(screen, cells[j].attr);
+			for (k = j, bytes = 0; k < last && k < blen && bytes + SCREEN_GLYPH_MAX <= sizeof(run) && cells[k].attr == cells[j].attr; ++k)
+				bytes += screen_cell_bytes(cells + k, run + bytes);
+			screen_output_append(&screen->out, run, bytes);
+		}
+		if (last > blen) {
+			/* Erasing fills with the current background, so reset first */
+			screen_output_attr(screen, SCREEN_ATTR_NORMAL);
+			screen_output_append(&screen->out, "\033[K", 3);
+		}
+
+		/* Past the last column the terminal may have wrapped already */
+		screen->cursor.row = (j < screen->max_col) ? i : UINT16_MAX;
+		screen->cursor.col = j;
+
+		memcpy(front, cells, sizeof(ScreenCell) * screen->max_col);
 	}
+
+	screen_output_attr(screen, SCREEN_ATTR_NORMAL);
+	screen_update_cursor(screen);
+}
+
+void screen_send(Screen *screen)
+{
+	/* Hand the whole frame to the terminal in one go */
+	if (screen != NULL && screen->term != NULL)
+		terminal_write(screen->term, screen->out.data, screen->out.length);
+}
+
+void screen_flush_out(Screen *screen)
+{
+	screen_compose(screen);
+	screen_send(screen);
 }
 
 unsigned char screen_ask(Screen *screen, const char *question)
 {
-	size_t i;
+	const uint16_t bar = screen->max_row - POST_EDITOR;
+
 	screen->mode = SCREEN_INTR; /* Interrupt screen */
-	for (i = 0; i < screen->max_col; ++i)
-		screen->buffer[screen->max_row - POST_EDITOR][i] = '#';
-	screen->buffer[screen->max_row - POST_EDITOR][1] = ' ';
-	strcpy((char *) screen->buffer[screen->max_row - POST_EDITOR] + 2, question);
-	screen->buffer[screen->max_row - POST_EDITOR][2 + strlen(question)] = ' ';
-	memset(screen->buffer[screen->max_row - POST_EDITOR + 1], 0, screen->max_col);
-	memset(screen->buffer[screen->max_row - POST_EDITOR + 2], 0, screen->max_col);
-	strcpy((char *) screen->buffer[screen->max_row - POST_EDITOR + 1], "[y] Yes\t\t[n] No");
-	strcpy((char *) screen->buffer[screen->max_row - POST_EDITOR + 2], "[c] Cancel");
+	screen_fill_row(screen, bar, '#');
+	screen_put_text(screen, bar, 1, " ");
+	screen_put_text(screen, bar, 2, question);
+	screen_put_text(screen, bar, 2 + strlen(question), " ");
+	screen_set_text(screen, bar + 1, "[y] Yes\t\t[n] No");
+	screen_set_text(screen, bar + 2, "[c] Cancel");
 
 	return 0;
 }
 
+void screen_prompt(Screen *screen, const char *question, const char *answer)
+{
+	const uint16_t bar = screen->max_row - POST_EDITOR;
+	size_t len;
+
+	screen->mode = SCREEN_INTR; /* Interrupt screen */
+	screen_fill_row(screen, bar, '#');
+	screen_put_text(screen, bar, 1, " ");
+	screen_put_text(screen, bar, 2, question);
+	len = strlen(question);
+	if (len > screen->max_col - 3)
+		len = screen->max_col - 3;
+	screen_put_text(screen, bar, 2 + len, " ");
+
+	screen_set_text(screen, bar + 1, answer);
+	len = screen_cells_length(screen_row(screen, bar + 1), screen->max_col - 1);
+	screen_set_text(screen, bar + 2, "[Enter] Confirm");
+	screen->pos.row = bar + 1;
+	screen->pos.col = len;
+}
+
+/*
+	Draws the bar above the menu, with the status message near its
+	right end
+*/
+static void screen_draw_bar(Screen *screen)
+{
+	const uint16_t bar = screen->max_row - POST_EDITOR;
+	size_t len = strlen(screen->status), used = 0;
+
+	screen_fill_row(screen, bar, '#');
+	if (screen->overlay[0] != '\0') {
+		used = strlen(screen->overlay) + 3;
+		if (used > screen->max_col)
+			used = screen->max_col;
+		screen_put_text(screen, bar, 1, " ");
+		screen_put_text(screen, bar, 2, screen->overlay);
+		if (used < screen->max_col)
+			screen_put_text(screen, bar, used - 1, " ");
+	}
+	if (len > 0 && used + len + 6 <= screen->max_col) {
+		screen_put_text(screen, bar, screen->max_col - len - 4, " ");
+		screen_put_text(screen, bar, screen->max_col - len - 3, screen->status);
+		screen_put_text(screen, bar, screen->max_col - 3, " ");
+	}
+}
+
 void screen_add_menu(Screen *screen)
 {
-	size_t i;
-	for (i = 0; i < screen->max_col; ++i)
-		screen->buffer[screen->max_row - POST_EDITOR][i] = '#';
-	memset(screen->buffer[screen->max_row - POST_EDITOR + 1], 0, screen->max_col);
-	memset(screen->buffer[screen->max_row - POST_EDITOR + 2], 0, screen->max_col);
-	strcpy((char *) screen->buffer[screen->max_row - POST_EDITOR + 1], "^O Write Out\t\t^V Cur Pos\t\t^K Cut Line");
-	strcpy((char *) screen->buffer[screen->max_row - POST_EDITOR + 2], "^C Exit");
+	screen->mode = SCREEN_NORMAL;
+	screen_draw_bar(screen);
+	screen_set_text(screen, screen->max_row - POST_EDITOR + 1, "^O Write Out\t\t^V Cur Pos\t\t^K Cut Line\tM-U Undo");
+	screen_set_text(screen, screen->max_row - POST_EDITOR + 2, "^C Exit\t\t^_ Go To Line\t^T Stats\t^W Where Is\t\tM-E Redo");
+}
+
+void screen_set_overlay(Screen *screen, const char *overlay)
+{
+	strncpy(screen->overlay, (overlay != NULL) ? overlay : "", SCREEN_OVERLAY_MAX - 1);
+	screen->overlay[SCREEN_OVERLAY_MAX - 1] = '\0';
+	if (screen->mode == SCREEN_NORMAL)
+		screen_draw_bar(screen);
+}
+
+void screen_set_status(Screen *screen, const char *status)
+{
+	strncpy(screen->status, status, SCREEN_STATUS_MAX - 1);
+	screen->status[SCREEN_STATUS_MAX - 1] = '\0';
+	if (screen->mode == SCREEN_NORMAL)
+		screen_draw_bar(screen);
 }
@@ -3,11 +3,30 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include "terminal.h"
 
 static const uint8_t PRE_EDITOR = 2;
 static const uint8_t POST_EDITOR = 3;
 static const unsigned char STOPGAP = 200;
 
+/**
+ *	Smallest screen the editor lays itself out on: a row of text between
+ *	the title and the menu, and room for the bar's padding. A terminal
+ *	smaller than this gets the top left corner of it
+ */
+#define SCREEN_MIN_ROWS	(PRE_EDITOR + POST_EDITOR + 2)
+#define SCREEN_MIN_COLS	8
+
+/**
+ *	Longest status message shown in the menu bar
+ */
+#define SCREEN_STATUS_MAX	64
+
+/**
+ *	Longest overlay shown at the left end of the menu bar
+ */
+#define SCREEN_OVERLAY_MAX	128
+
 /**
  *	Represents various screen-buffer states
  */
@@ -34,149 +53,191 @@ typedef enum _screen_mode {
 } ScreenMode;
 
 /**
- *	TODO:
- *	This structure keeps track of the format options for each character
- *	in the buffer
- *	A maximum of three format options available for each character:
+ *	The format options of a character. Up to three of them apply at once:
  *		1. Bold, Underlined, Blinking, Concealed, Reversed
  *		2. Foreground Colour
  *		3. Background Colour
- *	To make use of this, i'll need to implement a hash-map or map
- *	to keep track of position of the character in the buffer
+ *	Cells don't carry these themselves, only the id of an entry in a
+ *	table of them (see ScreenAttr)
  */
 typedef struct _screen_char_format {
 	const unsigned char *fmt[3];
 } ScreenCharFormat;
 
 /**
- *	Represents the current screen-buffer
+ *	Ids of the character formats cells can be drawn with
  */
-typedef struct _screen {
-	unsigned char **buffer;
-	ScreenPosition pos;
-	uint16_t max_row;
-	uint16_t max_col;
-	ScreenMode mode;
-} Screen;
+typedef enum _screen_attr {
+	SCREEN_ATTR_NORMAL,
+	SCREEN_ATTR_BOLD,
+	SCREEN_ATTR_UNDERLINED,
+	SCREEN_ATTR_REVERSED,
+	SCREEN_ATTR_RED,
+	SCREEN_ATTR_GREEN,
+	SCREEN_ATTR_YELLOW,
+	SCREEN_ATTR_BLUE,
+	SCREEN_ATTR_MAGENTA,
+	SCREEN_ATTR_CYAN,
+	SCREEN_ATTR_BOLD_BLUE,
+	SCREEN_ATTR_BOLD_MAGENTA,
+	SCREEN_ATTR_COUNT
+} ScreenAttr;
 
 /**
- *	Create a new screen buffer
+ *	Most bytes of UTF-8 a cell holds: a character, and as many of the
+ *	marks combining with it as fit
  */
-extern uint8_t screen_new(Screen *screen, const uint16_t rows, const uint16_t cols);
+#define SCREEN_GLYPH_MAX	8
 
 /**
- *	Initialize screen buffer
+ *	What the cell to the right of a wide character holds instead of a
+ *	glyph of its own. 0xFF never shows up in UTF-8
  */
-extern void screen_init(Screen *screen, const unsigned char *filename);
+#define SCREEN_GLYPH_WIDE	0xFF
 
 /**
- *	Deletes screen buffer
+ *	A character cell: the UTF-8 shown in it, NUL-padded (empty if nothing
+ *	is), and the id of the format it is drawn with
  */
-extern void screen_release(Screen *screen);
+typedef struct _screen_cell {
+	unsigned char glyph[SCREEN_GLYPH_MAX];
+	uint8_t attr;
+} ScreenCell;
 
 /**
- *	Update cursor
+ *	Bytes queued up for the terminal during a flush
  */
-extern void screen_update_cursor(Screen *screen);
+typedef struct _screen_output {
+	unsigned char *data;
+	size_t length;
+	size_t capacity;
+} ScreenOutput;
 
 /**
- *	Writes the character c into the current position of the screen buffer
- *	This acts based on the current input
+ *	Represents the current screen-buffer
+ *	buffer is the frame being built and front is the frame the terminal
+ *	is showing, each a single row-major array of max_row * max_col
+ *	cells. Every function that changes a row of buffer marks it in
+ *	dirty, and a flush only compares (and sends) the rows marked there.
+ *	attr is the format the terminal is currently drawing with. A flush
+ *	writes the frame to term; without one it is only left in out, for
+ *	whoever wants to look at it
  */
-extern uint8_t screen_write(Screen *screen, const unsigned char c);
+typedef struct _screen {
+	ScreenCell *buffer;
+	ScreenCell *front;
+	uint8_t *dirty;
+	uint8_t attr;
+	ScreenOutput out;
+	const Terminal *term;
+	ScreenPosition pos;
+	ScreenPosition cursor;
+	uint16_t max_row;
+	uint16_t max_col;
+	ScreenMode mode;
+	uint8_t fresh;
+	char status[SCREEN_STATUS_MAX];
+	char overlay[SCREEN_OVERLAY_MAX];
+} Screen;
 
 /**
- *	Write a character to the current position in the screen buffer
+ *	Create a new screen buffer, drawn on term
  */
-extern ScreenState screen_putc(Screen *screen, const unsigned char c);
+extern uint8_t screen_new(Screen *screen, const Terminal *term, const uint16_t rows, const uint16_t cols);
 
 /**
- *	Write a character to the specified position in the screen buffer
+ *	Initialize screen buffer
  */
-extern void screen_putc_here(Screen *screen, const unsigned char c, const uint16_t col);
+extern void screen_init(Screen *screen, const unsigned char *filename);
 
 /**
- *	Advance row. It returns the state of the screen. Supposing that
- *	it needs to scroll, the caller has to decide what to do next
+ *	Deletes screen buffer
  */
-extern ScreenState screen_advance_row(Screen *screen);
+extern void screen_release(Screen *screen);
 
 /**
- *	Retreat row. The same logic applies to this as screen_advance_row
+ *	Get the cells of a row of the frame being built
  */
-extern ScreenState screen_retreat_row(Screen *screen);
+extern ScreenCell *screen_row(const Screen *screen, const uint16_t row);
 
 /**
- *	Shifts buffer down by one from the current position
+ *	Draw the cells from col up to (not including) end of a row with attr
  */
-extern ScreenState screen_shift_down(Screen *screen);
+extern void screen_set_attr(Screen *screen, const uint16_t row, const uint16_t col, const uint16_t end, const uint8_t attr);
 
 /**
- *	Shifts buffer up by one to the current position
+ *	Mark rows first through last as changed since the last flush
  */
-extern ScreenState screen_shift_up(Screen *screen, const char *lastline);
+extern void screen_touch(Screen *screen, const uint16_t first, const uint16_t last);
 
 /**
- *	Reset col position to beginning of line
+ *	Queue a move of the terminal cursor to the current position
  */
-extern void screen_reset_col(Screen *screen);
+extern void screen_update_cursor(Screen *screen);
 
 /**
- *	Set col position
+ *	Replace the contents of a row with len bytes of UTF-8 in str,
+ *	expanding tabs and giving wide characters two cells. str starts at
+ *	the visual column start, while the row shows the columns from left
+ *	onwards; whatever falls outside is cut off.
+ *	attrs holds the ScreenAttr of every byte, or is NULL if they are all
+ *	drawn normally
  */
-extern ScreenState screen_set_col(Screen *screen, const uint16_t pos);
+extern void screen_set_line(Screen *screen, const uint16_t row, const unsigned char *str, const uint8_t *attrs,
+	const uint64_t len, const uint64_t start, const uint64_t left);
 
 /**
- *	Insert TAB_SPACE at current position
+ *	Set col position
  */
-extern ScreenState screen_insert_tab(Screen *screen);
+extern ScreenState screen_set_col(Screen *screen, const uint16_t pos);
 
 /**
- *	Insert TAB_SPACE at position
+ *	Set row position
  */
-extern ScreenState screen_insert_tab_here(Screen *screen, const uint16_t col);
+extern ScreenState screen_set_row_pos(Screen *screen, const uint16_t pos);
 
 /**
- *	Set row position
+ *	Flush screen buffer to output device. Only the parts of the rows that
+ *	changed since the previous flush are sent, in a single write
  */
-extern ScreenState screen_set_row_pos(Screen *screen, const uint16_t pos);
+extern void screen_flush_out(Screen *screen);
 
 /**
- *	Move column position right. The same logic applies to this as
- *	screen_advance_row
+ *	The first half of a flush: work out what changed and queue up the
+ *	bytes that bring the terminal up to date in out
  */
-extern ScreenState screen_move_col_right(Screen *screen);
+extern void screen_compose(Screen *screen);
 
 /**
- *	Move column position left. The same logic applies to this as
- *	screen_advance_row
+ *	The second half of a flush: write what screen_compose queued up
  */
-extern ScreenState screen_move_col_left(Screen *screen);
+extern void screen_send(Screen *screen);
 
 /**
- *	Removes the character (if there exists one) from
- *	the current position of the screen buffer
+ *	Ask for user input in response to question posed
  */
-extern void screen_delete(Screen *screen);
+extern unsigned char screen_ask(Screen *screen, const char *question);
 
 /**
- *	Clear the current line buffer
+ *	Prompt the user for a line of text, showing what was typed so far
  */
-extern void screen_clear_line(Screen *screen);
+extern void screen_prompt(Screen *screen, const char *question, const char *answer);
 
 /**
- *	Flush screen buffer to output device
+ *	Add the menu to the buffer
  */
-extern void screen_flush_out(Screen *screen);
+extern void screen_add_menu(Screen *screen);
 
 /**
- *	Ask for user input in response to question posed
+ *	Set the text shown at the left end of the menu bar, or take it away
+ *	if overlay is NULL or empty. It stays on until it is changed
  */
-extern unsigned char screen_ask(Screen *screen, const char *question);
+extern void screen_set_overlay(Screen *screen, const char *overlay);
 
 /**
- *	Add the menu to the buffer
+ *	Set the status message shown at the right end of the menu bar. It
+ *	is kept while a question is being asked and shown again after
  */
-extern void screen_add_menu(Screen *screen);
+extern void screen_set_status(Screen *screen, const char *status);
 
 #endif /* _SCREEN_H_INCLUDED */
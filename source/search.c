@@ -0,0 +1,169 @@
+#include "search.h"
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static unsigned char search_lower(const unsigned char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static unsigned char search_upper(const unsigned char c)
+{
+	return (c >= 'a' && c <= 'z') ? c - ('a' - 'A') : c;
+}
+
+void search_init(Search *search, const unsigned char *needle, const size_t len, const uint8_t fold)
+{
+	size_t i;
+
+	search->length = (len < SEARCH_MAX) ? len : SEARCH_MAX;
+	search->fold = fold;
+	for (i = 0; i < search->length; ++i)
+		search->needle[i] = (fold) ? search_lower(needle[i]) : needle[i];
+
+	/*
+		A window that ends in a byte can move on by how far that byte is
+		from the end of the needle, where it last occurs before its end;
+		by the whole needle if it does not
+	*/
+	for (i = 0; i < 256; ++i)
+		search->skip[i] = search->length;
+	for (i = 0; i + 1 < search->length; ++i) {
+		search->skip[search->needle[i]] = search->length - 1 - i;
+		if (fold)
+			search->skip[search_upper(search->needle[i])] = search->length - 1 - i;
+	}
+}
+
+/* Checks a window of length bytes against the needle */
+static uint8_t search_equal(const Search *search, const unsigned char *s)
+{
+	size_t i;
+
+	if (!search->fold)
+		return !memcmp(s, search->needle, search->length);
+	for (i = 0; i < search->length && search_lower(s[i]) == search->needle[i]; ++i);
+	return i == search->length;
+}
+
+/*
+	Finds the first match that lies entirely within the n bytes at data
+*/
+static const unsigned char *search_scan(const Search *search, const unsigned char *data, const size_t n)
+{
+	const size_t len = search->length;
+	const unsigned char last = search->needle[len - 1];
+	size_t i = 0;
+	unsigned char c;
+
+	if (len > n)
+		return NULL;
+
+	if (len >= SEARCH_HORSPOOL_MIN) {
+		while (i + len <= n) {
+			c = data[i + len - 1];
+			if ((c == last || (search->fold && search_lower(c) == last)) && search_equal(search, data + i))
+				return data + i;
+			i += search->skip[c];
+		}
+		return NULL;
+	}
+
+#ifdef __SSE2__
+	{
+		/*
+			Look at 16 windows at a time, on their first and last bytes
+			(in either case when folding), and only check the ones where
+			both agree with the needle in full
+		*/
+		const unsigned char first = search->needle[0];
+		const __m128i f = _mm_set1_epi8(first), l = _mm_set1_epi8(last);
+		const __m128i fu = _mm_set1_epi8((search->fold) ? search_upper(first) : first);
+		const __m128i lu = _mm_set1_epi8((search->fold) ? search_upper(last) : last);
+		__m128i a, b;
+		int mask;
+
+		for (; i + len - 1 + 16 <= n; i += 16) {
+			a = _mm_loadu_si128((const __m128i *) (data + i));
+			b = _mm_loadu_si128((const __m128i *) (data + i + len - 1));
+			mask = _mm_movemask_epi8(_mm_and_si128(_mm_or_si128(_mm_cmpeq_epi8(a, f), _mm_cmpeq_epi8(a, fu)),
+				_mm_or_si128(_mm_cmpeq_epi8(b, l), _mm_cmpeq_epi8(b, lu))));
+			for (; mask; mask &= mask - 1) {
+				if (search_equal(search, data + i + __builtin_ctz(mask)))
+					return data + i + __builtin_ctz(mask);
+			}
+		}
+	}
+#endif
+	for (; i + len <= n; ++i) {
+		if (search_equal(search, data + i))
+			return data + i;
+	}
+	return NULL;
+}
+
+uint8_t search_find(const Search *search, const Document *doc, const uint64_t from, const uint64_t to, uint64_t *match)
+{
+	unsigned char window[SEARCH_MAX];
+	const unsigned char *data, *found;
+	const uint64_t len = search->length, end = document_length(doc);
+	uint64_t pos = from, n, k;
+
+	if (len == 0)
+		return 1;
+
+	while (pos < to && pos + len <= end) {
+		n = document_chunk(doc, pos, &data);
+		if (n == 0)
+			break;
+		/* The part of the file that was not indexed yet comes whole: take it a page at a time */
+		if (n > DOCUMENT_PAGE_SIZE)
+			n = DOCUMENT_PAGE_SIZE;
+
+		/* Matches within the chunk, that start before to */
+		found = search_scan(search, data, (n < to - pos + len - 1) ? n : to - pos + len - 1);
+		if (found != NULL) {
+			*match = pos + (found - data);
+			return 0;
+		}
+
+		/* Then the ones that start near its end and run on past it */
+		for (k = (n >= len) ? n - len + 1 : 0; k < n && pos + k < to && pos + k + len <= end; ++k) {
+			if ((data[k] == search->needle[0] || (search->fold && search_lower(data[k]) == search->needle[0]))
+				&& document_read(doc, pos + k, window, len) == len && search_equal(search, window)) {
+				*match = pos + k;
+				return 0;
+			}
+		}
+		pos += n;
+	}
+
+	return 1;
+}
+
+void search_tally_start(SearchTally *tally, const Document *doc, const uint64_t offset)
+{
+	memset(tally, 0, sizeof(SearchTally));
+	tally->offset = offset;
+	tally->revision = doc->revision;
+}
+
+uint8_t search_tally_step(const Search *search, const Document *doc, SearchTally *tally)
+{
+	uint64_t match, end = document_length(doc), to;
+
+	if (doc->revision != tally->revision)
+		return 2;
+
+	to = (end - tally->pos > SEARCH_TALLY_STEP) ? tally->pos + SEARCH_TALLY_STEP : end;
+	while (!search_find(search, doc, tally->pos, to, &match)) {
+		++tally->count;
+		if (match < tally->offset)
+			++tally->before;
+		tally->pos = match + 1;
+	}
+	tally->pos = to;
+	return to == end;
+}
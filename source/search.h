@@ -0,0 +1,77 @@
+#ifndef _SEARCH_H_INCLUDED
+#define _SEARCH_H_INCLUDED
+
+#include "document.h"
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ *	Longest text that can be searched for
+ */
+#define SEARCH_MAX	256
+
+/**
+ *	Needles at least this long are searched for with Boyer-Moore-Horspool,
+ *	shorter ones with a vector filter on their first and last bytes
+ */
+#define SEARCH_HORSPOOL_MIN	16
+
+/**
+ *	Represents a compiled search for length bytes of needle. If fold is
+ *	set, ASCII letters match either case, and needle is kept in lower
+ *	case. skip is the Horspool shift for each byte that can end a window
+ */
+typedef struct _search {
+	unsigned char needle[SEARCH_MAX];
+	size_t length;
+	uint8_t fold;
+	uint16_t skip[256];
+} Search;
+
+/**
+ *	Set up a search for the len bytes of needle, cut off at SEARCH_MAX
+ */
+extern void search_init(Search *search, const unsigned char *needle, const size_t len, const uint8_t fold);
+
+/**
+ *	Find the first match in the document that starts in [from, to), going
+ *	straight over the document's pieces, and store its offset in match.
+ *	Returns non-zero if there is none
+ */
+extern uint8_t search_find(const Search *search, const Document *doc, const uint64_t from, const uint64_t to, uint64_t *match);
+
+/**
+ *	Most bytes of the document a step of a count goes over
+ */
+#define SEARCH_TALLY_STEP	((uint64_t) 8 << 20)
+
+/**
+ *	Represents a count of the matches in a document, made a step at a
+ *	time so that a large document never holds everything else up. The
+ *	document has been gone over up to pos, as it was at revision, with
+ *	count matches found, before of them starting before offset.
+ *	Overlapping matches count too, as stepping from one match to the next
+ *	finds them
+ */
+typedef struct _search_tally {
+	uint64_t offset;
+	uint64_t pos;
+	uint64_t count;
+	uint64_t before;
+	uint64_t revision;
+} SearchTally;
+
+/**
+ *	Start counting the matches in doc, and how many of them start before
+ *	offset
+ */
+extern void search_tally_start(SearchTally *tally, const Document *doc, const uint64_t offset);
+
+/**
+ *	Go on with a count for up to SEARCH_TALLY_STEP more bytes. Returns
+ *	0 if there is more to go, 1 once the whole document has been counted
+ *	and 2 if the document changed since the count started
+ */
+extern uint8_t search_tally_step(const Search *search, const Document *doc, SearchTally *tally);
+
+#endif /* _SEARCH_H_INCLUDED */
@@ -0,0 +1,137 @@
+#include "stats.h"
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+static const char *STATS_NAMES[STATS_STAGE_COUNT] = {
+	"input", "edit", "backup", "render", "write", "key"
+};
+
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_init(Stats *stats)
+{
+	memset(stats, 0, sizeof(Stats));
+}
+
+/*
+	Values under 2^STATS_SUB_BITS get a bucket each. Past that, the top
+	STATS_SUB_BITS + 1 bits of a value pick its bucket: the position of
+	the highest bit picks the power of two, the bits after it the bucket
+	within it
+*/
+static uint64_t stats_bucket(const uint64_t value)
+{
+	uint64_t shift;
+
+	if (value < (1 << STATS_SUB_BITS))
+		return value;
+	shift = 63 - __builtin_clzll(value) - STATS_SUB_BITS;
+	return ((shift + 1) << STATS_SUB_BITS) + ((value >> shift) & ((1 << STATS_SUB_BITS) - 1));
+}
+
+/*
+	The largest value that lands in a bucket
+*/
+static uint64_t stats_bucket_value(const uint64_t bucket)
+{
+	uint64_t shift;
+
+	if (bucket < (1 << STATS_SUB_BITS))
+		return bucket;
+	shift = (bucket >> STATS_SUB_BITS) - 1;
+	return ((((bucket & ((1 << STATS_SUB_BITS) - 1)) | (1 << STATS_SUB_BITS)) + 1) << shift) - 1;
+}
+
+void stats_histogram_add(StatsHistogram *hist, const uint64_t value)
+{
+	++hist->counts[stats_bucket(value)];
+	++hist->count;
+	hist->total += value;
+	if (value > hist->max)
+		hist->max = value;
+}
+
+uint64_t stats_percentile(const StatsHistogram *hist, const double p)
+{
+	uint64_t rank, seen = 0, i, value;
+
+	if (hist->count == 0)
+		return 0;
+
+	rank = (uint64_t) (p / 100.0 * hist->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < STATS_BUCKETS; ++i) {
+		seen += hist->counts[i];
+		if (seen >= rank)
+			break;
+	}
+	value = stats_bucket_value(i);
+	return (value < hist->max) ? value : hist->max;
+}
+
+uint64_t stats_record(Stats *stats, const StatsStage stage, const uint64_t start)
+{
+	uint64_t now = stats_now();
+
+	stats_histogram_add(&stats->stages[stage], now - start);
+	return now;
+}
+
+void stats_frame(Stats *stats, const uint64_t bytes)
+{
+	++stats->frames;
+	stats->bytes += bytes;
+}
+
+/*
+	Writes a duration the way a person would read it
+*/
+static int stats_duration(char *buf, const size_t size, const uint64_t ns)
+{
+	if (ns < 10000)
+		return snprintf(buf, size, "%.1fus", ns / 1e3);
+	if (ns < 10000000)
+		return snprintf(buf, size, "%" PRIu64 "us", ns / 1000);
+	return snprintf(buf, size, "%" PRIu64 "ms", ns / 1000000);
+}
+
+void stats_format(const Stats *stats, char *buf, const size_t width)
+{
+	const StatsHistogram *key = &stats->stages[STATS_KEY];
+	char p50[16], p99[16], render[16], output[16];
+	size_t size = (width + 1 < STATS_LINE_MAX) ? width + 1 : STATS_LINE_MAX;
+
+	stats_duration(p50, sizeof(p50), stats_percentile(key, 50));
+	stats_duration(p99, sizeof(p99), stats_percentile(key, 99));
+	stats_duration(render, sizeof(render), stats_percentile(&stats->stages[STATS_RENDER], 99));
+	stats_duration(output, sizeof(output), stats_percentile(&stats->stages[STATS_WRITE], 99));
+	snprintf(buf, size, "key p50 %s p99 %s render %s write %s %" PRIu64 "B/frame", p50, p99, render, output,
+		(stats->frames) ? stats->bytes / stats->frames : 0);
+}
+
+void stats_dump(const Stats *stats, FILE *out)
+{
+	const StatsHistogram *hist;
+	uint8_t i;
+
+	fprintf(out, "%-8s %10s %10s %10s %10s %10s %10s %10s\n", "stage", "count", "mean", "p50", "p90", "p99",
+		"p99.9", "max");
+	for (i = 0; i < STATS_STAGE_COUNT; ++i) {
+		hist = &stats->stages[i];
+		fprintf(out, "%-8s %10" PRIu64 " %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n", STATS_NAMES[i], hist->count,
+			(hist->count) ? hist->total / 1e3 / hist->count : 0, stats_percentile(hist, 50) / 1e3,
+			stats_percentile(hist, 90) / 1e3, stats_percentile(hist, 99) / 1e3,
+			stats_percentile(hist, 99.9) / 1e3, hist->max / 1e3);
+	}
+	fprintf(out, "(times in microseconds)\n");
+	fprintf(out, "keys %" PRIu64 ", frames %" PRIu64 ", bytes written %" PRIu64 "\n", stats->keys, stats->frames,
+		stats->bytes);
+}
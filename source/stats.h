@@ -0,0 +1,99 @@
+#ifndef _STATS_H_INCLUDED
+#define _STATS_H_INCLUDED
+
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ *	Each power of two is split into 2^STATS_SUB_BITS buckets, so a value
+ *	is only ever off by 1/16th in a histogram (values under 16 are exact)
+ */
+#define STATS_SUB_BITS	4
+#define STATS_BUCKETS	((64 - STATS_SUB_BITS + 1) << STATS_SUB_BITS)
+
+/**
+ *	Longest line stats_format makes
+ */
+#define STATS_LINE_MAX	128
+
+/**
+ *	The stages a key goes through, each timed on its own
+ *		1. STATS_INPUT - reading and decoding the bytes of keys
+ *		2. STATS_EDIT - editor_input acting on a key
+ *		3. STATS_BACKUP - handing edits to the backup thread
+ *		4. STATS_RENDER - drawing a frame and working out what changed
+ *		5. STATS_WRITE - handing the frame to the terminal
+ *		6. STATS_KEY - from keys coming in to the frame after them
+ *		   leaving, the latency someone typing sees
+ */
+typedef enum _stats_stage {
+	STATS_INPUT, STATS_EDIT, STATS_BACKUP, STATS_RENDER, STATS_WRITE, STATS_KEY, STATS_STAGE_COUNT
+} StatsStage;
+
+/**
+ *	A log-linear histogram of nanoseconds, in the manner of HDR
+ *	histograms: recording is a few instructions and takes no memory, at
+ *	the cost of knowing every value only to within a bucket
+ */
+typedef struct _stats_histogram {
+	uint64_t counts[STATS_BUCKETS];
+	uint64_t count;
+	uint64_t total;
+	uint64_t max;
+} StatsHistogram;
+
+/**
+ *	Represents what a session spent its time on: a histogram per stage,
+ *	and counts of keys and of the frames sent to the terminal
+ */
+typedef struct _stats {
+	StatsHistogram stages[STATS_STAGE_COUNT];
+	uint64_t keys;
+	uint64_t frames;
+	uint64_t bytes;
+} Stats;
+
+/**
+ *	Get a timestamp, in nanoseconds, to time stages from
+ */
+extern uint64_t stats_now(void);
+
+/**
+ *	Empty every histogram and counter
+ */
+extern void stats_init(Stats *stats);
+
+/**
+ *	Add a value to a histogram
+ */
+extern void stats_histogram_add(StatsHistogram *hist, const uint64_t value);
+
+/**
+ *	Get the value that p percent of the values in a histogram are not
+ *	larger than (up to the bucket it falls in)
+ */
+extern uint64_t stats_percentile(const StatsHistogram *hist, const double p);
+
+/**
+ *	Record that a stage ran from start until now, and return now, so
+ *	the next stage can start from it
+ */
+extern uint64_t stats_record(Stats *stats, const StatsStage stage, const uint64_t start);
+
+/**
+ *	Count a frame of bytes sent to the terminal
+ */
+extern void stats_frame(Stats *stats, const uint64_t bytes);
+
+/**
+ *	Sum up the latencies in a line of at most width characters, for
+ *	showing while editing. buf has to hold STATS_LINE_MAX bytes
+ */
+extern void stats_format(const Stats *stats, char *buf, const size_t width);
+
+/**
+ *	Write a table of every stage and the counters to out
+ */
+extern void stats_dump(const Stats *stats, FILE *out);
+
+#endif /* _STATS_H_INCLUDED */
@@ -0,0 +1,66 @@
+#include "terminal.h"
+#include <unistd.h>
+#include <errno.h>
+
+static uint8_t terminal_tty_write(const Terminal *term, const unsigned char *data, const size_t len)
+{
+	size_t done;
+	ssize_t n;
+
+	for (done = 0; done < len; done += n) {
+		n = write(term->fd, data + done, len - done);
+		if (n < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void terminal_tty_size(const Terminal *term, TtyInfo *info)
+{
+	tty_info_get(info, term->fd);
+}
+
+void terminal_tty(Terminal *term, const int fd)
+{
+	term->write = terminal_tty_write;
+	term->size = terminal_tty_size;
+	term->fd = fd;
+	term->ctx = NULL;
+}
+
+static uint8_t terminal_virtual_write(const Terminal *term, const unsigned char *data, const size_t len)
+{
+	vterm_feed((VTerm *) term->ctx, data, len);
+	return 0;
+}
+
+static void terminal_virtual_size(const Terminal *term, TtyInfo *info)
+{
+	const VTerm *vt = (const VTerm *) term->ctx;
+
+	info->rows = vt->rows;
+	info->cols = vt->cols;
+}
+
+void terminal_virtual(Terminal *term, VTerm *vt)
+{
+	term->write = terminal_virtual_write;
+	term->size = terminal_virtual_size;
+	term->fd = -1;
+	term->ctx = vt;
+}
+
+uint8_t terminal_write(const Terminal *term, const unsigned char *data, const size_t len)
+{
+	return term->write(term, data, len);
+}
+
+void terminal_size(const Terminal *term, TtyInfo *info)
+{
+	term->size(term, info);
+}
@@ -0,0 +1,45 @@
+#ifndef _TERMINAL_H_INCLUDED
+#define _TERMINAL_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+#include "tty.h"
+#include "vterm.h"
+
+/**
+ *	Represents where the screen's frames go and where its size comes
+ *	from. write hands over len bytes of output and returns nonzero if
+ *	they could not all be written; size fills in how big the terminal
+ *	is. A backend keeps its descriptor in fd, or anything else it needs
+ *	in ctx. There are two of them:
+ *		1. terminal_tty - a real terminal on a descriptor
+ *		2. terminal_virtual - a VTerm in memory, for running headless
+ */
+typedef struct _terminal {
+	uint8_t (*write)(const struct _terminal *term, const unsigned char *data, const size_t len);
+	void (*size)(const struct _terminal *term, TtyInfo *info);
+	int fd;
+	void *ctx;
+} Terminal;
+
+/**
+ *	Set up a backend for the terminal on fd
+ */
+extern void terminal_tty(Terminal *term, const int fd);
+
+/**
+ *	Set up a backend that feeds everything to vt and is as big as it is
+ */
+extern void terminal_virtual(Terminal *term, VTerm *vt);
+
+/**
+ *	Write len bytes of data to the terminal
+ */
+extern uint8_t terminal_write(const Terminal *term, const unsigned char *data, const size_t len);
+
+/**
+ *	Get the size of the terminal
+ */
+extern void terminal_size(const Terminal *term, TtyInfo *info);
+
+#endif /* _TERMINAL_H_INCLUDED */
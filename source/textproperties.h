@@ -3,4 +3,19 @@
 
 #define TAB_SIZE	4
 
+/**
+ *	Check whether c is a control byte other than tab. These are drawn
+ *	in caret notation, ^[ for ESC and ^? for DEL, CONTROL_WIDTH columns
+ *	wide, rather than sent to the terminal
+ */
+#define text_is_control(c)	(((c) < 0x20 && (c) != '\t') || (c) == 0x7F)
+#define CONTROL_WIDTH	2
+
+/**
+ *	Check whether the code point cp is a C1 control, U+0080 to U+009F.
+ *	A terminal may act on these just as on ESC (U+009B is CSI), so they
+ *	are drawn like the C0 ones, as a caret and cp - 0x40
+ */
+#define text_is_c1(cp)	((cp) >= 0x80 && (cp) < 0xA0)
+
 #endif /* _TEXT_PROPERTIES_H_INCLUDED */
@@ -1,21 +1,44 @@
 #include "tty.h"
+#include "textproperties.h"
+#include "utf8.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/ioctl.h>
 
-void tty_info_get(TtyInfo *info)
+/*
+	Reads a dimension from the environment, the way curses does
+*/
+static uint16_t tty_env_size(const char *name, const uint16_t fallback)
+{
+	const char *value = getenv(name);
+	long n;
+
+	if (value == NULL)
+		return fallback;
+	n = strtol(value, NULL, 10);
+	return (n > 3 && n < UINT16_MAX) ? (uint16_t) n : fallback;
+}
+
+void tty_info_get(TtyInfo *info, const int fd)
 {
 	struct winsize w;
-	ioctl(STDOUT_FILENO, TIOCGWINSZ, &w);
 
-	info->rows = w.ws_row;
-	info->cols = w.ws_col;
+	if (fd >= 0 && ioctl(fd, TIOCGWINSZ, &w) == 0 && w.ws_row > 0 && w.ws_col > 0) {
+		info->rows = w.ws_row;
+		info->cols = w.ws_col;
+		return;
+	}
+
+	/* Headless, or a terminal that doesn't know its size */
+	info->rows = tty_env_size("LINES", TTY_DEFAULT_ROWS);
+	info->cols = tty_env_size("COLUMNS", TTY_DEFAULT_COLS);
 }
 
 uint8_t tty_line_buffer_new(TtyLineBuffer *line)
 {
-	line->buffer = (unsigned char *) malloc(sizeof(unsigned char) * BUFSIZE);
+	line->buffer = (unsigned char *) malloc(sizeof(unsigned char) * TTY_LINE_MIN_CAPACITY);
 
 	if (line->buffer == NULL) {
 		return 3;
@@ -23,6 +46,11 @@ uint8_t tty_line_buffer_new(TtyLineBuffer *line)
 
 	line->insertionPoint = 0;
 	line->length = 0;
+	line->capacity = TTY_LINE_MIN_CAPACITY;
+	line->column = 0;
+	line->marks.line = UINT64_MAX;
+	line->marks.points = NULL;
+	line->marks.count = line->marks.capacity = 0;
 
 	return 0;
 }
@@ -31,117 +59,438 @@ void tty_line_buffer_release(TtyLineBuffer *buf)
 {
 	if (buf->buffer != NULL) {
 		free(buf->buffer);
+		buf->buffer = NULL;
+	}
+	if (buf->marks.points != NULL) {
+		free(buf->marks.points);
+		buf->marks.points = NULL;
 	}
 }
 
-uint8_t tty_line_buffer_list_init(TtyLineBufferList *head)
+void tty_column_marks_add(TtyColumnMarks *marks, const uint64_t offset, const uint64_t column)
 {
-	if (head == NULL) {
-		head = (TtyLineBufferList *) malloc(sizeof(TtyLineBufferList));
+	TtyColumnMark *tmp;
+	uint64_t capacity;
 
-		if (head == NULL)
-			return 1;
+	if (marks == NULL || offset < ((marks->count) ? marks->points[marks->count - 1].offset : 0) + TTY_COLUMN_CHECKPOINT)
+		return;
+	if (marks->count >= marks->capacity) {
+		capacity = (marks->capacity) ? marks->capacity * 2 : 16;
+		tmp = (TtyColumnMark *) realloc(marks->points, sizeof(TtyColumnMark) * capacity);
+		if (tmp == NULL)
+			return;
+		marks->points = tmp;
+		marks->capacity = capacity;
 	}
+	marks->points[marks->count].offset = offset;
+	marks->points[marks->count++].column = column;
+}
+
+TtyColumnMark tty_column_marks_find(const TtyColumnMarks *marks, const uint64_t offset, const uint64_t col)
+{
+	TtyColumnMark start = { 0, 0 };
+	uint64_t lo = 0, hi, mid;
 
-	if (tty_line_buffer_new(&head->line) > 0)
-		return 2;
+	if (marks == NULL || marks->count == 0 || marks->points[0].offset > offset || marks->points[0].column > col)
+		return start;
 
-	head->prev = head->next = NULL;
-	return 0;
+	/* Offsets and columns both only grow along the line, so the ones that do come first */
+	for (hi = marks->count; hi - lo > 1; ) {
+		mid = lo + (hi - lo) / 2;
+		if (marks->points[mid].offset <= offset && marks->points[mid].column <= col)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return marks->points[lo];
+}
+
+void tty_column_marks_cut(TtyColumnMarks *marks, const uint64_t offset)
+{
+	while (marks->count > 0 && marks->points[marks->count - 1].offset > offset)
+		--marks->count;
+}
+
+uint64_t tty_column_advance(const uint64_t col, const unsigned char c)
+{
+	if (c == '\t')
+		return (col / TAB_SIZE + 1) * TAB_SIZE;
+	return col + (text_is_control(c) ? CONTROL_WIDTH : 1);
 }
 
-uint16_t tty_line_buffer_list_length(TtyLineBufferList *head)
+uint8_t tty_char_width(const unsigned char *s, const uint64_t len, uint8_t *width)
 {
-	TtyLineBufferList *cur = head;
-	uint16_t ret = 0;
+	uint32_t cp;
+	uint8_t n;
 
-	while (cur != NULL) {
-		++ret;
-		cur = cur->next;
+	if (s[0] < 0x80) {
+		*width = text_is_control(s[0]) ? CONTROL_WIDTH : 1;
+		return 1;
 	}
+	n = utf8_decode(s, len, &cp);
+	*width = text_is_c1(cp) ? CONTROL_WIDTH : utf8_width(cp);
+	return n;
+}
 
-	return ret;
+uint64_t tty_line_buffer_span(const TtyLineBuffer *buf, const uint64_t pos, const unsigned char **data)
+{
+	if (pos < buf->insertionPoint) {
+		*data = buf->buffer + pos;
+		return buf->insertionPoint - pos;
+	}
+	*data = buf->buffer + pos + buf->capacity - buf->length;
+	return buf->length - pos;
 }
 
-void tty_line_buffer_list_grab_line_at(TtyLineBufferList *head, const uint16_t pos, const char **str)
+/*
+	Updates the column for the insertion point stepping forward over the
+	character at the start of the n bytes of s, which is at pos. Returns
+	its length
+*/
+static uint64_t tty_line_buffer_step_forward(TtyLineBuffer *buf, const uint64_t pos, const unsigned char *s, const uint64_t n)
 {
-	TtyLineBufferList *cur = head;
-	uint16_t ret = 0;
+	uint8_t width, len = 1;
 
-	while (cur != NULL) {
-		++ret;
-		if (ret == pos) {
-			*str = (const char *) cur->line.buffer;
-			break;
-		}
+	if (s[0] == '\t') {
+		buf->column = tty_column_advance(buf->column, '\t');
+	} else {
+		len = tty_char_width(s, n, &width);
+		buf->column += width;
 	}
+	tty_column_marks_add(&buf->marks, pos + len, buf->column);
+	return len;
 }
 
-uint8_t tty_line_buffer_list_new(TtyLineBufferList **cur)
+/*
+	Gets the column the tab at pos, before the gap, starts at, given the
+	column after it. A tab ends on a multiple of TAB_SIZE, so it starts
+	as far past one as the text since the tab before it takes, unless a
+	checkpoint comes first and says where that text starts
+*/
+static uint64_t tty_line_buffer_tab_start(const TtyLineBuffer *buf, uint64_t pos, const uint64_t after)
 {
-	if ((*cur)->next == NULL) {
-		(*cur)->next = (TtyLineBufferList *) malloc(sizeof(TtyLineBufferList));
+	TtyColumnMark mark = tty_column_marks_find(&buf->marks, pos, UINT64_MAX);
+	uint64_t run = 0, prev;
+	uint8_t width;
 
-		if ((*cur)->next == NULL)
-			return 1;
+	while (pos > mark.offset && buf->buffer[pos - 1] != '\t') {
+		prev = (buf->buffer[pos - 1] < 0x80) ? pos - 1 : utf8_char_start(buf->buffer, pos);
+		tty_char_width(buf->buffer + prev, pos - prev, &width);
+		run += width;
+		pos = prev;
+	}
+	if (pos == mark.offset)
+		return mark.column + run;
+	return after - TAB_SIZE + run % TAB_SIZE;
+}
 
-		if (tty_line_buffer_new(&(*cur)->next->line)) {
-			return 2;
-		}
+/*
+	Updates the column for the insertion point stepping back over the
+	character that ends at end, in the text before the gap. Returns
+	where that character starts
+*/
+static uint64_t tty_line_buffer_step_back(TtyLineBuffer *buf, const uint64_t end)
+{
+	uint64_t start;
+	uint8_t width;
 
-		(*cur)->next->prev = *cur;
-		(*cur)->next->next = NULL;
-		(*cur) = (*cur)->next;
-	} else {
-		/* If we need to insert a new line admidst others */
-		TtyLineBufferList *tmp;
-		tmp = (*cur)->next;
-		(*cur)->next = (TtyLineBufferList *) malloc(sizeof(TtyLineBufferList));
+	if (buf->buffer[end - 1] == '\t') {
+		buf->column = tty_line_buffer_tab_start(buf, end - 1, buf->column);
+		return end - 1;
+	}
+
+	start = (buf->buffer[end - 1] < 0x80) ? end - 1 : utf8_char_start(buf->buffer, end);
+	tty_char_width(buf->buffer + start, end - start, &width);
+	buf->column = (buf->column > width) ? buf->column - width : 0;
+	return start;
+}
+
+/*
+	Walks forward from pos, at column *column, over whole characters
+	until it gets to to or the next one would end past col. Adds the
+	checkpoints it passes on the way, and returns where it stopped
+*/
+static uint64_t tty_line_buffer_walk(TtyLineBuffer *buf, uint64_t pos, uint64_t *column, const uint64_t to, const uint64_t col)
+{
+	const unsigned char *data;
+	uint64_t n, next;
+	uint8_t width;
 
-		if ((*cur)->next == NULL) {
-			return 3;
+	while (pos < to) {
+		n = tty_line_buffer_span(buf, pos, &data);
+
+		/* Printable ASCII a checkpoint at a time */
+		next = utf8_printable_span(data, (n < TTY_COLUMN_CHECKPOINT) ? n : TTY_COLUMN_CHECKPOINT);
+		if (next > to - pos)
+			next = to - pos;
+		if (next > col - *column)
+			next = col - *column;
+		if (next > 0) {
+			pos += next;
+			*column += next;
+			tty_column_marks_add(&buf->marks, pos, *column);
+			continue;
 		}
 
-		if (tty_line_buffer_new(&(*cur)->next->line)) {
-			return 4;
+		if (data[0] == '\t') {
+			next = tty_column_advance(*column, '\t');
+			n = 1;
+		} else {
+			n = tty_char_width(data, n, &width);
+			next = *column + width;
 		}
+		if (next > col)
+			break;
+		*column = next;
+		pos += n;
+		tty_column_marks_add(&buf->marks, pos, next);
+	}
+	return pos;
+}
+
+/*
+	Moves the gap to pos, which is at column
+*/
+static void tty_line_buffer_place(TtyLineBuffer *buf, const uint64_t pos, const uint64_t column)
+{
+	uint64_t gap = buf->capacity - buf->length;
+
+	if (pos < buf->insertionPoint)
+		memmove(buf->buffer + pos + gap, buf->buffer + pos, buf->insertionPoint - pos);
+	else if (pos > buf->insertionPoint)
+		memmove(buf->buffer + buf->insertionPoint, buf->buffer + buf->insertionPoint + gap, pos - buf->insertionPoint);
+	buf->insertionPoint = pos;
+	buf->column = column;
+}
+
+uint8_t tty_line_buffer_reserve(TtyLineBuffer *buf, const uint64_t extra)
+{
+	uint64_t capacity, tail;
+	unsigned char *tmp;
+
+	if (buf->capacity - buf->length >= extra)
+		return 0;
+
+	capacity = (buf->capacity) ? buf->capacity : TTY_LINE_MIN_CAPACITY;
+	while (capacity - buf->length < extra)
+		capacity *= 2;
+
+	tmp = (unsigned char *) realloc(buf->buffer, sizeof(unsigned char) * capacity);
+	if (tmp == NULL)
+		return 1;
+
+	/* The text after the gap has to stay glued to the end of the buffer */
+	tail = buf->length - buf->insertionPoint;
+	memmove(tmp + capacity - tail, tmp + buf->capacity - tail, tail);
+
+	buf->buffer = tmp;
+	buf->capacity = capacity;
+	return 0;
+}
+
+void tty_line_buffer_move_to(TtyLineBuffer *buf, const uint64_t pos)
+{
+	uint64_t target = (pos > buf->length) ? buf->length : pos;
+	uint64_t column = buf->column, i;
+	TtyColumnMark mark;
 
-		(*cur)->next->next = tmp;
-		(*cur)->next->prev = *cur;
-		(*cur) = (*cur)->next;
-		tmp->prev = *cur;
+	/* Whole characters are stepped over, so a target inside one moves past it */
+	if (target == 0) {
+		/* Nothing to measure at the start of the line */
+		column = 0;
+	} else if (target < buf->insertionPoint && buf->insertionPoint - target <= TTY_COLUMN_CHECKPOINT) {
+		for (i = buf->insertionPoint; i > target; )
+			i = tty_line_buffer_step_back(buf, i);
+		target = i;
+		column = buf->column;
+	} else {
+		/* Further back than that, it is measured again from the checkpoint before it */
+		i = buf->insertionPoint;
+		mark = tty_column_marks_find(&buf->marks, target, UINT64_MAX);
+		if (target < buf->insertionPoint || mark.offset > buf->insertionPoint) {
+			i = mark.offset;
+			column = mark.column;
+		}
+		target = tty_line_buffer_walk(buf, i, &column, target, UINT64_MAX);
+	}
+	tty_line_buffer_place(buf, target, column);
+}
+
+uint64_t tty_line_buffer_seek_column(TtyLineBuffer *buf, const uint64_t col, uint64_t *start)
+{
+	uint64_t pos = buf->insertionPoint, column = buf->column, prev;
+	TtyColumnMark mark = tty_column_marks_find(&buf->marks, buf->length, col);
+	uint8_t width;
+
+	if (col < column && col - mark.column >= column - col) {
+		/* Backwards, if it is nearer than the checkpoint before col */
+		while (column > col) {
+			if (buf->buffer[pos - 1] == '\t') {
+				column = tty_line_buffer_tab_start(buf, --pos, column);
+				continue;
+			}
+			prev = (buf->buffer[pos - 1] < 0x80) ? pos - 1 : utf8_char_start(buf->buffer, pos);
+			tty_char_width(buf->buffer + prev, pos - prev, &width);
+			column = (column > width) ? column - width : 0;
+			pos = prev;
+		}
+	} else if (col < column || mark.offset > pos) {
+		pos = mark.offset;
+		column = mark.column;
 	}
 
+	/* Then forwards, to the character that covers col */
+	pos = tty_line_buffer_walk(buf, pos, &column, buf->length, col);
+	*start = column;
+	return pos;
+}
+
+void tty_line_buffer_move_to_column(TtyLineBuffer *buf, const uint64_t col)
+{
+	uint64_t start, pos;
+
+	/* The character covering col starts at the last position not past it */
+	pos = tty_line_buffer_seek_column(buf, col, &start);
+	tty_line_buffer_place(buf, pos, start);
+}
+
+uint8_t tty_line_buffer_insert(TtyLineBuffer *buf, const unsigned char c)
+{
+	if (tty_line_buffer_reserve(buf, 1))
+		return 1;
+
+	tty_column_marks_cut(&buf->marks, buf->insertionPoint);
+	tty_line_buffer_step_forward(buf, buf->insertionPoint, &c, 1);
+
+	buf->buffer[buf->insertionPoint++] = c;
+	++buf->length;
 	return 0;
 }
 
-uint8_t tty_line_buffer_list_del(TtyLineBufferList **cur)
+uint8_t tty_line_buffer_insert_span(TtyLineBuffer *buf, const unsigned char *str, const uint64_t len)
 {
-	TtyLineBufferList *tmp;
+	uint64_t i, n;
 
-	if (cur == NULL)
+	if (tty_line_buffer_reserve(buf, len))
 		return 1;
 
-	tmp = *cur;
-	if ((*cur)->prev != NULL)
-		(*cur)->prev->next = (*cur)->next;
-	if ((*cur)->next != NULL)
-		(*cur)->next->prev = (*cur)->prev;
+	tty_column_marks_cut(&buf->marks, buf->insertionPoint);
+	for (i = 0; i < len; i += n)
+		n = tty_line_buffer_step_forward(buf, buf->insertionPoint + i, str + i, len - i);
+	memcpy(buf->buffer + buf->insertionPoint, str, len);
+	buf->insertionPoint += len;
+	buf->length += len;
+	return 0;
+}
+
+uint8_t tty_line_buffer_delete_back(TtyLineBuffer *buf)
+{
+	uint64_t start;
+
+	if (buf->insertionPoint == 0)
+		return 1;
+
+	start = tty_line_buffer_step_back(buf, buf->insertionPoint);
+	buf->length -= buf->insertionPoint - start;
+	buf->insertionPoint = start;
+	tty_column_marks_cut(&buf->marks, start);
+	return 0;
+}
+
+uint8_t tty_line_buffer_delete_forward(TtyLineBuffer *buf)
+{
+	const unsigned char *data;
+	uint64_t n;
+	uint8_t width;
 
-	tty_line_buffer_release(&(*cur)->line);
+	if (buf->insertionPoint >= buf->length)
+		return 1;
 
-	free(tmp);
+	/* Widening the gap swallows the character right after it */
+	n = tty_line_buffer_span(buf, buf->insertionPoint, &data);
+	buf->length -= tty_char_width(data, n, &width);
+	tty_column_marks_cut(&buf->marks, buf->insertionPoint);
 	return 0;
 }
 
-void tty_line_buffer_list_release(TtyLineBufferList *head)
+uint64_t tty_line_buffer_prev_grapheme(const TtyLineBuffer *buf)
+{
+	uint64_t pos = buf->insertionPoint, start;
+	uint32_t cp;
+
+	while (pos > 0) {
+		pos = utf8_char_start(buf->buffer, pos);
+		utf8_decode(buf->buffer + pos, buf->insertionPoint - pos, &cp);
+		if (pos == 0 || utf8_extends(cp))
+			continue;
+
+		/* Whatever follows a joiner is part of the same grapheme */
+		start = utf8_char_start(buf->buffer, pos);
+		utf8_decode(buf->buffer + start, pos - start, &cp);
+		if (cp != UTF8_ZWJ)
+			break;
+	}
+	return pos;
+}
+
+uint64_t tty_line_buffer_next_grapheme(const TtyLineBuffer *buf)
 {
-	TtyLineBufferList *cur = head, *tmp;
+	const unsigned char *data;
+	uint64_t len, i, n;
+	uint32_t cp, next;
+
+	if (buf->insertionPoint >= buf->length)
+		return buf->length;
 
-	while (cur != NULL) {
-		tmp = cur;
-		cur = cur->next;
-		tty_line_buffer_release(&tmp->line);
-		free(tmp);
+	len = tty_line_buffer_span(buf, buf->insertionPoint, &data);
+	i = utf8_decode(data, len, &cp);
+	while (i < len) {
+		/* Marks go with the character before them, and a joiner with the one after */
+		n = utf8_decode(data + i, len - i, &next);
+		if (!utf8_extends(next) && cp != UTF8_ZWJ)
+			break;
+		cp = next;
+		i += n;
 	}
+	return buf->insertionPoint + i;
+}
+
+void tty_line_buffer_clear(TtyLineBuffer *buf)
+{
+	/* The room stays, for the next line checked out to fill again */
+	buf->insertionPoint = 0;
+	buf->length = 0;
+	buf->column = 0;
+	buf->marks.count = 0;
+}
+
+unsigned char *tty_line_buffer_open(TtyLineBuffer *buf, const uint64_t length)
+{
+	tty_line_buffer_clear(buf);
+	if (tty_line_buffer_reserve(buf, length))
+		return NULL;
+	buf->length = length;
+	return buf->buffer + buf->capacity - length;
+}
+
+unsigned char tty_line_buffer_at(const TtyLineBuffer *buf, const uint64_t pos)
+{
+	if (pos < buf->insertionPoint)
+		return buf->buffer[pos];
+	return buf->buffer[pos + buf->capacity - buf->length];
+}
+
+const unsigned char *tty_line_buffer_cstr(TtyLineBuffer *buf)
+{
+	tty_line_buffer_move_to(buf, buf->length);
+	if (tty_line_buffer_reserve(buf, 1))
+		return NULL;
+	buf->buffer[buf->length] = '\0';
+	return buf->buffer;
+}
+
+void tty_line_buffer_write(const TtyLineBuffer *buf, FILE *sink)
+{
+	fwrite(buf->buffer, sizeof(unsigned char), buf->insertionPoint, sink);
+	fwrite(buf->buffer + buf->capacity - (buf->length - buf->insertionPoint), sizeof(unsigned char), buf->length - buf->insertionPoint, sink);
 }
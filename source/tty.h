@@ -2,11 +2,20 @@
 #define TTY_H_INCLUDED
 
 #include <stdint.h>
+#include <stdio.h>
 
 /**
- *	Default buffer size for each new line created
+ *	Initial capacity of each new line created. Lines grow on demand,
+ *	doubling their capacity whenever the gap runs out
  */
-static const uint64_t BUFSIZE = 512;
+static const uint64_t TTY_LINE_MIN_CAPACITY = 16;
+
+/**
+ *	Size assumed when there is no terminal to ask and LINES and COLUMNS
+ *	don't say otherwise
+ */
+#define TTY_DEFAULT_ROWS	24
+#define TTY_DEFAULT_COLS	80
 
 /**
  *	Stores info about the current terminal
@@ -17,59 +26,181 @@ typedef struct _tty_info {
 } TtyInfo;
 
 /**
- *	Populates any TtyInfo object given to it
+ *	Populates any TtyInfo object given to it, with the size of the
+ *	terminal on fd if there is one
+ */
+extern void tty_info_get(TtyInfo *info, const int fd);
+
+/**
+ *	Lines longer than TTY_COLUMN_CHECKPOINT bytes keep the visual column
+ *	about every that many bytes through them, so that finding a column,
+ *	or the column of a byte, only takes walking from the checkpoint
+ *	before it
+ */
+#define TTY_COLUMN_CHECKPOINT	4096
+
+/**
+ *	The visual column text at byte offset of a line starts at
  */
-extern void tty_info_get(TtyInfo *info);
+typedef struct _tty_column_mark {
+	uint64_t offset;
+	uint64_t column;
+} TtyColumnMark;
+
+/**
+ *	The column checkpoints of line, count of them in points, in order.
+ *	The start of the line, at column 0, is always one without being
+ *	stored. line is UINT64_MAX while they belong to no line
+ */
+typedef struct _tty_column_marks {
+	uint64_t line;
+	TtyColumnMark *points;
+	uint64_t count;
+	uint64_t capacity;
+} TtyColumnMarks;
 
 /**
  *	Represents a line buffer
+ *	The line is stored as a gap buffer: the text before the cursor lives
+ *	in buffer[0, insertionPoint) and the text after it lives at the end
+ *	of the allocation, so that inserting or deleting at the cursor never
+ *	has to shift the rest of the line.
+ *	column is the visual column of the insertion point, kept up to date
+ *	as it moves. Text is UTF-8: the insertion point only ever stops
+ *	between characters, and each character takes the columns given by
+ *	tty_char_width. Tabs advance to the next multiple of TAB_SIZE, so
+ *	stepping back over one only takes going back to the tab before it,
+ *	or to a checkpoint. marks holds the checkpoints of the line, which
+ *	are added as it is walked and dropped from wherever it is edited on
  */
 typedef struct _tty_line_buffer {
 	unsigned char *buffer;
 	uint64_t insertionPoint;
 	uint64_t length;
+	uint64_t capacity;
+	uint64_t column;
+	TtyColumnMarks marks;
 } TtyLineBuffer;
 
 extern uint8_t tty_line_buffer_new(TtyLineBuffer *line);
 extern void tty_line_buffer_release(TtyLineBuffer *buf);
 
 /**
- *	Keeps a doubly linked list of variadic line-buffers
+ *	Add a checkpoint at offset if the last one is far enough behind it
+ */
+extern void tty_column_marks_add(TtyColumnMarks *marks, const uint64_t offset, const uint64_t column);
+
+/**
+ *	Get the last checkpoint that is neither past offset nor past column
+ *	col. marks may be NULL, for a line that has none
+ */
+extern TtyColumnMark tty_column_marks_find(const TtyColumnMarks *marks, const uint64_t offset, const uint64_t col);
+
+/**
+ *	Drop the checkpoints past offset, where the line was edited
+ */
+extern void tty_column_marks_cut(TtyColumnMarks *marks, const uint64_t offset);
+
+/**
+ *	Makes sure at least `extra` bytes can be inserted without reallocating
+ */
+extern uint8_t tty_line_buffer_reserve(TtyLineBuffer *buf, const uint64_t extra);
+
+/**
+ *	Moves the insertion point (and with it, the gap) to pos
+ */
+extern void tty_line_buffer_move_to(TtyLineBuffer *buf, const uint64_t pos);
+
+/**
+ *	Moves the insertion point to the last position whose visual column
+ *	is not past col
+ */
+extern void tty_line_buffer_move_to_column(TtyLineBuffer *buf, const uint64_t col);
+
+/**
+ *	Find the position of the character that covers the visual column
+ *	col, and store the column that character starts at in start. Walks
+ *	from the insertion point or the checkpoint before col, whichever is
+ *	nearer
+ */
+extern uint64_t tty_line_buffer_seek_column(TtyLineBuffer *buf, const uint64_t col, uint64_t *start);
+
+/**
+ *	Get the visual column that text at column col continues at after c
+ */
+extern uint64_t tty_column_advance(const uint64_t col, const unsigned char c);
+
+/**
+ *	Get the length of the character at the start of the len bytes of s,
+ *	storing the number of columns it takes in width. Tabs are left to
+ *	tty_column_advance
+ */
+extern uint8_t tty_char_width(const unsigned char *s, const uint64_t len, uint8_t *width);
+
+/**
+ *	Inserts a character at the insertion point and advances past it
+ */
+extern uint8_t tty_line_buffer_insert(TtyLineBuffer *buf, const unsigned char c);
+
+/**
+ *	Inserts len bytes at the insertion point and advances past them
+ */
+extern uint8_t tty_line_buffer_insert_span(TtyLineBuffer *buf, const unsigned char *str, const uint64_t len);
+
+/**
+ *	Removes the character before the insertion point (Backspace)
+ */
+extern uint8_t tty_line_buffer_delete_back(TtyLineBuffer *buf);
+
+/**
+ *	Removes the character after the insertion point (Delete)
+ */
+extern uint8_t tty_line_buffer_delete_forward(TtyLineBuffer *buf);
+
+/**
+ *	Get the position the grapheme before the insertion point starts at:
+ *	a character together with the marks that combine with it, or a
+ *	sequence of characters held together by joiners
+ */
+extern uint64_t tty_line_buffer_prev_grapheme(const TtyLineBuffer *buf);
+
+/**
+ *	Get the position the grapheme after the insertion point ends at
  */
-typedef struct _tty_line_buffer_list {
-	TtyLineBuffer line;
-	struct _tty_line_buffer_list *next;
-	struct _tty_line_buffer_list *prev;
-} TtyLineBufferList;
+extern uint64_t tty_line_buffer_next_grapheme(const TtyLineBuffer *buf);
 
 /**
- *	Initializes a list
+ *	Empties the line, keeping the room it had
  */
-extern uint8_t tty_line_buffer_list_init(TtyLineBufferList *head);
+extern void tty_line_buffer_clear(TtyLineBuffer *buf);
 
 /**
- *	Get the number of lines
+ *	Empties the line and makes it length bytes long, all of them after
+ *	the insertion point, which is left at the start. Returns where those
+ *	bytes go, for the caller to fill in, or NULL if there is no room
  */
-extern uint16_t tty_line_buffer_list_length(TtyLineBufferList *head);
+extern unsigned char *tty_line_buffer_open(TtyLineBuffer *buf, const uint64_t length);
 
 /**
- *	Get the line buffer at specified position in list
+ *	Returns the character at logical position pos (gap excluded)
  */
-extern void tty_line_buffer_list_grab_line_at(TtyLineBufferList *head, const uint16_t pos, const char **str);
+extern unsigned char tty_line_buffer_at(const TtyLineBuffer *buf, const uint64_t pos);
 
 /**
- *	Adds a new node to the buffer list and advances the current pointer
+ *	Point data at the byte at logical position pos, and return how many
+ *	bytes follow it in one piece, up to the gap or the end of the line
  */
-extern uint8_t tty_line_buffer_list_new(TtyLineBufferList **cur);
+extern uint64_t tty_line_buffer_span(const TtyLineBuffer *buf, const uint64_t pos, const unsigned char **data);
 
 /**
- *	Deletes the current line from the buffer list
+ *	Closes the gap at the end of the line and NUL-terminates it, so that
+ *	the contents can be handed out as a regular string
  */
-extern uint8_t tty_line_buffer_list_del(TtyLineBufferList **cur);
+extern const unsigned char *tty_line_buffer_cstr(TtyLineBuffer *buf);
 
 /**
- *	Destroys buffer list
+ *	Writes the line contents into sink, without the gap
  */
-extern void tty_line_buffer_list_release(TtyLineBufferList *head);
+extern void tty_line_buffer_write(const TtyLineBuffer *buf, FILE *sink);
 
 #endif /* TTY_H_INCLUDED */
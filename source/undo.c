@@ -0,0 +1,222 @@
+#include "undo.h"
+#include <stdlib.h>
+#include <string.h>
+
+void undo_new(Undo *undo, const uint64_t budget)
+{
+	memset(undo, 0, sizeof(Undo));
+	undo->budget = budget;
+}
+
+void undo_release(Undo *undo)
+{
+	free(undo->records);
+	free(undo->arena);
+	undo_new(undo, undo->budget);
+}
+
+uint64_t undo_size(const Undo *undo)
+{
+	return (undo->length - undo->first) * sizeof(UndoRecord) + undo->arena_length - undo->arena_start;
+}
+
+/*
+	Makes room for one more record and len more bytes of text. What the
+	oldest groups were dropped from is reused first, once it is at least
+	half of what is there
+*/
+static uint8_t undo_reserve(Undo *undo, const uint64_t len)
+{
+	UndoRecord *records;
+	unsigned char *arena;
+	uint64_t capacity, i;
+
+	if (undo->length + 1 > undo->capacity && undo->first > 0 && undo->first >= undo->capacity / 2) {
+		memmove(undo->records, undo->records + undo->first, sizeof(UndoRecord) * (undo->length - undo->first));
+		undo->count -= undo->first;
+		undo->length -= undo->first;
+		undo->first = 0;
+	}
+	if (undo->length + 1 > undo->capacity) {
+		capacity = (undo->capacity) ? undo->capacity * 2 : 64;
+		records = (UndoRecord *) realloc(undo->records, sizeof(UndoRecord) * capacity);
+		if (records == NULL)
+			return 1;
+		undo->records = records;
+		undo->capacity = capacity;
+	}
+
+	if (undo->arena_length + len > undo->arena_capacity && undo->arena_start > 0
+		&& undo->arena_start >= undo->arena_capacity / 2) {
+		memmove(undo->arena, undo->arena + undo->arena_start, undo->arena_length - undo->arena_start);
+		for (i = undo->first; i < undo->length; ++i)
+			undo->records[i].data -= undo->arena_start;
+		undo->arena_length -= undo->arena_start;
+		undo->arena_start = 0;
+	}
+	if (undo->arena_length + len > undo->arena_capacity) {
+		capacity = (undo->arena_capacity) ? undo->arena_capacity : 4096;
+		while (capacity < undo->arena_length + len)
+			capacity *= 2;
+		arena = (unsigned char *) realloc(undo->arena, capacity);
+		if (arena == NULL)
+			return 2;
+		undo->arena = arena;
+		undo->arena_capacity = capacity;
+	}
+	return 0;
+}
+
+/*
+	Forgets the records that were undone, along with their text: a new
+	edit leaves nothing for them to be redone on top of
+*/
+static void undo_truncate(Undo *undo)
+{
+	if (undo->count == undo->length)
+		return;
+	undo->arena_length = undo->records[undo->count].data;
+	undo->length = undo->count;
+}
+
+/*
+	Drops the oldest groups, whole, until the log fits its budget again.
+	The newest group stays even if it does not fit on its own
+*/
+static void undo_trim(Undo *undo)
+{
+	uint64_t group;
+
+	while (undo->first < undo->length && undo_size(undo) > undo->budget
+		&& undo->records[undo->first].group != undo->records[undo->length - 1].group) {
+		group = undo->records[undo->first].group;
+		while (undo->first < undo->length && undo->records[undo->first].group == group)
+			++undo->first;
+		undo->arena_start = (undo->first < undo->length) ? undo->records[undo->first].data : undo->arena_length;
+		if (undo->count < undo->first)
+			undo->count = undo->first;
+	}
+}
+
+/*
+	Gets the record an edit could be merged into: the last one made, if
+	it is in the group still open
+*/
+static UndoRecord *undo_open_record(Undo *undo)
+{
+	UndoRecord *last;
+
+	if (!undo->open || undo->count == undo->first)
+		return NULL;
+	last = undo->records + undo->count - 1;
+	return (last->group == undo->group) ? last : NULL;
+}
+
+/* Starts a record whose len bytes of text are to be put at the end of the arena */
+static UndoRecord *undo_add(Undo *undo, const UndoOp op, const uint64_t offset, const uint64_t len)
+{
+	UndoRecord *record = undo->records + undo->length;
+
+	record->op = op;
+	record->group = undo->group;
+	record->offset = offset;
+	record->length = len;
+	record->data = undo->arena_length;
+	undo->count = ++undo->length;
+	undo->arena_length += len;
+	return record;
+}
+
+uint8_t undo_insert(Undo *undo, const uint64_t offset, const unsigned char *str, const uint64_t len)
+{
+	UndoRecord *last;
+
+	if (len == 0)
+		return 0;
+	undo_truncate(undo);
+	if (undo_reserve(undo, len))
+		return 1;
+
+	last = undo_open_record(undo);
+	if (last != NULL && last->op == UNDO_INSERT && offset == last->offset + last->length) {
+		/* Typing on from where the last insertion ended */
+		memcpy(undo->arena + undo->arena_length, str, len);
+		undo->arena_length += len;
+		last->length += len;
+	} else {
+		last = undo_add(undo, UNDO_INSERT, offset, len);
+		memcpy(undo->arena + last->data, str, len);
+	}
+
+	undo->open = 1;
+	undo_trim(undo);
+	return 0;
+}
+
+unsigned char *undo_delete(Undo *undo, const uint64_t offset, const uint64_t len)
+{
+	UndoRecord *last;
+	unsigned char *dst;
+
+	if (len == 0)
+		return NULL;
+	undo_truncate(undo);
+	if (undo_reserve(undo, len))
+		return NULL;
+
+	last = undo_open_record(undo);
+	if (last != NULL && last->op == UNDO_DELETE && offset + len == last->offset) {
+		/* Deleting backwards from where the last deletion was: the text goes in front */
+		memmove(undo->arena + last->data + len, undo->arena + last->data, last->length);
+		dst = undo->arena + last->data;
+		undo->arena_length += len;
+		last->offset = offset;
+		last->length += len;
+	} else if (last != NULL && last->op == UNDO_DELETE && offset == last->offset) {
+		dst = undo->arena + undo->arena_length;
+		undo->arena_length += len;
+		last->length += len;
+	} else {
+		last = undo_add(undo, UNDO_DELETE, offset, len);
+		dst = undo->arena + last->data;
+	}
+
+	undo->open = 1;
+	undo_trim(undo);
+	return dst;
+}
+
+void undo_boundary(Undo *undo)
+{
+	if (!undo->open)
+		return;
+	++undo->group;
+	undo->open = 0;
+}
+
+const UndoRecord *undo_last(const Undo *undo)
+{
+	return (undo->count > undo->first) ? undo->records + undo->count - 1 : NULL;
+}
+
+const UndoRecord *undo_next(const Undo *undo)
+{
+	return (undo->count < undo->length) ? undo->records + undo->count : NULL;
+}
+
+const unsigned char *undo_text(const Undo *undo, const UndoRecord *record)
+{
+	return undo->arena + record->data;
+}
+
+void undo_back(Undo *undo)
+{
+	if (undo->count > undo->first)
+		--undo->count;
+}
+
+void undo_forward(Undo *undo)
+{
+	if (undo->count < undo->length)
+		++undo->count;
+}
@@ -0,0 +1,123 @@
+#ifndef _UNDO_H_INCLUDED
+#define _UNDO_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ *	Most memory (in bytes) an undo log holds by default, records and
+ *	text together
+ */
+#define UNDO_BUDGET	(32 << 20)
+
+/**
+ *	Kinds of edits in an undo log
+ *		1. UNDO_INSERT - bytes inserted at an offset
+ *		2. UNDO_DELETE - bytes removed from an offset
+ */
+typedef enum _undo_op {
+	UNDO_INSERT = 'i', UNDO_DELETE = 'd'
+} UndoOp;
+
+/**
+ *	An edit of the document: length bytes inserted at or deleted from
+ *	offset. The bytes are kept at data in the log's arena. Edits of the
+ *	same group were made by one command, and are undone together
+ */
+typedef struct _undo_record {
+	uint8_t op;
+	uint64_t group;
+	uint64_t offset;
+	uint64_t length;
+	uint64_t data;
+} UndoRecord;
+
+/**
+ *	Represents the edits made to a document, oldest first, with the text
+ *	each of them inserted or deleted, so that they can be undone and
+ *	redone. The records from first up to count have been made; the ones
+ *	from count up to length were undone and can be redone, until a new
+ *	edit is recorded. The text of all of them is kept back to back in a
+ *	single arena, from arena_start on, in the order they were recorded.
+ *	Edits go into group until undo_boundary is called; as long as it is
+ *	open, an edit that carries on the one before it (typing right after
+ *	it, or deleting right before or at it) is merged into that record.
+ *	Once records and text take more than budget bytes, the oldest groups
+ *	are dropped, though never the newest: the last edit can always be
+ *	undone, however large it is
+ */
+typedef struct _undo {
+	UndoRecord *records;
+	uint64_t first;
+	uint64_t count;
+	uint64_t length;
+	uint64_t capacity;
+	unsigned char *arena;
+	uint64_t arena_start;
+	uint64_t arena_length;
+	uint64_t arena_capacity;
+	uint64_t group;
+	uint8_t open;
+	uint64_t budget;
+} Undo;
+
+/**
+ *	Initialize an empty undo log, holding at most budget bytes
+ */
+extern void undo_new(Undo *undo, const uint64_t budget);
+
+/**
+ *	Releases the undo log
+ */
+extern void undo_release(Undo *undo);
+
+/**
+ *	Record an insertion of len bytes of str at offset. Whatever could
+ *	be redone is forgotten
+ */
+extern uint8_t undo_insert(Undo *undo, const uint64_t offset, const unsigned char *str, const uint64_t len);
+
+/**
+ *	Record the deletion of len bytes at offset. Whatever could be redone
+ *	is forgotten. Returns where the len bytes deleted are to be copied,
+ *	or NULL if there was no room for them
+ */
+extern unsigned char *undo_delete(Undo *undo, const uint64_t offset, const uint64_t len);
+
+/**
+ *	Close the current group, so that the next edit starts a new one
+ */
+extern void undo_boundary(Undo *undo);
+
+/**
+ *	Get the record undoing would revert next, or NULL if there is none
+ */
+extern const UndoRecord *undo_last(const Undo *undo);
+
+/**
+ *	Get the record redoing would make again next, or NULL if there is
+ *	none
+ */
+extern const UndoRecord *undo_next(const Undo *undo);
+
+/**
+ *	Get the text of a record
+ */
+extern const unsigned char *undo_text(const Undo *undo, const UndoRecord *record);
+
+/**
+ *	Mark the record undo_last returned as undone
+ */
+extern void undo_back(Undo *undo);
+
+/**
+ *	Mark the record undo_next returned as made again
+ */
+extern void undo_forward(Undo *undo);
+
+/**
+ *	Get how many bytes the log holds, records and text together
+ */
+extern uint64_t undo_size(const Undo *undo);
+
+#endif /* _UNDO_H_INCLUDED */
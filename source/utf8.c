@@ -0,0 +1,182 @@
+#include "utf8.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/*
+	A range of code points, both ends included
+*/
+typedef struct _utf8_range {
+	uint32_t first;
+	uint32_t last;
+} Utf8Range;
+
+/*
+	East Asian Wide (W) and Fullwidth (F) characters, emoji included
+*/
+static const Utf8Range UTF8_WIDE[] = {
+	{ 0x1100, 0x115F }, { 0x231A, 0x231B }, { 0x2329, 0x232A }, { 0x23E9, 0x23EC }, { 0x23F0, 0x23F0 },
+	{ 0x23F3, 0x23F3 }, { 0x25FD, 0x25FE }, { 0x2614, 0x2615 }, { 0x2648, 0x2653 }, { 0x267F, 0x267F },
+	{ 0x2693, 0x2693 }, { 0x26A1, 0x26A1 }, { 0x26AA, 0x26AB }, { 0x26BD, 0x26BE }, { 0x26C4, 0x26C5 },
+	{ 0x26CE, 0x26CE }, { 0x26D4, 0x26D4 }, { 0x26EA, 0x26EA }, { 0x26F2, 0x26F3 }, { 0x26F5, 0x26F5 },
+	{ 0x26FA, 0x26FA }, { 0x26FD, 0x26FD }, { 0x2705, 0x2705 }, { 0x270A, 0x270B }, { 0x2728, 0x2728 },
+	{ 0x274C, 0x274C }, { 0x274E, 0x274E }, { 0x2753, 0x2755 }, { 0x2757, 0x2757 }, { 0x2795, 0x2797 },
+	{ 0x27B0, 0x27B0 }, { 0x27BF, 0x27BF }, { 0x2B1B, 0x2B1C }, { 0x2B50, 0x2B50 }, { 0x2B55, 0x2B55 },
+	{ 0x2E80, 0x3029 }, { 0x302E, 0x303E }, { 0x3041, 0x3098 }, { 0x309B, 0x33FF }, { 0x3400, 0x4DBF },
+	{ 0x4E00, 0x9FFF }, { 0xA000, 0xA4CF }, { 0xA960, 0xA97F }, { 0xAC00, 0xD7A3 }, { 0xF900, 0xFAFF },
+	{ 0xFE10, 0xFE19 }, { 0xFE30, 0xFE6F }, { 0xFF00, 0xFF60 }, { 0xFFE0, 0xFFE6 }, { 0x16FE0, 0x16FE4 },
+	{ 0x17000, 0x18AFF }, { 0x1B000, 0x1B2FF }, { 0x1F004, 0x1F004 }, { 0x1F0CF, 0x1F0CF }, { 0x1F18E, 0x1F18E },
+	{ 0x1F191, 0x1F19A }, { 0x1F200, 0x1F202 }, { 0x1F210, 0x1F23B }, { 0x1F240, 0x1F248 }, { 0x1F250, 0x1F251 },
+	{ 0x1F260, 0x1F265 }, { 0x1F300, 0x1F320 }, { 0x1F32D, 0x1F335 }, { 0x1F337, 0x1F37C }, { 0x1F37E, 0x1F393 },
+	{ 0x1F3A0, 0x1F3CA }, { 0x1F3CF, 0x1F3D3 }, { 0x1F3E0, 0x1F3F0 }, { 0x1F3F4, 0x1F3F4 }, { 0x1F3F8, 0x1F3FA },
+	{ 0x1F400, 0x1F43E }, { 0x1F440, 0x1F440 }, { 0x1F442, 0x1F4FC }, { 0x1F4FF, 0x1F53D }, { 0x1F54B, 0x1F54E },
+	{ 0x1F550, 0x1F567 }, { 0x1F57A, 0x1F57A }, { 0x1F595, 0x1F596 }, { 0x1F5A4, 0x1F5A4 }, { 0x1F5FB, 0x1F64F },
+	{ 0x1F680, 0x1F6C5 }, { 0x1F6CC, 0x1F6CC }, { 0x1F6D0, 0x1F6D2 }, { 0x1F6D5, 0x1F6D7 }, { 0x1F6EB, 0x1F6EC },
+	{ 0x1F6F4, 0x1F6FC }, { 0x1F7E0, 0x1F7EB }, { 0x1F90C, 0x1F93A }, { 0x1F93C, 0x1F945 }, { 0x1F947, 0x1F9FF },
+	{ 0x1FA70, 0x1FAFF }, { 0x20000, 0x2FFFD }, { 0x30000, 0x3FFFD }
+};
+
+/*
+	Characters that take no column of their own: combining marks, format
+	characters, variation selectors and emoji modifiers
+*/
+static const Utf8Range UTF8_ZERO[] = {
+	{ 0x0300, 0x036F }, { 0x0483, 0x0489 }, { 0x0591, 0x05BD }, { 0x05BF, 0x05BF }, { 0x05C1, 0x05C2 },
+	{ 0x05C4, 0x05C5 }, { 0x05C7, 0x05C7 }, { 0x0610, 0x061A }, { 0x064B, 0x065F }, { 0x0670, 0x0670 },
+	{ 0x06D6, 0x06DC }, { 0x06DF, 0x06E4 }, { 0x06E7, 0x06E8 }, { 0x06EA, 0x06ED }, { 0x0711, 0x0711 },
+	{ 0x0730, 0x074A }, { 0x07A6, 0x07B0 }, { 0x0900, 0x0902 }, { 0x093A, 0x093A }, { 0x093C, 0x093C },
+	{ 0x0941, 0x0948 }, { 0x094D, 0x094D }, { 0x0951, 0x0957 }, { 0x0962, 0x0963 }, { 0x0981, 0x0981 },
+	{ 0x09BC, 0x09BC }, { 0x09C1, 0x09C4 }, { 0x09CD, 0x09CD }, { 0x0E31, 0x0E31 }, { 0x0E34, 0x0E3A },
+	{ 0x0E47, 0x0E4E }, { 0x0EB1, 0x0EB1 }, { 0x0EB4, 0x0EBC }, { 0x0EC8, 0x0ECD }, { 0x1160, 0x11FF },
+	{ 0x1AB0, 0x1AFF }, { 0x1DC0, 0x1DFF }, { 0x200B, 0x200F }, { 0x202A, 0x202E }, { 0x2060, 0x2064 },
+	{ 0x20D0, 0x20FF }, { 0x302A, 0x302D }, { 0x3099, 0x309A }, { 0xFE00, 0xFE0F }, { 0xFE20, 0xFE2F },
+	{ 0xFEFF, 0xFEFF }, { 0x1F3FB, 0x1F3FF }, { 0xE0020, 0xE007F }, { 0xE0100, 0xE01EF }
+};
+
+static uint8_t utf8_in(const Utf8Range *table, const uint64_t count, const uint32_t cp)
+{
+	uint64_t lo = 0, hi = count, mid;
+
+	if (cp < table[0].first || cp > table[count - 1].last)
+		return 0;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (cp > table[mid].last)
+			lo = mid + 1;
+		else if (cp < table[mid].first)
+			hi = mid;
+		else
+			return 1;
+	}
+	return 0;
+}
+
+uint8_t utf8_sequence_length(const unsigned char lead)
+{
+	if (lead >= 0xC2 && lead <= 0xDF)
+		return 2;
+	if (lead >= 0xE0 && lead <= 0xEF)
+		return 3;
+	if (lead >= 0xF0 && lead <= 0xF4)
+		return 4;
+	return 1;
+}
+
+uint8_t utf8_decode(const unsigned char *s, const uint64_t len, uint32_t *cp)
+{
+	uint8_t n, i;
+	uint32_t c;
+
+	if (s[0] < 0x80) {
+		*cp = s[0];
+		return 1;
+	}
+
+	n = utf8_sequence_length(s[0]);
+	*cp = UTF8_REPLACEMENT;
+	if (n == 1 || n > len)
+		return 1;
+
+	c = s[0] & (0x7F >> n);
+	for (i = 1; i < n; ++i) {
+		if (!utf8_is_continuation(s[i]))
+			return 1;
+		c = (c << 6) | (s[i] & 0x3F);
+	}
+
+	/* Overlong forms, surrogates and anything past U+10FFFF */
+	if ((n == 3 && c < 0x800) || (n == 4 && (c < 0x10000 || c > 0x10FFFF)) || (c >= 0xD800 && c <= 0xDFFF))
+		return 1;
+
+	*cp = c;
+	return n;
+}
+
+uint64_t utf8_char_start(const unsigned char *s, const uint64_t end)
+{
+	uint64_t start;
+	uint32_t cp;
+
+	/*
+		Only a lead byte at most three back can own the byte before end,
+		and only if the sequence it starts ends exactly there; otherwise
+		that byte stands on its own
+	*/
+	for (start = end - 1; start > 0 && end - start < 4 && utf8_is_continuation(s[start]); --start);
+	if (start + utf8_decode(s + start, end - start, &cp) == end)
+		return start;
+	return end - 1;
+}
+
+uint8_t utf8_width(const uint32_t cp)
+{
+	if (cp < 0x300)
+		return 1;
+	if (utf8_in(UTF8_ZERO, sizeof(UTF8_ZERO) / sizeof(Utf8Range), cp))
+		return 0;
+	if (utf8_in(UTF8_WIDE, sizeof(UTF8_WIDE) / sizeof(Utf8Range), cp))
+		return 2;
+	return 1;
+}
+
+uint8_t utf8_extends(const uint32_t cp)
+{
+	return cp >= 0x300 && utf8_width(cp) == 0;
+}
+
+uint64_t utf8_ascii_span(const unsigned char *s, const uint64_t len)
+{
+	uint64_t i = 0;
+#ifdef __SSE2__
+	int mask;
+
+	/* The top bit of every byte, gathered into a mask: zero means all ASCII */
+	for (; i + 16 <= len; i += 16) {
+		mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *) (s + i)));
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	for (; i < len && s[i] < 0x80; ++i);
+	return i;
+}
+
+uint64_t utf8_printable_span(const unsigned char *s, const uint64_t len)
+{
+	uint64_t i = 0;
+#ifdef __SSE2__
+	const __m128i low = _mm_set1_epi8(0x1F), high = _mm_set1_epi8(0x7F);
+	__m128i v;
+	int mask;
+
+	/* Signed compares: bytes past 0x7F are negative, so fall below low too */
+	for (; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *) (s + i));
+		mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpgt_epi8(v, low), _mm_cmplt_epi8(v, high))) ^ 0xFFFF;
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+#endif
+	for (; i < len && s[i] > 0x1F && s[i] < 0x7F; ++i);
+	return i;
+}
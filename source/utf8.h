@@ -0,0 +1,65 @@
+#ifndef _UTF8_H_INCLUDED
+#define _UTF8_H_INCLUDED
+
+#include <stdint.h>
+
+/**
+ *	What a byte that does not start a valid sequence decodes to
+ */
+#define UTF8_REPLACEMENT	0xFFFD
+
+/**
+ *	Zero width joiner: the characters either side of it are one grapheme
+ */
+#define UTF8_ZWJ	0x200D
+
+/**
+ *	Check whether c continues a multi-byte sequence rather than starting
+ *	a character
+ */
+#define utf8_is_continuation(c)	(((c) & 0xC0) == 0x80)
+
+/**
+ *	Get the number of bytes of the sequence that lead starts, going only
+ *	by lead itself. Returns 1 for anything that cannot start one
+ */
+extern uint8_t utf8_sequence_length(const unsigned char lead);
+
+/**
+ *	Decode the character at the start of the len bytes of s into cp and
+ *	return how many bytes it takes. A byte that does not start a valid,
+ *	complete sequence is a character of its own, UTF8_REPLACEMENT
+ */
+extern uint8_t utf8_decode(const unsigned char *s, const uint64_t len, uint32_t *cp);
+
+/**
+ *	Find where the character that ends at end starts, looking no further
+ *	back than s. Agrees with decoding forwards from any earlier character
+ */
+extern uint64_t utf8_char_start(const unsigned char *s, const uint64_t end);
+
+/**
+ *	Get the number of columns the terminal gives cp: 2 for East Asian
+ *	wide and fullwidth characters, 0 for ones that combine with the
+ *	character before them, 1 for everything else
+ */
+extern uint8_t utf8_width(const uint32_t cp);
+
+/**
+ *	Check whether cp belongs to the grapheme of the character before it
+ */
+extern uint8_t utf8_extends(const uint32_t cp);
+
+/**
+ *	Get the number of bytes at the start of s that are plain ASCII. Goes
+ *	16 bytes at a time where SSE2 is available
+ */
+extern uint64_t utf8_ascii_span(const unsigned char *s, const uint64_t len);
+
+/**
+ *	Get the number of bytes at the start of s that are printable ASCII,
+ *	each a column wide: no control bytes, tabs or anything past 0x7E
+ */
+extern uint64_t utf8_printable_span(const unsigned char *s, const uint64_t len);
+
+#endif /* _UTF8_H_INCLUDED */
@@ -0,0 +1,44 @@
+#include "viewport.h"
+
+void viewport_init(Viewport *vp, const uint16_t height, const uint16_t width)
+{
+	vp->top_line = vp->left_col = 0;
+	viewport_resize(vp, height, width);
+}
+
+void viewport_resize(Viewport *vp, const uint16_t height, const uint16_t width)
+{
+	vp->height = (height) ? height : 1;
+	vp->width = (width) ? width : 1;
+}
+
+uint8_t viewport_show_line(Viewport *vp, const uint64_t line)
+{
+	if (line < vp->top_line) {
+		vp->top_line = line;
+		return 1;
+	}
+	if (line >= vp->top_line + vp->height) {
+		vp->top_line = line - vp->height + 1;
+		return 1;
+	}
+	return 0;
+}
+
+uint8_t viewport_show_column(Viewport *vp, const uint64_t col)
+{
+	if (col < vp->left_col) {
+		vp->left_col = col;
+		return 1;
+	}
+	if (col >= vp->left_col + vp->width) {
+		vp->left_col = col - vp->width + 1;
+		return 1;
+	}
+	return 0;
+}
+
+uint8_t viewport_has_line(const Viewport *vp, const uint64_t line)
+{
+	return line >= vp->top_line && line < vp->top_line + vp->height;
+}
@@ -0,0 +1,46 @@
+#ifndef _VIEWPORT_H_INCLUDED
+#define _VIEWPORT_H_INCLUDED
+
+#include <stdint.h>
+
+/**
+ *	Represents the part of the document that is on screen: height lines
+ *	starting at top_line, width columns starting at left_col. Nothing is
+ *	copied out of the document; the visible lines are read from it when
+ *	the screen is drawn, so scrolling only moves top_line
+ */
+typedef struct _viewport {
+	uint64_t top_line;
+	uint64_t left_col;
+	uint16_t height;
+	uint16_t width;
+} Viewport;
+
+/**
+ *	Set up a viewport of the given size at the top of the document
+ */
+extern void viewport_init(Viewport *vp, const uint16_t height, const uint16_t width);
+
+/**
+ *	Change the size of the viewport, keeping where it starts
+ */
+extern void viewport_resize(Viewport *vp, const uint16_t height, const uint16_t width);
+
+/**
+ *	Scroll as little as needed for line to be visible. Returns non-zero
+ *	if the viewport moved
+ */
+extern uint8_t viewport_show_line(Viewport *vp, const uint64_t line);
+
+/**
+ *	Scroll sideways as little as needed for the visual column col to be
+ *	visible. Returns non-zero if the viewport moved
+ */
+extern uint8_t viewport_show_column(Viewport *vp, const uint64_t col);
+
+/**
+ *	Check whether line is inside the viewport
+ */
+extern uint8_t viewport_has_line(const Viewport *vp, const uint64_t line);
+
+#endif /* _VIEWPORT_H_INCLUDED */
@@ -0,0 +1,435 @@
+#include "vterm.h"
+#include "utf8.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Most parameters of a control sequence that are looked at */
+#define VTERM_PARAMS_MAX	16
+
+uint8_t vterm_new(VTerm *vt, const uint16_t rows, const uint16_t cols)
+{
+	size_t i;
+
+	if (vt == NULL || rows == 0 || cols == 0)
+		return 1;
+
+	vt->cells = (VTermCell *) malloc(sizeof(VTermCell) * rows * cols);
+	if (vt->cells == NULL)
+		return 2;
+
+	vt->rows = rows;
+	vt->cols = cols;
+	vt->row = vt->col = 0;
+	vt->wrap = 0;
+	vt->pen.flags = 0;
+	vt->pen.fg = vt->pen.bg = VTERM_DEFAULT;
+	vt->state = VTERM_GROUND;
+	vt->seq_length = vt->pending_length = 0;
+	memset(&vt->stats, 0, sizeof(VTermStats));
+
+	for (i = 0; i < (size_t) rows * cols; ++i) {
+		memset(vt->cells[i].glyph, 0, VTERM_GLYPH_MAX);
+		vt->cells[i].pen = vt->pen;
+	}
+
+	return 0;
+}
+
+void vterm_release(VTerm *vt)
+{
+	if (vt == NULL)
+		return;
+	free(vt->cells);
+	vt->cells = NULL;
+}
+
+const VTermCell *vterm_cell(const VTerm *vt, const uint16_t row, const uint16_t col)
+{
+	return vt->cells + (size_t) row * vt->cols + col;
+}
+
+static VTermCell *vterm_at(VTerm *vt, const uint16_t row, const uint16_t col)
+{
+	return vt->cells + (size_t) row * vt->cols + col;
+}
+
+/*
+	Erases the cells from first up to (not including) last, counting
+	across rows. Erased cells take the background of the pen
+*/
+static void vterm_erase(VTerm *vt, const size_t first, const size_t last)
+{
+	size_t i;
+
+	for (i = first; i < last; ++i) {
+		memset(vt->cells[i].glyph, 0, VTERM_GLYPH_MAX);
+		vt->cells[i].pen.flags = 0;
+		vt->cells[i].pen.fg = VTERM_DEFAULT;
+		vt->cells[i].pen.bg = vt->pen.bg;
+	}
+}
+
+/*
+	Moves the cursor down a row, scrolling everything up a row if it is
+	on the last one already
+*/
+static void vterm_linefeed(VTerm *vt)
+{
+	if (vt->row + 1 < vt->rows) {
+		++vt->row;
+		return;
+	}
+	memmove(vt->cells, vt->cells + vt->cols, sizeof(VTermCell) * (vt->rows - 1) * vt->cols);
+	vterm_erase(vt, (size_t) (vt->rows - 1) * vt->cols, (size_t) vt->rows * vt->cols);
+}
+
+/*
+	Blanks whatever is left of a wide character that a write to cell
+	(row, col) is about to cut in half
+*/
+static void vterm_split_wide(VTerm *vt, const uint16_t row, const uint16_t col)
+{
+	VTermCell *cell = vterm_at(vt, row, col);
+
+	if (cell->glyph[0] == VTERM_GLYPH_WIDE && col > 0)
+		memset(cell[-1].glyph, 0, VTERM_GLYPH_MAX);
+	else if (cell->glyph[0] != VTERM_GLYPH_WIDE && col + 1 < vt->cols && cell[1].glyph[0] == VTERM_GLYPH_WIDE)
+		memset(cell[1].glyph, 0, VTERM_GLYPH_MAX);
+}
+
+/*
+	Draws a character of n bytes at the cursor and moves past it
+*/
+static void vterm_put(VTerm *vt, const unsigned char *s, const uint8_t n, const uint32_t cp)
+{
+	uint8_t width = (cp < 0x80) ? 1 : utf8_width(cp);
+	uint16_t col;
+	VTermCell *cell;
+	size_t len;
+
+	++vt->stats.glyphs;
+	if (width == 0) {
+		/* A mark goes in with the character before the cursor */
+		col = (vt->wrap) ? vt->col : vt->col - 1;
+		if (!vt->wrap && vt->col == 0)
+			return;
+		cell = vterm_at(vt, vt->row, col);
+		if (cell->glyph[0] == VTERM_GLYPH_WIDE && col > 0)
+			--cell;
+		for (len = 0; len < VTERM_GLYPH_MAX && cell->glyph[len] != '\0'; ++len);
+		if (len + n <= VTERM_GLYPH_MAX)
+			memcpy(cell->glyph + len, s, n);
+		return;
+	}
+
+	if (vt->wrap || (width == 2 && vt->col + 1 >= vt->cols)) {
+		vt->col = 0;
+		vt->wrap = 0;
+		vterm_linefeed(vt);
+	}
+
+	vterm_split_wide(vt, vt->row, vt->col);
+	cell = vterm_at(vt, vt->row, vt->col);
+	memset(cell->glyph, 0, VTERM_GLYPH_MAX);
+	memcpy(cell->glyph, s, n);
+	cell->pen = vt->pen;
+	if (width == 2) {
+		vterm_split_wide(vt, vt->row, vt->col + 1);
+		memset(cell[1].glyph, 0, VTERM_GLYPH_MAX);
+		cell[1].glyph[0] = VTERM_GLYPH_WIDE;
+		cell[1].pen = vt->pen;
+	}
+
+	/* The cursor stays on the last column until more text comes */
+	if (vt->col + width >= vt->cols) {
+		vt->col = vt->cols - 1;
+		vt->wrap = 1;
+	} else {
+		vt->col += width;
+	}
+}
+
+/*
+	Draws what is pending, which was never finished, as a replacement
+	character
+*/
+static void vterm_put_invalid(VTerm *vt)
+{
+	vterm_put(vt, (const unsigned char *) "\xEF\xBF\xBD", 3, UTF8_REPLACEMENT);
+	vt->pending_length = 0;
+}
+
+static void vterm_sgr(VTerm *vt, const unsigned int *params, const uint8_t count)
+{
+	unsigned int p;
+	uint8_t i;
+
+	++vt->stats.sgr;
+	if (count == 0) {
+		vt->pen.flags = 0;
+		vt->pen.fg = vt->pen.bg = VTERM_DEFAULT;
+		return;
+	}
+
+	for (i = 0; i < count; ++i) {
+		p = params[i];
+		if (p == 0) {
+			vt->pen.flags = 0;
+			vt->pen.fg = vt->pen.bg = VTERM_DEFAULT;
+		} else if (p == 1) {
+			vt->pen.flags |= VTERM_BOLD;
+		} else if (p == 4) {
+			vt->pen.flags |= VTERM_UNDERLINED;
+		} else if (p == 5) {
+			vt->pen.flags |= VTERM_BLINKING;
+		} else if (p == 7) {
+			vt->pen.flags |= VTERM_REVERSED;
+		} else if (p == 8) {
+			vt->pen.flags |= VTERM_CONCEALED;
+		} else if (p == 22) {
+			vt->pen.flags &= ~VTERM_BOLD;
+		} else if (p == 24) {
+			vt->pen.flags &= ~VTERM_UNDERLINED;
+		} else if (p == 25) {
+			vt->pen.flags &= ~VTERM_BLINKING;
+		} else if (p == 27) {
+			vt->pen.flags &= ~VTERM_REVERSED;
+		} else if (p == 28) {
+			vt->pen.flags &= ~VTERM_CONCEALED;
+		} else if (p >= 30 && p <= 37) {
+			vt->pen.fg = p - 30;
+		} else if (p == 39) {
+			vt->pen.fg = VTERM_DEFAULT;
+		} else if (p >= 40 && p <= 47) {
+			vt->pen.bg = p - 40;
+		} else if (p == 49) {
+			vt->pen.bg = VTERM_DEFAULT;
+		} else if (p >= 90 && p <= 97) {
+			vt->pen.fg = p - 90 + 8;
+		} else if (p >= 100 && p <= 107) {
+			vt->pen.bg = p - 100 + 8;
+		}
+	}
+}
+
+/*
+	Carries out the control sequence in seq, which ended in final
+*/
+static void vterm_csi(VTerm *vt, const unsigned char final)
+{
+	unsigned int params[VTERM_PARAMS_MAX] = { 0 };
+	uint8_t count = 0, i, private = 0;
+	size_t cursor = (size_t) vt->row * vt->cols + vt->col, row = (size_t) vt->row * vt->cols;
+	unsigned int n;
+
+	for (i = 0; i < vt->seq_length; ++i) {
+		if (vt->seq[i] >= '0' && vt->seq[i] <= '9') {
+			if (count == 0)
+				count = 1;
+			if (count <= VTERM_PARAMS_MAX)
+				params[count - 1] = params[count - 1] * 10 + (vt->seq[i] - '0');
+		} else if (vt->seq[i] == ';') {
+			if (count == 0)
+				count = 1;
+			++count;
+		} else {
+			private = 1;
+		}
+	}
+	if (count > VTERM_PARAMS_MAX)
+		count = VTERM_PARAMS_MAX;
+
+	/* Modes and the like don't change the grid */
+	if (private)
+		return;
+
+	n = (params[0] > 0) ? params[0] : 1;
+	switch (final) {
+	case 'H':
+	case 'f':
+		vt->row = (params[0] > 0) ? params[0] - 1 : 0;
+		vt->col = (params[1] > 0) ? params[1] - 1 : 0;
+		if (vt->row >= vt->rows)
+			vt->row = vt->rows - 1;
+		if (vt->col >= vt->cols)
+			vt->col = vt->cols - 1;
+		vt->wrap = 0;
+		++vt->stats.moves;
+	break;
+
+	case 'A':
+		vt->row = (vt->row > n) ? vt->row - n : 0;
+		vt->wrap = 0;
+		++vt->stats.moves;
+	break;
+
+	case 'B':
+		vt->row = (vt->row + n < vt->rows) ? vt->row + n : vt->rows - 1;
+		vt->wrap = 0;
+		++vt->stats.moves;
+	break;
+
+	case 'C':
+		vt->col = (vt->col + n < vt->cols) ? vt->col + n : vt->cols - 1;
+		vt->wrap = 0;
+		++vt->stats.moves;
+	break;
+
+	case 'D':
+		vt->col = (vt->col > n) ? vt->col - n : 0;
+		vt->wrap = 0;
+		++vt->stats.moves;
+	break;
+
+	case 'J':
+		if (params[0] == 0)
+			vterm_erase(vt, cursor, (size_t) vt->rows * vt->cols);
+		else if (params[0] == 1)
+			vterm_erase(vt, 0, cursor + 1);
+		else
+			vterm_erase(vt, 0, (size_t) vt->rows * vt->cols);
+		if (params[0] >= 2)
+			++vt->stats.clears;
+		else
+			++vt->stats.erases;
+	break;
+
+	case 'K':
+		if (params[0] == 0)
+			vterm_erase(vt, cursor, row + vt->cols);
+		else if (params[0] == 1)
+			vterm_erase(vt, row, cursor + 1);
+		else
+			vterm_erase(vt, row, row + vt->cols);
+		++vt->stats.erases;
+	break;
+
+	case 'm':
+		vterm_sgr(vt, params, count);
+	break;
+	}
+}
+
+/*
+	Handles a byte of text: bytes of a character are gathered in pending
+	until it is whole
+*/
+static void vterm_text(VTerm *vt, const unsigned char c)
+{
+	uint32_t cp;
+	uint8_t n;
+
+	if (vt->pending_length > 0) {
+		if (utf8_is_continuation(c)) {
+			vt->pending[vt->pending_length++] = c;
+			if (vt->pending_length < utf8_sequence_length(vt->pending[0]))
+				return;
+			n = utf8_decode(vt->pending, vt->pending_length, &cp);
+			if (n == vt->pending_length)
+				vterm_put(vt, vt->pending, n, cp);
+			else
+				vterm_put_invalid(vt);
+			vt->pending_length = 0;
+			return;
+		}
+		vterm_put_invalid(vt);
+	}
+
+	if (c < 0x80) {
+		vterm_put(vt, &c, 1, c);
+	} else if (utf8_sequence_length(c) > 1) {
+		vt->pending[0] = c;
+		vt->pending_length = 1;
+	} else {
+		vterm_put_invalid(vt);
+	}
+}
+
+void vterm_feed(VTerm *vt, const unsigned char *data, const size_t len)
+{
+	unsigned char c;
+	size_t i;
+
+	++vt->stats.writes;
+	vt->stats.bytes += len;
+
+	for (i = 0; i < len; ++i) {
+		c = data[i];
+		switch (vt->state) {
+		case VTERM_ESC:
+			vt->state = (c == '[') ? VTERM_CSI : VTERM_GROUND;
+			vt->seq_length = 0;
+		break;
+
+		case VTERM_CSI:
+			if (c >= 0x40 && c <= 0x7E) {
+				vterm_csi(vt, c);
+				vt->state = VTERM_GROUND;
+			} else if (vt->seq_length < VTERM_SEQ_MAX) {
+				vt->seq[vt->seq_length++] = c;
+			}
+		break;
+
+		case VTERM_GROUND:
+			if (c >= 0x20 && c != 0x7F) {
+				vterm_text(vt, c);
+				break;
+			}
+			if (vt->pending_length > 0)
+				vterm_put_invalid(vt);
+
+			if (c == 0x1B) {
+				vt->state = VTERM_ESC;
+			} else if (c == '\r') {
+				vt->col = 0;
+				vt->wrap = 0;
+			} else if (c == '\n') {
+				vterm_linefeed(vt);
+				vt->wrap = 0;
+			} else if (c == '\b') {
+				if (vt->col > 0 && !vt->wrap)
+					--vt->col;
+				vt->wrap = 0;
+			} else if (c == '\t') {
+				vt->col = (vt->col / 8 + 1) * 8;
+				if (vt->col >= vt->cols)
+					vt->col = vt->cols - 1;
+			}
+		break;
+		}
+	}
+}
+
+size_t vterm_row_text(const VTerm *vt, const uint16_t row, char *buf, const size_t size)
+{
+	const VTermCell *cell = vterm_cell(vt, row, 0);
+	size_t len = 0, end = 0, n;
+	uint16_t col;
+
+	if (size == 0)
+		return 0;
+
+	for (col = 0; col < vt->cols; ++col, ++cell) {
+		if (cell->glyph[0] == VTERM_GLYPH_WIDE)
+			continue;
+		if (cell->glyph[0] == '\0') {
+			if (len + 1 >= size)
+				break;
+			buf[len++] = ' ';
+			continue;
+		}
+		for (n = 0; n < VTERM_GLYPH_MAX && cell->glyph[n] != '\0'; ++n);
+		if (len + n >= size)
+			break;
+		memcpy(buf + len, cell->glyph, n);
+		len += n;
+		if (n > 1 || cell->glyph[0] != ' ')
+			end = len;
+	}
+
+	/* Trailing blanks are the same as nothing */
+	while (len > end && buf[len - 1] == ' ')
+		--len;
+	buf[len] = '\0';
+	return len;
+}
@@ -0,0 +1,134 @@
+#ifndef _VTERM_H_INCLUDED
+#define _VTERM_H_INCLUDED
+
+#include <stdint.h>
+#include <stddef.h>
+
+/**
+ *	Most bytes of UTF-8 a cell of the virtual terminal holds
+ */
+#define VTERM_GLYPH_MAX	8
+
+/**
+ *	What the cell to the right of a wide character holds
+ */
+#define VTERM_GLYPH_WIDE	0xFF
+
+/**
+ *	Longest control sequence the parser keeps; anything longer is
+ *	skipped up to its final byte
+ */
+#define VTERM_SEQ_MAX	32
+
+/**
+ *	Flags of the pen, set and cleared by SGR sequences
+ */
+enum {
+	VTERM_BOLD = 0x01,
+	VTERM_UNDERLINED = 0x02,
+	VTERM_BLINKING = 0x04,
+	VTERM_REVERSED = 0x08,
+	VTERM_CONCEALED = 0x10
+};
+
+/**
+ *	Colour of a pen that was never given one
+ */
+#define VTERM_DEFAULT	0xFF
+
+/**
+ *	What the pen draws with: flags and the two colours, each one of the
+ *	8 basic ones (16 with the bright ones) or VTERM_DEFAULT
+ */
+typedef struct _vterm_pen {
+	uint8_t flags;
+	uint8_t fg;
+	uint8_t bg;
+} VTermPen;
+
+/**
+ *	A character cell: the UTF-8 shown in it, NUL-padded (empty if it was
+ *	never written to or was erased), and the pen it was drawn with
+ */
+typedef struct _vterm_cell {
+	unsigned char glyph[VTERM_GLYPH_MAX];
+	VTermPen pen;
+} VTermCell;
+
+/**
+ *	What the terminal was asked to do, as counted by the parser
+ */
+typedef struct _vterm_stats {
+	uint64_t bytes;
+	uint64_t writes;
+	uint64_t glyphs;
+	uint64_t moves;
+	uint64_t sgr;
+	uint64_t erases;
+	uint64_t clears;
+} VTermStats;
+
+/**
+ *	States of the escape sequence parser
+ *		1. VTERM_GROUND - text and C0 controls
+ *		2. VTERM_ESC - saw ESC
+ *		3. VTERM_CSI - inside ESC [ ...
+ */
+typedef enum _vterm_state {
+	VTERM_GROUND, VTERM_ESC, VTERM_CSI
+} VTermState;
+
+/**
+ *	Represents a terminal that only exists in memory
+ *	Whatever is fed to it is parsed the way a VT100-style terminal
+ *	would: text lands in cells (a single row-major array of rows * cols
+ *	of them) at the cursor, and the control sequences the screen sends
+ *	move the cursor, erase and change the pen. Like a real terminal, the
+ *	cursor stays on the last column after it is written to, and only
+ *	wraps (wrap set) once more text comes. Characters split across two
+ *	writes are put together in pending. stats counts what was done
+ */
+typedef struct _vterm {
+	VTermCell *cells;
+	uint16_t rows;
+	uint16_t cols;
+	uint16_t row;
+	uint16_t col;
+	uint8_t wrap;
+	VTermPen pen;
+	VTermState state;
+	unsigned char seq[VTERM_SEQ_MAX];
+	uint8_t seq_length;
+	unsigned char pending[4];
+	uint8_t pending_length;
+	VTermStats stats;
+} VTerm;
+
+/**
+ *	Create a blank virtual terminal of rows by cols
+ */
+extern uint8_t vterm_new(VTerm *vt, const uint16_t rows, const uint16_t cols);
+
+/**
+ *	Deletes the virtual terminal
+ */
+extern void vterm_release(VTerm *vt);
+
+/**
+ *	Parse len bytes of output, as one write
+ */
+extern void vterm_feed(VTerm *vt, const unsigned char *data, const size_t len);
+
+/**
+ *	Get a cell of the grid
+ */
+extern const VTermCell *vterm_cell(const VTerm *vt, const uint16_t row, const uint16_t col);
+
+/**
+ *	Copy the text of a row into buf as UTF-8, with blanks for empty
+ *	cells and without trailing ones. Returns the length of the text,
+ *	which is cut off to fit size - 1 bytes and NUL-terminated
+ */
+extern size_t vterm_row_text(const VTerm *vt, const uint16_t row, char *buf, const size_t size);
+
+#endif /* _VTERM_H_INCLUDED */